@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -24,6 +25,7 @@ enum {
     TNEWLINE,
     TSPACE,
     TMACRO_PARAM,
+    THEADER_NAME, // #include operand, only in the header cache
 };
 
 enum {
@@ -34,13 +36,22 @@ enum {
     ENC_WCHAR,
 };
 
+typedef struct {
+    uint32_t hash;
+    char *key;
+    void *val;
+} MapSlot;
+
 typedef struct Map {
     struct Map *parent;
-    char **key;
-    void **val;
+    uint8_t *ctrl;   // control bytes, one per slot (see map.c)
+    MapSlot *slots;
+    char **keys;     // keys and values of an interned map
+    void **vals;
     int size;
     int nelem;
     int nused;
+    bool interned; // true if all keys are interned strings
 } Map;
 
 typedef struct {
@@ -54,9 +65,20 @@ typedef struct {
     Vector *key;
 } Dict;
 
+// A symbol table for nested scopes, keyed by interned strings; see scope.c.
+typedef struct {
+    Map map;    // name -> innermost visible Binding
+    Vector log; // Bindings made in open block scopes, innermost last
+    int depth;  // number of open block scopes
+    int hidden; // block scopes up to this depth are hidden
+} Scope;
+
+// A set of interned strings, stored as a sorted array of their intern IDs.
+// Sets are hash-consed; see set.c.
 typedef struct Set {
-    char *v;
-    struct Set *next;
+    int len;
+    uint32_t hash;
+    int ids[];
 } Set;
 
 typedef struct {
@@ -67,7 +89,10 @@ typedef struct {
 
 typedef struct {
     FILE *file;  // stream backed by FILE *
-    char *p;     // stream backed by string
+    char *p;     // stream backed by string or memory-mapped file
+    char *end;   // end of the mapped region. NULL if string-backed
+    void *map;   // the mapping, until the file is closed
+    size_t maplen;
     char *name;
     int line;
     int column;
@@ -76,6 +101,12 @@ typedef struct {
     int buf[3];   // push-back buffer for unread operations
     int buflen;   // push-back buffer size
     time_t mtime; // last modified time. 0 if string-backed file
+    long nread;   // number of bytes consumed, for -fstat-io
+    int nsyscall; // number of I/O system calls made, for -fstat-io
+    Vector *tokens; // pre-lexed content if replayed from the header cache
+    int tokpos;     // next token to return from tokens
+    bool preprocessed; // tokens came from a token stream (tokstream.c)
+    long nsec;      // time spent reading this file, for -ftime-report
 } File;
 
 typedef struct {
@@ -128,6 +159,7 @@ enum {
     AST_GOTO,
     AST_COMPUTED_GOTO,
     AST_LABEL,
+    AST_SWITCH,
     OP_SIZEOF,
     OP_CAST,
     OP_SHR,
@@ -195,6 +227,28 @@ typedef struct {
     int line;
 } SourceLoc;
 
+// An error or a warning, collected by the library interface instead of
+// being printed
+typedef struct {
+    bool error;
+    char *pos; // "file:line:column", or NULL if unknown
+    char *msg;
+} Diagnostic;
+
+// How a switch statement dispatches to its case labels
+enum {
+    SWITCH_LINEAR,  // a compare for each case
+    SWITCH_BSEARCH, // binary search over sorted cases
+    SWITCH_TABLE,   // indirect jump through a table
+};
+
+// A case label. beg and end are the same unless it's a [GNU] case range.
+typedef struct {
+    long beg;
+    long end;
+    char *label;
+} Case;
+
 typedef struct Node {
     int kind;
     Type *ty;
@@ -218,6 +272,7 @@ typedef struct Node {
             // local
             int loff;
             Vector *lvarinit;
+            char *lreg; // register holding the variable at -O1, or NULL
             // global
             char *glabel;
         };
@@ -265,6 +320,13 @@ typedef struct Node {
             char *label;
             char *newlabel;
         };
+        // Switch statement
+        struct {
+            struct Node *switchvar;
+            Vector *cases;
+            char *defaultlabel;
+            int strategy;
+        };
         // Return statement
         struct Node *retval;
         // Compound statement
@@ -295,13 +357,34 @@ extern Type *type_double;
 extern Type *type_ldouble;
 
 #define EMPTY_MAP ((Map){})
+#define EMPTY_INTERNED_MAP ((Map){ .interned = true })
 #define EMPTY_VECTOR ((Vector){})
+#define EMPTY_SCOPE ((Scope){ .map = { .interned = true } })
+
+// arena.c
+enum {
+    ARENA_TOKEN,
+    ARENA_AST,
+    ARENA_TYPE,
+    ARENA_STRING,
+};
+
+extern bool mem_stats;
+
+void *arena_alloc(int kind, size_t size);
+void print_mem_stats(void);
 
 // encoding.c
 Buffer *to_utf16(char *p, int len);
 Buffer *to_utf32(char *p, int len);
 void write_utf8(Buffer *b, uint32_t rune);
 
+// asm.c
+extern bool integrated_as;
+
+bool assemble_to_buffer(Buffer *text, Buffer *out);
+bool assemble(Buffer *text, char *filename);
+
 // buffer.c
 Buffer *make_buffer(void);
 char *buf_body(Buffer *b);
@@ -315,15 +398,29 @@ char *quote_cstring(char *p);
 char *quote_cstring_len(char *p, int len);
 char *quote_char(char c);
 
+// context.c
+typedef struct CompilerContext CompilerContext;
+
+CompilerContext *make_context(void);
+void enter_context(CompilerContext *ctx);
+void leave_context(void);
+
 // cpp.c
+extern bool macro_stats;
+
 void read_from_string(char *buf);
 bool is_ident(Token *tok, char *s);
 void expect_newline(void);
+void set_base_file(char *path);
 void add_include_path(char *path);
+void print_include_stat(void);
+void print_macro_stats(void);
 void init_now(void);
 void cpp_init(void);
 Token *peek_token(void);
 Token *read_token(void);
+void *cpp_save_state(void);
+void cpp_restore_state(void *state);
 
 // debug.c
 char *ty2s(Type *ty);
@@ -341,6 +438,9 @@ extern bool enable_warning;
 extern bool dumpstack;
 extern bool dumpsource;
 extern bool warning_is_error;
+extern jmp_buf *error_jmp;
+extern Vector *diagnostics;
+extern jmp_buf *diag_jmp;
 
 #define STR2(x) #x
 #define STR(x) STR2(x)
@@ -352,27 +452,61 @@ extern bool warning_is_error;
 noreturn void errorf(char *line, char *pos, char *fmt, ...);
 void warnf(char *line, char *pos, char *fmt, ...);
 char *token_pos(Token *tok);
+void *error_save_state(void);
+void error_restore_state(void *state);
 
 // file.c
+extern bool stat_io;
+
 File *make_file(FILE *file, char *name);
 File *make_file_string(char *s);
+File *make_file_tokens(char *name, time_t mtime);
+void close_file(File *f);
 int readc(void);
 void unreadc(int c);
 File *current_file(void);
 void stream_push(File *file);
+void stream_pop(void);
 int stream_depth(void);
 char *input_position(void);
 void stream_stash(File *f);
 void stream_unstash(void);
+void stream_close_all(void);
+void print_stat_io(void);
+void *file_save_state(void);
+void file_restore_state(void *state);
 
 // gen.c
+extern int optimize_level;
+
 void set_output_file(FILE *fp);
+void set_output_buffer(Buffer *b);
 void close_output_file(void);
 void emit_toplevel(Node *v);
+void *gen_save_state(void);
+void gen_restore_state(void *state);
+
+// hcache.c
+extern char *header_cache_dir;
+
+File *hcache_open(FILE *fp, char *path);
+
+// inline.c
+extern bool dump_inline;
+extern int inline_limit;
+void inline_functions(Vector *toplevels);
+void *inline_save_state(void);
+void inline_restore_state(void *state);
+
+// intern.c
+char *intern(char *s);
+char *intern_len(char *s, int len);
+uint32_t intern_hash(char *s);
+int intern_id(char *s);
 
 // lex.c
-void lex_init(char *filename);
-char *get_base_file(void);
+void lex_init(void);
+void lex_open(char *filename);
 void skip_cond_incl(void);
 char *read_header_file_name(bool *std);
 bool is_keyword(Token *tok, int c);
@@ -380,27 +514,66 @@ void token_buffer_stash(Vector *buf);
 void token_buffer_unstash();
 void unget_token(Token *tok);
 Token *lex_string(char *s);
+Vector *lex_all(File *f);
 Token *lex(void);
+void *lex_save_state(void);
+void lex_restore_state(void *state);
+
+// lib8cc.c
+enum { OUTPUT_ASM, OUTPUT_OBJ };
+
+bool compile_string(char *name, char *src, int output, Buffer *out, Vector *diags);
 
 // map.c
+uint32_t hash_bytes(char *p, int len);
 Map *make_map(void);
+Map *make_interned_map(void);
 Map *make_map_parent(Map *parent);
 void *map_get(Map *m, char *key);
 void map_put(Map *m, char *key, void *val);
 void map_remove(Map *m, char *key);
 size_t map_len(Map *m);
 
+// opt.c
+Vector *optimize(Vector *toplevels);
+void *opt_save_state(void);
+void opt_restore_state(void *state);
+
 // parse.c
 char *make_tempname(void);
 char *make_label(void);
 bool is_inttype(Type *ty);
 bool is_flotype(Type *ty);
 void *make_pair(void *first, void *second);
-int eval_intexpr(Node *node, Node **addr);
+long eval_intexpr(Node *node, Node **addr);
 Node *read_expr(void);
 Vector *read_toplevels(void);
 void parse_init(void);
 char *fullpath(char *path);
+void *parse_save_state(void);
+void parse_restore_state(void *state);
+
+// peep.c
+extern bool dump_peephole;
+
+Vector *peephole(Vector *lines);
+void print_peephole_stats(void);
+void *peep_save_state(void);
+void peep_restore_state(void *state);
+
+// regalloc.c
+Vector *alloc_regs(Node *func);
+void *regalloc_save_state(void);
+void regalloc_restore_state(void *state);
+
+// scope.c
+Scope *make_scope(void);
+void scope_enter(Scope *s);
+void scope_leave(Scope *s);
+void *scope_get(Scope *s, char *name);
+void *scope_get_local(Scope *s, char *name);
+void scope_put(Scope *s, char *name, void *val);
+void scope_put_global(Scope *s, char *name, void *val);
 
 // set.c
 Set *set_add(Set *s, char *v);
@@ -408,6 +581,38 @@ bool set_has(Set *s, char *v);
 Set *set_union(Set *a, Set *b);
 Set *set_intersection(Set *a, Set *b);
 
+// timer.c
+enum {
+    TIMER_LEX,
+    TIMER_CPP,
+    TIMER_PARSE,
+    TIMER_GEN,
+    TIMER_SUBST,
+    TIMER_EXPAND_ALL,
+    TIMER_INCLUDE,
+    TIMER_READ_DECL,
+    TIMER_EMIT_EXPR,
+    NTIMERS,
+};
+
+extern bool time_report;
+
+// The timers are called from hot paths, so the flag is checked inline.
+#define timer_start(id) (time_report ? do_timer_start(id) : (void)0)
+#define timer_stop(id) (time_report ? do_timer_stop(id) : (void)0)
+
+void do_timer_start(int id);
+void do_timer_stop(int id);
+long timer_now(void);
+void timer_function(char *name);
+void print_time_report(void);
+
+// tokstream.c
+void write_token_stream(FILE *fp);
+File *tokstream_open(FILE *fp, char *name);
+void *tokstream_save_state(void);
+void tokstream_restore_state(void *state);
+
 // vector.c
 Vector *make_vector(void);
 Vector *make_vector1(void *e);
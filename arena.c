@@ -0,0 +1,81 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Arenas are bump-pointer allocators for objects that live until the
+ * compiler exits. As explained in buffer.c, 8cc never frees memory, so
+ * most of what malloc() does for us (headers, free lists, size classes)
+ * is wasted work. An arena instead grabs large chunks from the system and
+ * hands out consecutive pieces of them.
+ *
+ * There is one arena per kind of object (tokens, AST nodes, types and
+ * strings), so that -fmem-stats can tell which phase of the compiler is
+ * responsible for the memory we use.
+ *
+ * Memory returned by arena_alloc() is zero-filled.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+#define CHUNK_SIZE (256 * 1024)
+
+// Objects larger than this get their own chunk, so that a single huge
+// allocation doesn't waste the rest of the current chunk.
+#define LARGE_OBJECT (CHUNK_SIZE / 4)
+
+typedef struct {
+    char *name;
+    char *p;      // next free byte in the current chunk
+    char *end;    // end of the current chunk
+    long nbytes;  // bytes handed out
+    long nobjs;   // number of allocations
+    long nchunks; // number of chunks obtained from the system
+} Arena;
+
+bool mem_stats = false;
+
+static Arena arenas[] = {
+    [ARENA_TOKEN] = { "token" },
+    [ARENA_AST] = { "ast" },
+    [ARENA_TYPE] = { "type" },
+    [ARENA_STRING] = { "string" },
+};
+
+static void *new_chunk(Arena *a, size_t size) {
+    char *r = calloc(1, size);
+    if (!r)
+        error("out of memory: %s arena", a->name);
+    a->nchunks++;
+    return r;
+}
+
+void *arena_alloc(int kind, size_t size) {
+    Arena *a = &arenas[kind];
+    // Keep every object 8-byte aligned, which is enough for anything
+    // the compiler itself stores.
+    size = (size + 7) & ~(size_t)7;
+    a->nbytes += size;
+    a->nobjs++;
+    if (size > LARGE_OBJECT)
+        return new_chunk(a, size);
+    if (a->end - a->p < size) {
+        a->p = new_chunk(a, CHUNK_SIZE);
+        a->end = a->p + CHUNK_SIZE;
+    }
+    void *r = a->p;
+    a->p += size;
+    return r;
+}
+
+void print_mem_stats() {
+    long bytes = 0, objs = 0;
+    fprintf(stderr, "mem-stats: %-8s %12s %10s %7s\n", "arena", "bytes", "objects", "chunks");
+    for (int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++) {
+        Arena *a = &arenas[i];
+        fprintf(stderr, "mem-stats: %-8s %12ld %10ld %7ld\n", a->name, a->nbytes, a->nobjs, a->nchunks);
+        bytes += a->nbytes;
+        objs += a->nobjs;
+    }
+    fprintf(stderr, "mem-stats: %-8s %12ld %10ld\n", "total", bytes, objs);
+}
@@ -0,0 +1,1231 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Integrated assembler
+ *
+ * Usually 8cc writes assembly to a temporary file and runs as(1) on it,
+ * which costs a process spawn and a round trip through a text file for
+ * every object file. With -fintegrated-as, the assembly is kept in
+ * memory instead, and this file translates it to x86-64 machine code and
+ * writes an ELF64 relocatable object file.
+ *
+ * This is not a general-purpose assembler. It understands the subset of
+ * the GNU assembler syntax gen.c emits and nothing else. If it sees
+ * anything it doesn't know, assemble() returns false, and the caller
+ * falls back to as(1), so an unusual instruction never breaks a build.
+ *
+ * The output differs from as(1)'s in a few ways. Jumps are always
+ * encoded in their 32-bit forms, because we don't do branch relaxation.
+ * .file and .loc directives are ignored, so there's no line number
+ * information. And the object has a .note.GNU-stack section, so that the
+ * linker doesn't make the stack executable.
+ *
+ * Section contents are built per subsection (".data 1" and so on) and
+ * concatenated in subsection order at the end. Symbol offsets and
+ * relocations are therefore recorded relative to their subsection, and
+ * resolved after all input has been read.
+ */
+
+#include <elf.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+bool integrated_as = false;
+
+enum { SEC_UNDEF, SEC_TEXT, SEC_DATA, SEC_BSS, NSECTIONS };
+
+enum { OPD_REG = 1, OPD_XMM, OPD_IMM, OPD_MEM };
+
+typedef struct {
+    char *name;
+    int sect;
+    int subsec;
+    long off;
+    bool global;
+    int index; // index in the ELF symbol table
+} Symbol;
+
+typedef struct {
+    int kind;
+    int reg;   // register number, or base register of a memory operand
+    int size;  // register size in bytes
+    int index; // index register of a memory operand, or -1
+    int scale;
+    bool rip;
+    bool indirect; // "*%reg" operand of jmp or call
+    long val;      // immediate or displacement
+    Symbol *sym;   // symbol in an immediate or displacement
+} Operand;
+
+// A field that refers to a symbol and is filled in at the end.
+typedef struct {
+    int sect;
+    int subsec;
+    long off;
+    int size;
+    int type;      // ELF relocation type
+    Symbol *sym;
+    Symbol *minus; // for "a-b"
+    long addend;
+} Fixup;
+
+// Instructions other than conditional ones, which are I_JCC and I_SETCC
+// with the condition code in bits 8 and above.
+enum {
+    I_ALU = 1, I_TEST, I_MOV, I_MOVX, I_LEA, I_IMUL, I_UNARY, I_SHIFT,
+    I_JCC, I_SETCC, I_JMP, I_CALL, I_PUSH, I_POP, I_FIXED, I_SSE, I_CVT2SI,
+    I_CVTSI2,
+};
+
+typedef struct {
+    char *name;
+    int kind;
+    int pfx;    // mandatory prefix of SSE instructions
+    int opcode; // up to 3 bytes, most significant first
+    int ext;    // opcode extension in ModR/M, or a size for some kinds
+} Mnemonic;
+
+static Mnemonic MNEMONICS[] = {
+    { "add", I_ALU, 0, 0x00, 0 },
+    { "or", I_ALU, 0, 0x08, 1 },
+    { "and", I_ALU, 0, 0x20, 4 },
+    { "sub", I_ALU, 0, 0x28, 5 },
+    { "xor", I_ALU, 0, 0x30, 6 },
+    { "cmp", I_ALU, 0, 0x38, 7 },
+    { "test", I_TEST, 0, 0, 0 },
+    { "mov", I_MOV, 0, 0, 0 },
+    { "movzb", I_MOVX, 0, 0x0FB6, 1 },
+    { "movzbl", I_MOVX, 0, 0x0FB6, 1 },
+    { "movzbq", I_MOVX, 0, 0x0FB6, 1 },
+    { "movzwq", I_MOVX, 0, 0x0FB7, 2 },
+    { "movsbq", I_MOVX, 0, 0x0FBE, 1 },
+    { "movswq", I_MOVX, 0, 0x0FBF, 2 },
+    { "movslq", I_MOVX, 0, 0x63, 4 },
+    { "movzx", I_MOVX, 0, 0x0FB6, 0 },
+    { "lea", I_LEA, 0, 0, 0 },
+    { "imul", I_IMUL, 0, 0, 0 },
+    { "not", I_UNARY, 0, 0xF7, 2 },
+    { "neg", I_UNARY, 0, 0xF7, 3 },
+    { "div", I_UNARY, 0, 0xF7, 6 },
+    { "idiv", I_UNARY, 0, 0xF7, 7 },
+    { "sal", I_SHIFT, 0, 0, 4 },
+    { "shl", I_SHIFT, 0, 0, 4 },
+    { "shr", I_SHIFT, 0, 0, 5 },
+    { "sar", I_SHIFT, 0, 0, 7 },
+    { "jmp", I_JMP, 0, 0, 0 },
+    { "call", I_CALL, 0, 0, 0 },
+    { "push", I_PUSH, 0, 0, 0 },
+    { "pop", I_POP, 0, 0, 0 },
+    { "cqto", I_FIXED, 0, 0x4899, 0 },
+    { "cltq", I_FIXED, 0, 0x4898, 0 },
+    { "leave", I_FIXED, 0, 0xC9, 0 },
+    { "ret", I_FIXED, 0, 0xC3, 0 },
+    { "nop", I_FIXED, 0, 0x90, 0 },
+    { "movss", I_SSE, 0xF3, 0x0F10, 0 },
+    { "movsd", I_SSE, 0xF2, 0x0F10, 0 },
+    { "movaps", I_SSE, 0, 0x0F28, 0 },
+    { "addss", I_SSE, 0xF3, 0x0F58, 0 },
+    { "addsd", I_SSE, 0xF2, 0x0F58, 0 },
+    { "subss", I_SSE, 0xF3, 0x0F5C, 0 },
+    { "subsd", I_SSE, 0xF2, 0x0F5C, 0 },
+    { "mulss", I_SSE, 0xF3, 0x0F59, 0 },
+    { "mulsd", I_SSE, 0xF2, 0x0F59, 0 },
+    { "divss", I_SSE, 0xF3, 0x0F5E, 0 },
+    { "divsd", I_SSE, 0xF2, 0x0F5E, 0 },
+    { "ucomiss", I_SSE, 0, 0x0F2E, 0 },
+    { "ucomisd", I_SSE, 0x66, 0x0F2E, 0 },
+    { "xorps", I_SSE, 0, 0x0F57, 0 },
+    { "xorpd", I_SSE, 0x66, 0x0F57, 0 },
+    { "cvtps2pd", I_SSE, 0, 0x0F5A, 0 },
+    { "cvtpd2ps", I_SSE, 0x66, 0x0F5A, 0 },
+    { "cvtss2sd", I_SSE, 0xF3, 0x0F5A, 0 },
+    { "cvtsd2ss", I_SSE, 0xF2, 0x0F5A, 0 },
+    { "cvttss2si", I_CVT2SI, 0xF3, 0x0F2C, 0 },
+    { "cvttsd2si", I_CVT2SI, 0xF2, 0x0F2C, 0 },
+    { "cvtsi2ss", I_CVTSI2, 0xF3, 0x0F2A, 0 },
+    { "cvtsi2sd", I_CVTSI2, 0xF2, 0x0F2A, 0 },
+};
+
+static char *CONDS[] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a",
+    "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+// Aliases of the condition codes above
+static char *COND_ALIASES[][2] = {
+    { "c", "b" }, { "nae", "b" }, { "nb", "ae" }, { "nc", "ae" },
+    { "z", "e" }, { "nz", "ne" }, { "na", "be" }, { "nbe", "a" },
+    { "pe", "p" }, { "po", "np" }, { "nge", "l" }, { "nl", "ge" },
+    { "ng", "le" }, { "nle", "g" },
+};
+
+static char *REGS[4][16] = {
+    { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+      "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" },
+    { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+      "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" },
+    { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+      "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" },
+    { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+      "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" },
+};
+
+static Map *mnemonics;
+static Map *registers;
+
+static Vector *subsecs[NSECTIONS]; // Buffers of each subsection
+static long bss_size;
+static Map *symbols;
+static Vector *symlist;
+static Vector *fixups;
+static int cursect;
+static int cursubsec;
+static Buffer *curbuf;
+static jmp_buf fail;
+
+/*
+ * Tables
+ */
+
+static void init_tables() {
+    if (mnemonics)
+        return;
+    mnemonics = make_interned_map();
+    for (int i = 0; i < sizeof(MNEMONICS) / sizeof(*MNEMONICS); i++)
+        map_put(mnemonics, intern(MNEMONICS[i].name), &MNEMONICS[i]);
+    for (int i = 0; i < 16; i++) {
+        Mnemonic *j = calloc(1, sizeof(Mnemonic));
+        *j = (Mnemonic){ intern(format("j%s", CONDS[i])), I_JCC | (i << 8) };
+        map_put(mnemonics, j->name, j);
+        Mnemonic *set = calloc(1, sizeof(Mnemonic));
+        *set = (Mnemonic){ intern(format("set%s", CONDS[i])), I_SETCC | (i << 8) };
+        map_put(mnemonics, set->name, set);
+    }
+    for (int i = 0; i < sizeof(COND_ALIASES) / sizeof(*COND_ALIASES); i++) {
+        char *alias = COND_ALIASES[i][0];
+        char *cond = COND_ALIASES[i][1];
+        map_put(mnemonics, intern(format("j%s", alias)), map_get(mnemonics, intern(format("j%s", cond))));
+        map_put(mnemonics, intern(format("set%s", alias)), map_get(mnemonics, intern(format("set%s", cond))));
+    }
+
+    // Registers are stored as (size << 8 | number) + 1 so that none is 0.
+    registers = make_interned_map();
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 16; j++)
+            map_put(registers, intern(REGS[i][j]), (void *)(intptr_t)(((1 << i) << 8 | j) + 1));
+    for (int i = 0; i < 16; i++)
+        map_put(registers, intern(format("xmm%d", i)), (void *)(intptr_t)((16 << 8 | i) + 1));
+    map_put(registers, intern("rip"), (void *)(intptr_t)((8 << 8 | 16) + 1));
+}
+
+/*
+ * Output
+ */
+
+static void set_section(int sect, int subsec) {
+    Vector *v = subsecs[sect];
+    while (vec_len(v) <= subsec)
+        vec_push(v, make_buffer());
+    cursect = sect;
+    cursubsec = subsec;
+    curbuf = vec_get(v, subsec);
+}
+
+static Buffer *cur() {
+    return curbuf;
+}
+
+static long here() {
+    return buf_len(cur());
+}
+
+static void byte(int c) {
+    buf_write(cur(), c);
+}
+
+static void put_le(long v, int size) {
+    for (int i = 0; i < size; i++)
+        byte(v >> (i * 8));
+}
+
+static void put_opcode(int opcode) {
+    if (opcode > 0xFFFF)
+        byte(opcode >> 16);
+    if (opcode > 0xFF)
+        byte(opcode >> 8);
+    byte(opcode);
+}
+
+static Symbol *get_symbol(char *name) {
+    Symbol *sym = map_get(symbols, name);
+    if (sym)
+        return sym;
+    sym = calloc(1, sizeof(Symbol));
+    sym->name = name;
+    map_put(symbols, name, sym);
+    vec_push(symlist, sym);
+    return sym;
+}
+
+static void add_fixup(int type, int size, Symbol *sym, Symbol *minus, long addend) {
+    Fixup *f = calloc(1, sizeof(Fixup));
+    *f = (Fixup){ cursect, cursubsec, here(), size, type, sym, minus, addend };
+    vec_push(fixups, f);
+    put_le(0, size);
+}
+
+/*
+ * Parser
+ */
+
+static void skip_space(char **p) {
+    while (**p == ' ' || **p == '\t')
+        (*p)++;
+}
+
+static bool is_symbol_char(char c) {
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9')
+        || c == '_' || c == '.' || c == '$';
+}
+
+static char *read_name(char **p) {
+    char *start = *p;
+    while (is_symbol_char(**p))
+        (*p)++;
+    if (*p == start)
+        longjmp(fail, 1);
+    return intern_len(start, *p - start);
+}
+
+static long read_number(char **p) {
+    bool neg = false;
+    if (**p == '-' || **p == '+') {
+        neg = (**p == '-');
+        (*p)++;
+    }
+    if (**p < '0' || '9' < **p)
+        longjmp(fail, 1);
+    char *end;
+    unsigned long v = strtoul(*p, &end, ((*p)[0] == '0' && (*p)[1] == 'x') ? 16 : 10);
+    *p = end;
+    return neg ? -(long)v : (long)v;
+}
+
+// Reads "number", "symbol" or "symbol+number".
+static void read_asm_expr(char **p, Symbol **sym, long *val) {
+    *sym = NULL;
+    *val = 0;
+    skip_space(p);
+    if (**p == '-' || **p == '+' || ('0' <= **p && **p <= '9')) {
+        *val = read_number(p);
+        return;
+    }
+    *sym = get_symbol(read_name(p));
+    if ((**p == '+' || **p == '-') && '0' <= (*p)[1] && (*p)[1] <= '9') {
+        if (**p == '+')
+            (*p)++;
+        *val = read_number(p);
+    }
+}
+
+static int read_register(char **p, int *size) {
+    (*p)++; // skip '%'
+    char *start = *p;
+    while (is_symbol_char(**p))
+        (*p)++;
+    int r = (intptr_t)map_get(registers, intern_len(start, *p - start));
+    if (!r)
+        longjmp(fail, 1);
+    r--;
+    *size = r >> 8;
+    return r & 0xFF;
+}
+
+static void read_operand(char **p, Operand *op) {
+    *op = (Operand){ .reg = -1, .index = -1, .scale = 1 };
+    skip_space(p);
+    if (**p == '*') {
+        op->indirect = true;
+        (*p)++;
+    }
+    if (**p == '%') {
+        op->reg = read_register(p, &op->size);
+        op->kind = (op->size == 16) ? OPD_XMM : OPD_REG;
+        if (op->size == 16 || op->reg == 16)
+            op->size = 0;
+        if (op->reg == 16)
+            longjmp(fail, 1);
+        return;
+    }
+    if (**p == '$') {
+        (*p)++;
+        op->kind = OPD_IMM;
+        read_asm_expr(p, &op->sym, &op->val);
+        return;
+    }
+    op->kind = OPD_MEM;
+    if (**p != '(')
+        read_asm_expr(p, &op->sym, &op->val);
+    if (**p != '(') {
+        // An absolute address, which is only valid as a branch target.
+        return;
+    }
+    (*p)++;
+    int size;
+    op->reg = read_register(p, &size);
+    if (op->reg == 16) {
+        op->rip = true;
+        op->reg = -1;
+    } else if (size != 8) {
+        longjmp(fail, 1);
+    }
+    if (**p == ',') {
+        (*p)++;
+        op->index = read_register(p, &size);
+        if (size != 8 || op->index == 4 || op->index == 16)
+            longjmp(fail, 1);
+        if (**p == ',') {
+            (*p)++;
+            op->scale = read_number(p);
+        }
+    }
+    if (**p != ')')
+        longjmp(fail, 1);
+    (*p)++;
+}
+
+/*
+ * Instruction encoder
+ */
+
+static bool needs_rex8(Operand *op) {
+    return op->kind == OPD_REG && op->size == 1 && 4 <= op->reg && op->reg <= 7;
+}
+
+// Emits an instruction with a ModR/M byte. reg is a register number or an
+// opcode extension, and rm is a register or memory operand. immlen is the
+// size of the immediate that follows, which RIP-relative addressing needs
+// to know.
+static void emit_rm(int pfx, bool w, bool rex8, int opcode, int reg, Operand *rm, int immlen) {
+    if (pfx)
+        byte(pfx);
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2);
+    if (rm->kind == OPD_MEM) {
+        if (rm->index >= 0)
+            rex |= (rm->index >> 3) << 1;
+        if (rm->reg >= 0)
+            rex |= rm->reg >> 3;
+    } else {
+        rex |= rm->reg >> 3;
+    }
+    if (rex != 0x40 || rex8)
+        byte(rex);
+    put_opcode(opcode);
+    reg &= 7;
+
+    if (rm->kind != OPD_MEM) {
+        byte(0xC0 | (reg << 3) | (rm->reg & 7));
+        return;
+    }
+    if (rm->rip) {
+        byte((reg << 3) | 5);
+        if (rm->sym)
+            add_fixup(R_X86_64_PC32, 4, rm->sym, NULL, rm->val - 4 - immlen);
+        else
+            put_le(rm->val, 4);
+        return;
+    }
+    long disp = rm->val;
+    if (rm->sym || rm->reg < 0 || disp != (int)disp)
+        longjmp(fail, 1);
+    int base = rm->reg & 7;
+    int mod = (disp == 0 && base != 5) ? 0 : (disp == (signed char)disp) ? 1 : 2;
+    if (rm->index >= 0 || base == 4) {
+        int scale;
+        switch (rm->scale) {
+        case 1: scale = 0; break;
+        case 2: scale = 1; break;
+        case 4: scale = 2; break;
+        case 8: scale = 3; break;
+        default: longjmp(fail, 1);
+        }
+        int index = (rm->index >= 0) ? (rm->index & 7) : 4;
+        byte((mod << 6) | (reg << 3) | 4);
+        byte((scale << 6) | (index << 3) | base);
+    } else {
+        byte((mod << 6) | (reg << 3) | base);
+    }
+    if (mod == 1)
+        byte(disp);
+    else if (mod == 2)
+        put_le(disp, 4);
+}
+
+// Emits an instruction whose operand size is given by size: an operand
+// size prefix for 16 bits, REX.W for 64 bits and the byte form of the
+// opcode (opcode - 1) for 8 bits.
+static void emit_sized(int size, int opcode, int reg, Operand *rm, bool rex8, int immlen) {
+    emit_rm(size == 2 ? 0x66 : 0, size == 8, rex8, size == 1 ? opcode - 1 : opcode, reg, rm, immlen);
+}
+
+static void emit_imm(Operand *op, int size) {
+    if (op->sym)
+        longjmp(fail, 1);
+    put_le(op->val, size);
+}
+
+static bool fits_imm(long v, int size) {
+    if (size == 8)
+        return v == (int)v;
+    if (size == 4)
+        return INT_MIN <= v && v <= UINT_MAX;
+    return -(1L << (size * 8 - 1)) <= v && v < (1L << (size * 8));
+}
+
+// Returns the operand size of an instruction: the size of its general
+// purpose register operand, or the size given by the mnemonic suffix.
+static int operand_size(Operand *ops, int nops, int suffix) {
+    for (int i = nops - 1; i >= 0; i--)
+        if (ops[i].kind == OPD_REG)
+            return ops[i].size;
+    switch (suffix) {
+    case 'b': return 1;
+    case 'w': return 2;
+    case 'l': return 4;
+    case 'q': return 8;
+    }
+    longjmp(fail, 1);
+}
+
+static void expect_nops(int nops, int n) {
+    if (nops != n)
+        longjmp(fail, 1);
+}
+
+static void assemble_alu(Mnemonic *m, Operand *ops, int nops, int size) {
+    expect_nops(nops, 2);
+    Operand *src = &ops[0], *dst = &ops[1];
+    if (src->kind == OPD_IMM) {
+        if (dst->kind == OPD_XMM || !fits_imm(src->val, size))
+            longjmp(fail, 1);
+        if (size == 1) {
+            emit_rm(0, false, needs_rex8(dst), 0x80, m->ext, dst, 1);
+            emit_imm(src, 1);
+        } else if (src->val == (signed char)src->val) {
+            emit_rm(size == 2 ? 0x66 : 0, size == 8, false, 0x83, m->ext, dst, 1);
+            emit_imm(src, 1);
+        } else {
+            int immlen = (size == 2) ? 2 : 4;
+            emit_rm(size == 2 ? 0x66 : 0, size == 8, false, 0x81, m->ext, dst, immlen);
+            emit_imm(src, immlen);
+        }
+        return;
+    }
+    bool rex8 = needs_rex8(src) || needs_rex8(dst);
+    if (src->kind == OPD_REG && dst->kind != OPD_IMM && dst->kind != OPD_XMM)
+        emit_sized(size, m->opcode + 1, src->reg, dst, rex8, 0);
+    else if (src->kind == OPD_MEM && dst->kind == OPD_REG)
+        emit_sized(size, m->opcode + 3, dst->reg, src, rex8, 0);
+    else
+        longjmp(fail, 1);
+}
+
+static void assemble_test(Operand *ops, int nops, int size) {
+    expect_nops(nops, 2);
+    Operand *src = &ops[0], *dst = &ops[1];
+    if (src->kind == OPD_IMM && dst->kind != OPD_XMM) {
+        int immlen = (size == 8) ? 4 : size;
+        if (!fits_imm(src->val, size))
+            longjmp(fail, 1);
+        emit_sized(size, 0xF7, 0, dst, needs_rex8(dst), immlen);
+        emit_imm(src, immlen);
+    } else if (src->kind == OPD_REG && (dst->kind == OPD_REG || dst->kind == OPD_MEM)) {
+        emit_sized(size, 0x85, src->reg, dst, needs_rex8(src) || needs_rex8(dst), 0);
+    } else {
+        longjmp(fail, 1);
+    }
+}
+
+static void assemble_mov(Operand *ops, int nops, int size) {
+    expect_nops(nops, 2);
+    Operand *src = &ops[0], *dst = &ops[1];
+    bool rex8 = needs_rex8(src) || needs_rex8(dst);
+    if (src->kind == OPD_IMM && dst->kind == OPD_REG) {
+        if (size == 8 && (src->sym || src->val == (int)src->val)) {
+            // Sign-extended 32-bit immediate
+            emit_rm(0, true, false, 0xC7, 0, dst, 4);
+            if (src->sym)
+                add_fixup(R_X86_64_32S, 4, src->sym, NULL, src->val);
+            else
+                put_le(src->val, 4);
+            return;
+        }
+        if (src->sym || (size < 8 && !fits_imm(src->val, size)))
+            longjmp(fail, 1);
+        if (size == 2)
+            byte(0x66);
+        int rex = 0x40 | ((size == 8) << 3) | (dst->reg >> 3);
+        if (rex != 0x40 || rex8)
+            byte(rex);
+        byte((size == 1 ? 0xB0 : 0xB8) + (dst->reg & 7));
+        put_le(src->val, size);
+        return;
+    }
+    if (src->kind == OPD_IMM && dst->kind == OPD_MEM) {
+        int immlen = (size == 8) ? 4 : size;
+        if (src->sym || !fits_imm(src->val, size))
+            longjmp(fail, 1);
+        emit_sized(size, 0xC7, 0, dst, false, immlen);
+        put_le(src->val, immlen);
+        return;
+    }
+    if (src->kind == OPD_REG && (dst->kind == OPD_REG || dst->kind == OPD_MEM))
+        emit_sized(size, 0x89, src->reg, dst, rex8, 0);
+    else if (src->kind == OPD_MEM && dst->kind == OPD_REG)
+        emit_sized(size, 0x8B, dst->reg, src, rex8, 0);
+    else
+        longjmp(fail, 1);
+}
+
+// movzx, movsx and friends. m->ext is the source size, or 0 if it's
+// given by the source register.
+static void assemble_movx(Mnemonic *m, Operand *ops, int nops) {
+    expect_nops(nops, 2);
+    Operand *src = &ops[0], *dst = &ops[1];
+    if (dst->kind != OPD_REG || (src->kind != OPD_REG && src->kind != OPD_MEM))
+        longjmp(fail, 1);
+    int srcsize = m->ext ? m->ext : src->size;
+    if (src->kind == OPD_REG && src->size != srcsize)
+        longjmp(fail, 1);
+    int opcode = m->opcode;
+    if (opcode == 0x0FB6 && srcsize == 2)
+        opcode = 0x0FB7;
+    else if (srcsize != 1 && srcsize != 2 && opcode != 0x63)
+        longjmp(fail, 1);
+    emit_rm(dst->size == 2 ? 0x66 : 0, dst->size == 8, needs_rex8(src), opcode, dst->reg, src, 0);
+}
+
+static void assemble_imul(Operand *ops, int nops, int size) {
+    expect_nops(nops, 2);
+    Operand *src = &ops[0], *dst = &ops[1];
+    if (dst->kind != OPD_REG || size == 1)
+        longjmp(fail, 1);
+    int pfx = (size == 2) ? 0x66 : 0;
+    if (src->kind == OPD_IMM) {
+        if (src->val == (signed char)src->val) {
+            emit_rm(pfx, size == 8, false, 0x6B, dst->reg, dst, 1);
+            emit_imm(src, 1);
+        } else {
+            int immlen = (size == 2) ? 2 : 4;
+            if (src->val != (int)src->val)
+                longjmp(fail, 1);
+            emit_rm(pfx, size == 8, false, 0x69, dst->reg, dst, immlen);
+            emit_imm(src, immlen);
+        }
+    } else if (src->kind == OPD_REG || src->kind == OPD_MEM) {
+        emit_rm(pfx, size == 8, false, 0x0FAF, dst->reg, src, 0);
+    } else {
+        longjmp(fail, 1);
+    }
+}
+
+static void assemble_shift(Mnemonic *m, Operand *ops, int nops, int size) {
+    expect_nops(nops, 2);
+    Operand *src = &ops[0], *dst = &ops[1];
+    if (dst->kind != OPD_REG && dst->kind != OPD_MEM)
+        longjmp(fail, 1);
+    if (src->kind == OPD_REG && src->reg == 1 && src->size == 1) {
+        emit_sized(size, 0xD3, m->ext, dst, needs_rex8(dst), 0);
+    } else if (src->kind == OPD_IMM && !src->sym && 0 <= src->val && src->val < 64) {
+        emit_sized(size, 0xC1, m->ext, dst, needs_rex8(dst), 1);
+        byte(src->val);
+    } else {
+        longjmp(fail, 1);
+    }
+}
+
+static void assemble_branch(int opcode, Operand *ops, int nops, int type) {
+    expect_nops(nops, 1);
+    if (ops[0].kind != OPD_MEM || ops[0].rip || ops[0].reg >= 0 || !ops[0].sym)
+        longjmp(fail, 1);
+    put_opcode(opcode);
+    add_fixup(type, 4, ops[0].sym, NULL, ops[0].val - 4);
+}
+
+static void assemble_jmp_call(Operand *ops, int nops, int opcode, int ext) {
+    expect_nops(nops, 1);
+    if (ops[0].indirect) {
+        if (ops[0].kind != OPD_REG || ops[0].size != 8)
+            longjmp(fail, 1);
+        emit_rm(0, false, false, 0xFF, ext, &ops[0], 0);
+        return;
+    }
+    assemble_branch(opcode, ops, nops, opcode == 0xE8 ? R_X86_64_PLT32 : R_X86_64_PC32);
+}
+
+static void assemble_push_pop(Operand *ops, int nops, int opcode) {
+    expect_nops(nops, 1);
+    if (ops[0].kind != OPD_REG || ops[0].size != 8)
+        longjmp(fail, 1);
+    if (ops[0].reg >= 8)
+        byte(0x41);
+    byte(opcode + (ops[0].reg & 7));
+}
+
+static void assemble_sse(Mnemonic *m, Operand *ops, int nops) {
+    expect_nops(nops, 2);
+    Operand *src = &ops[0], *dst = &ops[1];
+    if (dst->kind == OPD_XMM && (src->kind == OPD_XMM || src->kind == OPD_MEM)) {
+        emit_rm(m->pfx, false, false, m->opcode, dst->reg, src, 0);
+        return;
+    }
+    // Stores have their own opcodes.
+    if (src->kind == OPD_XMM && dst->kind == OPD_MEM) {
+        if (m->opcode == 0x0F10 || m->opcode == 0x0F28) {
+            emit_rm(m->pfx, false, false, m->opcode + 1, src->reg, dst, 0);
+            return;
+        }
+    }
+    longjmp(fail, 1);
+}
+
+static void assemble_insn(char *name, Operand *ops, int nops) {
+    Mnemonic *m = map_get(mnemonics, name);
+    int suffix = 0;
+    if (!m) {
+        // Try again without a size suffix, as in "movl".
+        int len = strlen(name);
+        if (len < 2 || !strchr("bwlq", name[len - 1]))
+            longjmp(fail, 1);
+        suffix = name[len - 1];
+        m = map_get(mnemonics, intern_len(name, len - 1));
+        if (!m)
+            longjmp(fail, 1);
+    }
+    int kind = m->kind & 0xFF;
+    int cond = m->kind >> 8;
+    switch (kind) {
+    case I_ALU:
+        assemble_alu(m, ops, nops, operand_size(ops, nops, suffix));
+        return;
+    case I_TEST:
+        assemble_test(ops, nops, operand_size(ops, nops, suffix));
+        return;
+    case I_MOV:
+        if (nops == 2 && (ops[0].kind == OPD_XMM || ops[1].kind == OPD_XMM))
+            longjmp(fail, 1);
+        assemble_mov(ops, nops, operand_size(ops, nops, suffix));
+        return;
+    case I_MOVX:
+        assemble_movx(m, ops, nops);
+        return;
+    case I_LEA:
+        expect_nops(nops, 2);
+        if (ops[0].kind != OPD_MEM || ops[1].kind != OPD_REG || ops[1].size != 8)
+            longjmp(fail, 1);
+        emit_rm(0, true, false, 0x8D, ops[1].reg, &ops[0], 0);
+        return;
+    case I_IMUL:
+        assemble_imul(ops, nops, operand_size(ops, nops, suffix));
+        return;
+    case I_UNARY: {
+        expect_nops(nops, 1);
+        if (ops[0].kind != OPD_REG && ops[0].kind != OPD_MEM)
+            longjmp(fail, 1);
+        int size = operand_size(ops, nops, suffix);
+        emit_sized(size, m->opcode, m->ext, &ops[0], needs_rex8(&ops[0]), 0);
+        return;
+    }
+    case I_SHIFT:
+        assemble_shift(m, ops, nops, operand_size(ops + 1, nops - 1, suffix));
+        return;
+    case I_JCC:
+        assemble_branch(0x0F80 + cond, ops, nops, R_X86_64_PC32);
+        return;
+    case I_SETCC:
+        expect_nops(nops, 1);
+        if (ops[0].kind != OPD_MEM && (ops[0].kind != OPD_REG || ops[0].size != 1))
+            longjmp(fail, 1);
+        emit_rm(0, false, needs_rex8(&ops[0]), 0x0F90 + cond, 0, &ops[0], 0);
+        return;
+    case I_JMP:
+        assemble_jmp_call(ops, nops, 0xE9, 4);
+        return;
+    case I_CALL:
+        assemble_jmp_call(ops, nops, 0xE8, 2);
+        return;
+    case I_PUSH:
+        assemble_push_pop(ops, nops, 0x50);
+        return;
+    case I_POP:
+        assemble_push_pop(ops, nops, 0x58);
+        return;
+    case I_FIXED:
+        expect_nops(nops, 0);
+        put_opcode(m->opcode);
+        return;
+    case I_SSE:
+        assemble_sse(m, ops, nops);
+        return;
+    case I_CVT2SI:
+        expect_nops(nops, 2);
+        if (ops[1].kind != OPD_REG || ops[1].size < 4 || ops[0].kind == OPD_REG || ops[0].kind == OPD_IMM)
+            longjmp(fail, 1);
+        emit_rm(m->pfx, ops[1].size == 8, false, m->opcode, ops[1].reg, &ops[0], 0);
+        return;
+    case I_CVTSI2:
+        expect_nops(nops, 2);
+        if (ops[1].kind != OPD_XMM || ops[0].kind != OPD_REG || ops[0].size < 4)
+            longjmp(fail, 1);
+        emit_rm(m->pfx, ops[0].size == 8, false, m->opcode, ops[1].reg, &ops[0], 0);
+        return;
+    }
+    longjmp(fail, 1);
+}
+
+/*
+ * Directives
+ */
+
+static void read_string(char **p) {
+    skip_space(p);
+    if (**p != '"')
+        longjmp(fail, 1);
+    (*p)++;
+    while (**p != '"') {
+        if (**p == '\0')
+            longjmp(fail, 1);
+        int c = *(*p)++;
+        if (c != '\\') {
+            byte(c);
+            continue;
+        }
+        c = *(*p)++;
+        switch (c) {
+        case 'b': byte('\b'); break;
+        case 'f': byte('\f'); break;
+        case 'n': byte('\n'); break;
+        case 'r': byte('\r'); break;
+        case 't': byte('\t'); break;
+        case 'x': {
+            // Like as(1), take all hex digits and keep the low byte.
+            int v = 0;
+            for (;;) {
+                char d = **p;
+                if ('0' <= d && d <= '9') v = v * 16 + d - '0';
+                else if ('a' <= d && d <= 'f') v = v * 16 + d - 'a' + 10;
+                else if ('A' <= d && d <= 'F') v = v * 16 + d - 'A' + 10;
+                else break;
+                (*p)++;
+            }
+            byte(v);
+            break;
+        }
+        case '\\': case '"': case '\'':
+            byte(c);
+            break;
+        default:
+            longjmp(fail, 1);
+        }
+    }
+    (*p)++;
+    byte('\0');
+}
+
+// .byte, .short, .long or .quad
+static void read_data(char **p, int size) {
+    Symbol *sym;
+    long val;
+    read_asm_expr(p, &sym, &val);
+    if (**p == '-' && sym && val == 0) {
+        // Difference of two labels
+        (*p)++;
+        Symbol *minus;
+        long v;
+        read_asm_expr(p, &minus, &v);
+        if (!minus || v || size != 4)
+            longjmp(fail, 1);
+        add_fixup(0, 4, sym, minus, 0);
+        return;
+    }
+    if (!sym) {
+        put_le(val, size);
+        return;
+    }
+    if (size != 8)
+        longjmp(fail, 1);
+    add_fixup(R_X86_64_64, 8, sym, NULL, val);
+}
+
+static void define_symbol(char *name, int sect, int subsec, long off) {
+    Symbol *sym = get_symbol(name);
+    if (sym->sect)
+        longjmp(fail, 1);
+    sym->sect = sect;
+    sym->subsec = subsec;
+    sym->off = off;
+}
+
+// .lcomm name, size
+static void read_lcomm(char **p) {
+    skip_space(p);
+    char *name = read_name(p);
+    skip_space(p);
+    if (*(*p)++ != ',')
+        longjmp(fail, 1);
+    skip_space(p);
+    long size = read_number(p);
+    int align = 1;
+    while (align < 16 && align * 2 <= size)
+        align *= 2;
+    bss_size = (bss_size + align - 1) & ~(long)(align - 1);
+    define_symbol(name, SEC_BSS, 0, bss_size);
+    bss_size += size;
+}
+
+static void assemble_directive(char *name, char *p) {
+    if (!strcmp(name, ".file") || !strcmp(name, ".loc"))
+        return;
+    if (!strcmp(name, ".text") || !strcmp(name, ".data")) {
+        skip_space(&p);
+        long subsec = *p ? read_number(&p) : 0;
+        if (subsec < 0 || subsec > 8192)
+            longjmp(fail, 1);
+        set_section(!strcmp(name, ".text") ? SEC_TEXT : SEC_DATA, subsec);
+        return;
+    }
+    if (!strcmp(name, ".global") || !strcmp(name, ".globl")) {
+        skip_space(&p);
+        get_symbol(read_name(&p))->global = true;
+        return;
+    }
+    if (!strcmp(name, ".lcomm")) {
+        read_lcomm(&p);
+        return;
+    }
+    if (!strcmp(name, ".string")) {
+        read_string(&p);
+        return;
+    }
+    if (!strcmp(name, ".byte"))  { read_data(&p, 1); return; }
+    if (!strcmp(name, ".short")) { read_data(&p, 2); return; }
+    if (!strcmp(name, ".long"))  { read_data(&p, 4); return; }
+    if (!strcmp(name, ".quad"))  { read_data(&p, 8); return; }
+    longjmp(fail, 1);
+}
+
+/*
+ * Lines
+ */
+
+// Removes a comment, which starts with '#' outside a string.
+static void strip_comment(char *p) {
+    bool quoted = false;
+    for (; *p; p++) {
+        if (quoted && *p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '"') {
+            quoted = !quoted;
+        } else if (*p == '#' && !quoted) {
+            *p = '\0';
+            return;
+        }
+    }
+}
+
+static void assemble_line(char *line) {
+    strip_comment(line);
+    char *p = line;
+    skip_space(&p);
+    char *end = p + strlen(p);
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    *end = '\0';
+    if (!*p)
+        return;
+
+    if (end[-1] == ':') {
+        char *q = p;
+        char *name = read_name(&q);
+        if (*q != ':')
+            longjmp(fail, 1);
+        if (cursect == SEC_UNDEF)
+            longjmp(fail, 1);
+        define_symbol(name, cursect, cursubsec, here());
+        return;
+    }
+
+    char *name = read_name(&p);
+    if (*name == '.') {
+        assemble_directive(name, p);
+        return;
+    }
+    if (cursect != SEC_TEXT)
+        longjmp(fail, 1);
+    Operand ops[3];
+    int nops = 0;
+    skip_space(&p);
+    while (*p) {
+        if (nops == 3)
+            longjmp(fail, 1);
+        read_operand(&p, &ops[nops++]);
+        skip_space(&p);
+        if (*p == ',')
+            p++;
+        else if (*p)
+            longjmp(fail, 1);
+    }
+    assemble_insn(name, ops, nops);
+}
+
+/*
+ * ELF writer
+ */
+
+static long subsec_base(int sect, int subsec) {
+    long r = 0;
+    for (int i = 0; i < subsec; i++)
+        r += buf_len(vec_get(subsecs[sect], i));
+    return r;
+}
+
+static long symbol_value(Symbol *sym) {
+    if (sym->sect == SEC_BSS)
+        return sym->off;
+    return subsec_base(sym->sect, sym->subsec) + sym->off;
+}
+
+static void patch(Buffer *b, long off, long val, int size) {
+    for (int i = 0; i < size; i++)
+        b->body[off + i] = val >> (i * 8);
+}
+
+static Buffer *section_contents(int sect) {
+    Buffer *b = make_buffer();
+    Vector *v = subsecs[sect];
+    for (int i = 0; i < vec_len(v); i++) {
+        Buffer *s = vec_get(v, i);
+        buf_append(b, buf_body(s), buf_len(s));
+    }
+    return b;
+}
+
+static void add_rela(Buffer *rela, long off, int sym, int type, long addend) {
+    Elf64_Rela r = { off, ELF64_R_INFO(sym, type), addend };
+    buf_append(rela, (char *)&r, sizeof(r));
+}
+
+// Section indices in the output. A symbol in section sect is in section
+// header sect.
+enum {
+    SHN_TEXT = 1, SHN_DATA, SHN_BSS, SHN_RELA_TEXT, SHN_RELA_DATA,
+    SHN_NOTE, SHN_SYMTAB, SHN_STRTAB, SHN_SHSTRTAB, NSHDRS,
+};
+
+static int add_string(Buffer *b, char *s) {
+    int off = buf_len(b);
+    buf_append(b, s, strlen(s) + 1);
+    return off;
+}
+
+static void add_symbol(Buffer *symtab, int name, int bind, int type, int shndx, long value) {
+    Elf64_Sym s = { name, ELF64_ST_INFO(bind, type), STV_DEFAULT, shndx, value, 0 };
+    buf_append(symtab, (char *)&s, sizeof(s));
+}
+
+// Builds the symbol table. Symbols named .L* are assembler-local and
+// not included; relocations refer to their sections instead. Undefined
+// symbols are global.
+static int build_symtab(Buffer *symtab, Buffer *strtab) {
+    buf_write(strtab, '\0');
+    add_symbol(symtab, 0, STB_LOCAL, STT_NOTYPE, SHN_UNDEF, 0);
+    for (int i = SEC_TEXT; i < NSECTIONS; i++)
+        add_symbol(symtab, 0, STB_LOCAL, STT_SECTION, i, 0);
+    int n = NSECTIONS;
+    for (int i = 0; i < vec_len(symlist); i++) {
+        Symbol *sym = vec_get(symlist, i);
+        if (sym->global || !sym->sect || !strncmp(sym->name, ".L", 2))
+            continue;
+        sym->index = n++;
+        add_symbol(symtab, add_string(strtab, sym->name), STB_LOCAL, STT_NOTYPE, sym->sect, symbol_value(sym));
+    }
+    int firstglobal = n;
+    for (int i = 0; i < vec_len(symlist); i++) {
+        Symbol *sym = vec_get(symlist, i);
+        if (!sym->global && sym->sect)
+            continue;
+        if (!sym->global && !strncmp(sym->name, ".L", 2))
+            longjmp(fail, 1); // undefined local label
+        sym->index = n++;
+        long value = sym->sect ? symbol_value(sym) : 0;
+        add_symbol(symtab, add_string(strtab, sym->name), STB_GLOBAL, STT_NOTYPE, sym->sect, value);
+    }
+    return firstglobal;
+}
+
+// Fills in fields that refer to symbols. PC-relative references to local
+// symbols in the same section are resolved here, and everything else
+// becomes a relocation.
+static void resolve_fixups(Buffer **contents, Buffer **rela) {
+    for (int i = 0; i < vec_len(fixups); i++) {
+        Fixup *f = vec_get(fixups, i);
+        Buffer *b = contents[f->sect];
+        long off = subsec_base(f->sect, f->subsec) + f->off;
+        Symbol *sym = f->sym;
+        if (f->minus) {
+            if (!sym->sect || sym->sect != f->minus->sect)
+                longjmp(fail, 1);
+            patch(b, off, symbol_value(sym) - symbol_value(f->minus) + f->addend, 4);
+            continue;
+        }
+        if (f->sect == SEC_BSS)
+            longjmp(fail, 1);
+        bool pcrel = (f->type == R_X86_64_PC32 || f->type == R_X86_64_PLT32);
+        if (pcrel && !sym->global && sym->sect == f->sect) {
+            patch(b, off, symbol_value(sym) + f->addend - off, 4);
+            continue;
+        }
+        if (!sym->global && sym->sect) {
+            // Relocate against the section symbol.
+            add_rela(rela[f->sect], off, sym->sect, f->type, symbol_value(sym) + f->addend);
+            continue;
+        }
+        add_rela(rela[f->sect], off, sym->index, f->type, f->addend);
+    }
+}
+
+static void align_buf(Buffer *b, int align) {
+    while (buf_len(b) % align)
+        buf_write(b, '\0');
+}
+
+static void set_shdr(Elf64_Shdr *sh, Buffer *shstrtab, char *name, int type, long flags, int align, int entsize) {
+    sh->sh_name = add_string(shstrtab, name);
+    sh->sh_type = type;
+    sh->sh_flags = flags;
+    sh->sh_addralign = align;
+    sh->sh_entsize = entsize;
+}
+
+static Buffer *build_elf() {
+    Buffer *contents[NSECTIONS];
+    Buffer *rela[NSECTIONS];
+    for (int i = SEC_TEXT; i < NSECTIONS; i++) {
+        contents[i] = section_contents(i);
+        rela[i] = make_buffer();
+    }
+    Buffer *symtab = make_buffer();
+    Buffer *strtab = make_buffer();
+    int firstglobal = build_symtab(symtab, strtab);
+    resolve_fixups(contents, rela);
+
+    Buffer *shstrtab = make_buffer();
+    buf_write(shstrtab, '\0');
+    Elf64_Shdr shdrs[NSHDRS];
+    memset(shdrs, 0, sizeof(shdrs));
+    set_shdr(&shdrs[SHN_TEXT], shstrtab, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16, 0);
+    set_shdr(&shdrs[SHN_DATA], shstrtab, ".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 16, 0);
+    set_shdr(&shdrs[SHN_BSS], shstrtab, ".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE, 16, 0);
+    set_shdr(&shdrs[SHN_RELA_TEXT], shstrtab, ".rela.text", SHT_RELA, SHF_INFO_LINK, 8, sizeof(Elf64_Rela));
+    set_shdr(&shdrs[SHN_RELA_DATA], shstrtab, ".rela.data", SHT_RELA, SHF_INFO_LINK, 8, sizeof(Elf64_Rela));
+    set_shdr(&shdrs[SHN_NOTE], shstrtab, ".note.GNU-stack", SHT_PROGBITS, 0, 1, 0);
+    set_shdr(&shdrs[SHN_SYMTAB], shstrtab, ".symtab", SHT_SYMTAB, 0, 8, sizeof(Elf64_Sym));
+    set_shdr(&shdrs[SHN_STRTAB], shstrtab, ".strtab", SHT_STRTAB, 0, 1, 0);
+    set_shdr(&shdrs[SHN_SHSTRTAB], shstrtab, ".shstrtab", SHT_STRTAB, 0, 1, 0);
+    shdrs[SHN_RELA_TEXT].sh_link = shdrs[SHN_RELA_DATA].sh_link = SHN_SYMTAB;
+    shdrs[SHN_RELA_TEXT].sh_info = SHN_TEXT;
+    shdrs[SHN_RELA_DATA].sh_info = SHN_DATA;
+    shdrs[SHN_SYMTAB].sh_link = SHN_STRTAB;
+    shdrs[SHN_SYMTAB].sh_info = firstglobal;
+
+    Buffer *body[NSHDRS] = {
+        NULL, contents[SEC_TEXT], contents[SEC_DATA], NULL, rela[SEC_TEXT], rela[SEC_DATA],
+        NULL, symtab, strtab, shstrtab,
+    };
+    Buffer *out = make_buffer();
+    Elf64_Ehdr ehdr;
+    memset(&ehdr, 0, sizeof(ehdr));
+    buf_append(out, (char *)&ehdr, sizeof(ehdr));
+    for (int i = 1; i < NSHDRS; i++) {
+        align_buf(out, shdrs[i].sh_addralign);
+        shdrs[i].sh_offset = buf_len(out);
+        if (body[i]) {
+            shdrs[i].sh_size = buf_len(body[i]);
+            buf_append(out, buf_body(body[i]), buf_len(body[i]));
+        }
+    }
+    shdrs[SHN_BSS].sh_size = bss_size;
+    align_buf(out, 8);
+
+    ehdr.e_ident[EI_MAG0] = ELFMAG0;
+    ehdr.e_ident[EI_MAG1] = ELFMAG1;
+    ehdr.e_ident[EI_MAG2] = ELFMAG2;
+    ehdr.e_ident[EI_MAG3] = ELFMAG3;
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_shoff = buf_len(out);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = NSHDRS;
+    ehdr.e_shstrndx = SHN_SHSTRTAB;
+    memcpy(out->body, &ehdr, sizeof(ehdr));
+    buf_append(out, (char *)shdrs, sizeof(shdrs));
+    return out;
+}
+
+/*
+ * Entry point
+ */
+
+// Assembles the given assembly text and appends the object file to out.
+// Returns false, leaving out untouched, if the input contains something we
+// don't support.
+bool assemble_to_buffer(Buffer *text, Buffer *out) {
+    init_tables();
+    for (int i = 0; i < NSECTIONS; i++)
+        subsecs[i] = make_vector();
+    bss_size = 0;
+    symbols = make_interned_map();
+    symlist = make_vector();
+    fixups = make_vector();
+    set_section(SEC_TEXT, 0);
+    if (setjmp(fail))
+        return false;
+
+    // Lines are split and trimmed in place, in a copy of the input so that
+    // the caller can still hand it to as(1) if we give up.
+    char *p = malloc(buf_len(text) + 1);
+    memcpy(p, buf_body(text), buf_len(text));
+    p[buf_len(text)] = '\0';
+    while (*p) {
+        char *eol = strchr(p, '\n');
+        if (eol)
+            *eol = '\0';
+        assemble_line(p);
+        if (!eol)
+            break;
+        p = eol + 1;
+    }
+    Buffer *obj = build_elf();
+    buf_append(out, buf_body(obj), buf_len(obj));
+    return true;
+}
+
+// Same as above, but writes the object file to the given file.
+bool assemble(Buffer *text, char *filename) {
+    Buffer *obj = make_buffer();
+    if (!assemble_to_buffer(text, obj))
+        return false;
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+        return false;
+    bool ok = (fwrite(buf_body(obj), 1, buf_len(obj), fp) == buf_len(obj));
+    return (fclose(fp) == 0) && ok;
+}
@@ -0,0 +1,176 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Benchmark driver
+ *
+ * Runs 8cc over the benchmark inputs in each of its modes and prints the
+ * results as JSON, so that runs before and after a change can be compared
+ * by a script. Build and run it from the top of the source tree:
+ *
+ *   cc -o bench/run bench/bench.c && bench/run > before.json
+ *
+ * Options:
+ *
+ *   -c <path>  the compiler to measure (default ./8cc)
+ *   -n <runs>  number of runs per input and mode (default 3)
+ *   <file>...  inputs (default: the files in bench/ and a few 8cc sources)
+ *
+ * The modes are:
+ *
+ *   lex   -flex-only: the lexer alone, without preprocessing
+ *   cpp   -E: lexer and preprocessor
+ *   ast   -fdump-ast: up to the parser
+ *   asm   -S: up to the code generator
+ *   obj   -c: the full compilation including the assembler
+ *
+ * For each input and mode, we report the best wall time of all runs in
+ * microseconds, the largest peak RSS in kilobytes as reported by the
+ * kernel, and the number of objects and bytes allocated from the arenas as
+ * reported by -fmem-stats. The RSS is that of the compiler process itself,
+ * not of the assembler it spawns in the obj mode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    long wall_us;
+    long maxrss_kb;
+    long allocs;
+    long alloc_bytes;
+    int status;
+} Result;
+
+static char *default_inputs[] = {
+    "bench/hideset.c",
+    "bench/macros.c",
+    "bench/functions.c",
+    "bench/switch.c",
+    "bench/initializer.c",
+    "bench/expr.c",
+    "parse.c",
+    "lex.c",
+    "gen.c",
+    NULL,
+};
+
+static char *modes[] = { "lex", "cpp", "ast", "asm", "obj", NULL };
+static char *mode_flags[] = { "-flex-only", "-E", "-fdump-ast", "-S", "-c", NULL };
+
+static char *compiler = "./8cc";
+
+static long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Reads the arena totals from the -fmem-stats output in log.
+static void read_mem_stats(FILE *log, Result *r) {
+    char line[256];
+    fseek(log, 0, SEEK_SET);
+    while (fgets(line, sizeof(line), log))
+        if (sscanf(line, "mem-stats: total %ld %ld", &r->alloc_bytes, &r->allocs) == 2)
+            return;
+}
+
+// Runs the compiler once. Its output is discarded, and its diagnostics go
+// to a temporary file, from which we read the allocation counts.
+static void run(char *file, int mode, Result *r) {
+    FILE *log = tmpfile();
+    if (!log) {
+        perror("tmpfile");
+        exit(1);
+    }
+    fflush(stdout);
+    long start = now_us();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        if (!freopen("/dev/null", "w", stdout))
+            _exit(1);
+        dup2(fileno(log), 2);
+        char *argv[] = { compiler, mode_flags[mode], "-fmem-stats", "-o", "/dev/null", file, NULL };
+        execvp(compiler, argv);
+        perror(compiler);
+        _exit(1);
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        exit(1);
+    }
+    r->wall_us = now_us() - start;
+    r->maxrss_kb = ru.ru_maxrss;
+    r->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    r->allocs = r->alloc_bytes = 0;
+    read_mem_stats(log, r);
+    fclose(log);
+}
+
+static void print_result(char *file, int mode, int runs, Result *r, int first) {
+    printf("%s  {\"file\": \"%s\", \"mode\": \"%s\", \"runs\": %d,",
+           first ? "" : ",\n", file, modes[mode], runs);
+    printf(" \"wall_us\": %ld, \"max_rss_kb\": %ld,", r->wall_us, r->maxrss_kb);
+    printf(" \"allocs\": %ld, \"alloc_bytes\": %ld, \"status\": %d}",
+           r->allocs, r->alloc_bytes, r->status);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: bench [ -c <compiler> ] [ -n <runs> ] [ <file>... ]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int runs = 3;
+    for (;;) {
+        int opt = getopt(argc, argv, "c:n:");
+        if (opt == -1)
+            break;
+        switch (opt) {
+        case 'c': compiler = optarg; break;
+        case 'n':
+            runs = atoi(optarg);
+            if (runs < 1)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    char **inputs = (optind < argc) ? argv + optind : default_inputs;
+
+    printf("[\n");
+    int first = 1;
+    for (int i = 0; inputs[i]; i++) {
+        for (int mode = 0; modes[mode]; mode++) {
+            Result best;
+            for (int n = 0; n < runs; n++) {
+                Result r;
+                run(inputs[i], mode, &r);
+                if (n == 0 || r.wall_us < best.wall_us)
+                    best.wall_us = r.wall_us;
+                if (n == 0 || r.maxrss_kb > best.maxrss_kb)
+                    best.maxrss_kb = r.maxrss_kb;
+                best.allocs = r.allocs;
+                best.alloc_bytes = r.alloc_bytes;
+                best.status = r.status;
+            }
+            print_result(inputs[i], mode, runs, &best, first);
+            fflush(stdout);
+            first = 0;
+        }
+    }
+    printf("\n]\n");
+    return 0;
+}
@@ -0,0 +1,31 @@
+// Benchmark for deeply nested expressions.
+//
+// The parser, the constant folder and the code generator are all
+// recursive over the expression tree. N8 below nests its argument 256
+// levels deep in alternating operators and parentheses, and the functions
+// use it on both variables and constants.
+
+#define N1(x) (a + (x) * b)
+#define N2(x) N1(N1(x))
+#define N4(x) N2(N2(x))
+#define N8(x) N4(N4(x))
+#define N16(x) N8(N8(x))
+#define N32(x) N16(N16(x))
+#define N64(x) N32(N32(x))
+#define N128(x) N64(N64(x))
+#define N256(x) N128(N128(x))
+
+long deep1(long a, long b) { return N256(a); }
+long deep2(long a, long b) { return N256(b - 1); }
+long deep3(long a, long b) { return N256(N256(a ^ b)); }
+
+long folded() {
+    long a = 3, b = 5;
+    return N256(1) + N256(2);
+}
+
+int chain(int x) {
+    return x && (x || (x && (x || (x && (x || (x && (x || (x && (x || (x &&
+           (x || (x && (x || (x && (x || (x && (x || (x && (x || (x && (x ||
+           x)))))))))))))))))))));
+}
@@ -0,0 +1,26 @@
+// Benchmark for a translation unit with thousands of small functions.
+//
+// FN(n) defines one function. The C and D macros paste digits together to
+// define 4000 functions, f0000 to f3999, each with a few locals, a loop and
+// a call to the previous function, which is roughly what a large generated
+// source file looks like.
+
+#define FN(n)                                   \
+    int f##n(int x, int y) {                    \
+        int a = x * 3 + y;                      \
+        int b = a ^ (x >> 2);                   \
+        for (int i = 0; i < y; i++)             \
+            b += i * a;                         \
+        return b + g(a);                        \
+    }
+
+#define D(p) FN(p##0) FN(p##1) FN(p##2) FN(p##3) FN(p##4) \
+             FN(p##5) FN(p##6) FN(p##7) FN(p##8) FN(p##9)
+#define C(p) D(p##0) D(p##1) D(p##2) D(p##3) D(p##4) \
+             D(p##5) D(p##6) D(p##7) D(p##8) D(p##9)
+#define M(p) C(p##0) C(p##1) C(p##2) C(p##3) C(p##4) \
+             C(p##5) C(p##6) C(p##7) C(p##8) C(p##9)
+
+int g(int x);
+
+M(0) M(1) M(2) M(3)
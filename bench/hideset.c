@@ -0,0 +1,49 @@
+// Benchmark for hideset handling in the macro expander (cpp.c).
+//
+// The argument of the 10-deep F chain below expands to about 10000 tokens,
+// and each of them picks up one more macro name in its hideset at every
+// level of the chain. With hash-consed hidesets, the work per token and
+// level is constant, so the expansion is linear in the number of tokens.
+//
+// Run it through the preprocessor only:
+//
+//   time ./8cc -E bench/hideset.c > /dev/null
+
+#define T10(x) x x x x x x x x x x
+#define T50(x) T10(x) T10(x) T10(x) T10(x) T10(x)
+#define T5000(x) T50(T10(T10(x)))
+
+#define F0(x) x
+#define F1(x) F0(x)
+#define F2(x) F1(x)
+#define F3(x) F2(x)
+#define F4(x) F3(x)
+#define F5(x) F4(x)
+#define F6(x) F5(x)
+#define F7(x) F6(x)
+#define F8(x) F7(x)
+#define F9(x) F8(x)
+#define F10(x) F9(x)
+
+#define G(x) F10(T5000(x))
+
+long v0[] = { G(1 +) 0 };
+long v1[] = { G(1 +) 0 };
+long v2[] = { G(1 +) 0 };
+long v3[] = { G(1 +) 0 };
+long v4[] = { G(1 +) 0 };
+long v5[] = { G(1 +) 0 };
+long v6[] = { G(1 +) 0 };
+long v7[] = { G(1 +) 0 };
+long v8[] = { G(1 +) 0 };
+long v9[] = { G(1 +) 0 };
+long v10[] = { G(1 +) 0 };
+long v11[] = { G(1 +) 0 };
+long v12[] = { G(1 +) 0 };
+long v13[] = { G(1 +) 0 };
+long v14[] = { G(1 +) 0 };
+long v15[] = { G(1 +) 0 };
+long v16[] = { G(1 +) 0 };
+long v17[] = { G(1 +) 0 };
+long v18[] = { G(1 +) 0 };
+long v19[] = { G(1 +) 0 };
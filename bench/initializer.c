@@ -0,0 +1,45 @@
+// Benchmark for huge static initializers.
+//
+// A table of structs and a large integer array, as found in generated
+// lookup tables and embedded resources. Every element goes through the
+// initializer parser and is emitted as data.
+//
+// The struct table is kept at 2000 entries because each element of an
+// array of structs currently re-sorts all the initializers read so far,
+// so the time grows quadratically with its length.
+
+struct entry {
+    int id;
+    short kind;
+    char flags;
+    long value;
+    const char *name;
+};
+
+#define E(n) { n, n & 7, 'a', n * 1000003L, "entry" },
+#define I(n) (n) * 7 % 256,
+
+#define T10(X, n) X(n) X(n + 1) X(n + 2) X(n + 3) X(n + 4) \
+                  X(n + 5) X(n + 6) X(n + 7) X(n + 8) X(n + 9)
+#define T100(X, n) T10(X, n) T10(X, n + 10) T10(X, n + 20) T10(X, n + 30) \
+                   T10(X, n + 40) T10(X, n + 50) T10(X, n + 60) T10(X, n + 70) \
+                   T10(X, n + 80) T10(X, n + 90)
+#define T1000(X, n) T100(X, n) T100(X, n + 100) T100(X, n + 200) T100(X, n + 300) \
+                    T100(X, n + 400) T100(X, n + 500) T100(X, n + 600) \
+                    T100(X, n + 700) T100(X, n + 800) T100(X, n + 900)
+#define T10000(X, n) T1000(X, n) T1000(X, n + 1000) T1000(X, n + 2000) \
+                     T1000(X, n + 3000) T1000(X, n + 4000) T1000(X, n + 5000) \
+                     T1000(X, n + 6000) T1000(X, n + 7000) T1000(X, n + 8000) \
+                     T1000(X, n + 9000)
+
+struct entry table[] = {
+    T1000(E, 0)
+    T1000(E, 1000)
+};
+
+unsigned char bytes[] = {
+    T10000(I, 0)
+    T10000(I, 10000)
+    T10000(I, 20000)
+    T10000(I, 30000)
+};
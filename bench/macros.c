@@ -0,0 +1,42 @@
+// Benchmark for macro-heavy code, in the style of generated headers.
+//
+// Each use of REPEAT below expands to hundreds of tokens through a few
+// levels of function-like macros, with stringizing, token pasting and
+// variadic arguments, as in headers produced by X-macros and code
+// generators. Run it with -E to measure the preprocessor alone.
+
+#define CAT(a, b) a##b
+#define XCAT(a, b) CAT(a, b)
+#define STR(x) #x
+#define XSTR(x) STR(x)
+#define FIRST(x, ...) x
+#define REST(x, ...) __VA_ARGS__
+#define APPLY(f, ...) f(__VA_ARGS__)
+
+#define COLORS(X) X(red, 1) X(green, 2) X(blue, 3) X(cyan, 4) X(magenta, 5) \
+                  X(yellow, 6) X(black, 7) X(white, 8)
+
+#define AS_ENUM(name, v) XCAT(COLOR_, name) = v,
+#define AS_STRING(name, v) [v] = XSTR(name),
+#define AS_CASE(name, v) case v: return APPLY(FIRST, v * 2, name);
+
+#define R4(x) x x x x
+#define R16(x) R4(R4(x))
+#define REPEAT(x) R16(R4(x))
+
+enum color { COLORS(AS_ENUM) };
+
+static const char *names[] = { COLORS(AS_STRING) };
+
+#define BODY(n)                                 \
+    int XCAT(lookup, n)(int c) {                \
+        int red = 1, green = 2, blue = 3, cyan = 4, magenta = 5, yellow = 6, \
+            black = 7, white = 8;               \
+        switch (c) { COLORS(AS_CASE) }          \
+        return REPEAT(APPLY(REST, 0, 1) +) 0;   \
+    }
+
+#define B10(p) BODY(p##0) BODY(p##1) BODY(p##2) BODY(p##3) BODY(p##4) \
+               BODY(p##5) BODY(p##6) BODY(p##7) BODY(p##8) BODY(p##9)
+
+B10(1) B10(2) B10(3) B10(4) B10(5) B10(6) B10(7) B10(8) B10(9)
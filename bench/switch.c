@@ -0,0 +1,22 @@
+// Benchmark for a large switch statement.
+//
+// The function below has a switch with 300 cases, like the dispatch loop
+// of an interpreter. Each case does a little arithmetic on the operands so
+// that the code generator has something to emit besides jumps.
+
+#define CASE(n) case n: acc = acc * 31 + (n ^ arg); break;
+#define D(p) CASE(p##0) CASE(p##1) CASE(p##2) CASE(p##3) CASE(p##4) \
+             CASE(p##5) CASE(p##6) CASE(p##7) CASE(p##8) CASE(p##9)
+#define C(p) D(p) D(p##1) D(p##2) D(p##3) D(p##4) \
+             D(p##5) D(p##6) D(p##7) D(p##8) D(p##9)
+
+long dispatch(int *code, int n, long arg) {
+    long acc = 0;
+    for (int i = 0; i < n; i++) {
+        switch (code[i]) {
+        C(1) C(2) C(3)
+        default: acc = -acc;
+        }
+    }
+    return acc;
+}
@@ -4,7 +4,8 @@
 // design decision to note in 8cc is that there's no function to destroy a 
 // buffer, meaning that all memory simply gets allocated without ever being freed.
 // This is acceptable because compilers do not generally run long enough to
-// use enough memory to cause problems.
+// use enough memory to cause problems. Since nothing is ever freed, buffers and
+// their bodies are carved out of the string arena (see arena.c).
 
 #include <ctype.h>
 // stdarg is a file in the C standard library that allows functions to accept an
@@ -18,11 +19,10 @@
 
 // This function creates a buffer.
 Buffer *make_buffer() {
-    Buffer *r = malloc(sizeof(Buffer));
+    Buffer *r = arena_alloc(ARENA_STRING, sizeof(Buffer));
 
     // We allocate memory for the members of the struct.
-    // malloc() allocates memory on the heap without initializing that memory.
-    r->body = malloc(INIT_SIZE);
+    r->body = arena_alloc(ARENA_STRING, INIT_SIZE);
 
     // nalloc is a member that keeps track of the size of the buffer.
     r->nalloc = INIT_SIZE;
@@ -36,7 +36,7 @@ Buffer *make_buffer() {
 static void realloc_body(Buffer *b) {
     // The new size is twice as large as the previous size.
     int newsize = b->nalloc * 2;
-    char *body = malloc(newsize);
+    char *body = arena_alloc(ARENA_STRING, newsize);
 
     // memcpy() copies memory. Here, we copy memory from the old body to the
     // new one.
@@ -71,9 +71,14 @@ void buf_write(Buffer *b, char c) {
 
 // Append an array of characters to the buffer.
 void buf_append(Buffer *b, char *s, int len) {
-    // Write each character to the buffer individually.
-    for (int i = 0; i < len; i++)
-        buf_write(b, s[i]);
+    // Make room for all of the characters at once, keeping one byte spare like
+    // buf_write() does, and copy them in one go. Whole assembly files pass
+    // through here with -fintegrated-as, so copying them one character at a
+    // time would be noticeably slow.
+    while (b->nalloc <= b->len + len)
+        realloc_body(b);
+    memcpy(b->body + b->len, s, len);
+    b->len += len;
 }
 
 // Print to the buffer. Note that this function takes a format string and a 
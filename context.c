@@ -0,0 +1,137 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Compiler contexts
+ *
+ * The state of a compilation lives in global variables of the modules
+ * that use it: the input file stack in file.c, the token buffers in
+ * lex.c, the macros, include state and macro statistics in cpp.c, the
+ * scopes and label counters in parse.c, the passes of -O1 in inline.c,
+ * opt.c, regalloc.c and peep.c, the output in gen.c and tokstream.c, and
+ * where diagnostics go in error.c. A CompilerContext owns a complete set
+ * of that state, so that a host process can keep several compilations in
+ * memory and run them one after another or interleaved, without forking
+ * a compiler for each.
+ *
+ * The compiler still reads and writes its state through the globals.
+ * enter_context() installs a context's state in the globals, and
+ * leave_context() saves it back into the context and reinstates the
+ * state that was active before. So only one context is active at a time.
+ *
+ * Contexts may be used from several threads. enter_context() takes a
+ * process-wide lock, which the thread holds until it leaves all the
+ * contexts it entered, so a thread that enters a context waits while
+ * another thread is compiling. Compilations on different threads are
+ * therefore safe but run one at a time, not in parallel.
+ *
+ * A new context starts out as if the process had just started, so the
+ * usual initialization (lex_init(), cpp_init(), parse_init() and setting
+ * the output) is done after entering it for the first time.
+ *
+ * Some state is shared by all contexts and is modified by every
+ * compilation: the intern table (intern.c), the memo tables of
+ * hash-consed sets (set.c), the memory arenas, the instruction template
+ * cache in gen.c, the -ftime-report timers and the -fdump-peephole
+ * counters. So are the options set from the command line. It's protected
+ * by the same lock, so a thread must be in a context to compile or use
+ * these tables while other threads may be doing the same.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "8cc.h"
+
+struct CompilerContext {
+    bool active;
+    void *file;
+    void *lex;
+    void *cpp;
+    void *parse;
+    void *inliner;
+    void *opt;
+    void *regalloc;
+    void *gen;
+    void *peep;
+    void *tokstream;
+    void *error;
+};
+
+static Vector *entered = &EMPTY_VECTOR; // active contexts, innermost last
+static Vector *outer = &EMPTY_VECTOR;   // states they replaced
+
+// Held by the thread that has entered contexts, once per context.
+static pthread_once_t lock_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lock;
+
+static void init_lock() {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&lock, &attr);
+}
+
+static void lock_contexts() {
+    pthread_once(&lock_once, init_lock);
+    pthread_mutex_lock(&lock);
+}
+
+CompilerContext *make_context() {
+    return calloc(1, sizeof(CompilerContext));
+}
+
+static void save(CompilerContext *ctx) {
+    ctx->file = file_save_state();
+    ctx->lex = lex_save_state();
+    ctx->cpp = cpp_save_state();
+    ctx->parse = parse_save_state();
+    ctx->inliner = inline_save_state();
+    ctx->opt = opt_save_state();
+    ctx->regalloc = regalloc_save_state();
+    ctx->gen = gen_save_state();
+    ctx->peep = peep_save_state();
+    ctx->tokstream = tokstream_save_state();
+    ctx->error = error_save_state();
+}
+
+static void restore(CompilerContext *ctx) {
+    file_restore_state(ctx->file);
+    lex_restore_state(ctx->lex);
+    cpp_restore_state(ctx->cpp);
+    parse_restore_state(ctx->parse);
+    inline_restore_state(ctx->inliner);
+    opt_restore_state(ctx->opt);
+    regalloc_restore_state(ctx->regalloc);
+    gen_restore_state(ctx->gen);
+    peep_restore_state(ctx->peep);
+    tokstream_restore_state(ctx->tokstream);
+    error_restore_state(ctx->error);
+}
+
+void enter_context(CompilerContext *ctx) {
+    lock_contexts();
+    if (ctx->active) {
+        pthread_mutex_unlock(&lock);
+        error("compiler context is already active");
+    }
+    CompilerContext *prev = make_context();
+    save(prev);
+    vec_push(outer, prev);
+    vec_push(entered, ctx);
+    ctx->active = true;
+    restore(ctx);
+}
+
+void leave_context() {
+    lock_contexts();
+    if (vec_len(entered) == 0) {
+        pthread_mutex_unlock(&lock);
+        error("no compiler context to leave");
+    }
+    CompilerContext *ctx = vec_pop(entered);
+    save(ctx);
+    ctx->active = false;
+    restore(vec_pop(outer));
+    // Release the lock taken above and the one taken by enter_context().
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&lock);
+}
@@ -14,13 +14,16 @@
 #include <unistd.h>
 #include "8cc.h"
 
-static Map *macros = &EMPTY_MAP;
+static Map *macros = &EMPTY_INTERNED_MAP;
 static Map *once = &EMPTY_MAP;
-static Map *keywords = &EMPTY_MAP;
-static Map *include_guard = &EMPTY_MAP;
+static Map *keywords = &EMPTY_INTERNED_MAP;
+static Map *include_guard = &EMPTY_INTERNED_MAP;
 static Vector *cond_incl_stack = &EMPTY_VECTOR;
 static Vector *std_include_path = &EMPTY_VECTOR;
+static Map *include_cache = &EMPTY_INTERNED_MAP;
 static struct tm now;
+static int counter; // for __COUNTER__
+static char *base_file; // for __BASE_FILE__
 static Token *cpp_token_zero = &(Token){ .kind = TNUMBER, .sval = "0" };
 static Token *cpp_token_one = &(Token){ .kind = TNUMBER, .sval = "1" };
 
@@ -81,7 +84,7 @@ static Macro *make_special_macro(SpecialMacroHandler *fn) {
 }
 
 static Token *make_macro_token(int position, bool is_vararg) {
-    Token *r = malloc(sizeof(Token));
+    Token *r = arena_alloc(ARENA_TOKEN, sizeof(Token));
     r->kind = TMACRO_PARAM;
     r->is_vararg = is_vararg;
     r->hideset = NULL;
@@ -92,7 +95,7 @@ static Token *make_macro_token(int position, bool is_vararg) {
 }
 
 static Token *copy_token(Token *tok) {
-    Token *r = malloc(sizeof(Token));
+    Token *r = arena_alloc(ARENA_TOKEN, sizeof(Token));
     *r = *tok;
     return r;
 }
@@ -210,8 +213,14 @@ static Vector *read_args(Token *tok, Macro *macro) {
 static Vector *add_hide_set(Vector *tokens, Set *hideset) {
     Vector *r = make_vector();
     for (int i = 0; i < vec_len(tokens); i++) {
-        Token *t = copy_token(vec_get(tokens, i));
-        t->hideset = set_union(t->hideset, hideset);
+        Token *t = vec_get(tokens, i);
+        // Sets are hash-consed, so if the union adds nothing the token
+        // can be shared instead of copied.
+        Set *hs = set_union(t->hideset, hideset);
+        if (hs != t->hideset) {
+            t = copy_token(t);
+            t->hideset = hs;
+        }
         vec_push(r, t);
     }
     return r;
@@ -247,7 +256,68 @@ static Token *stringize(Token *tmpl, Vector *args) {
     return r;
 }
 
+/*
+ * Macro statistics for -fmacro-stats
+ */
+
+typedef struct {
+    char *name;
+    long count;   // number of expansions
+    long ntokens; // tokens produced by substitution
+    int hideset;  // largest hideset given to the produced tokens
+    int depth;    // deepest nesting of argument pre-expansion
+    long nsec;    // time spent reading arguments and substituting
+} MacroStat;
+
+#define MACRO_STATS_TOP 20
+
+bool macro_stats;
+static Map *macro_stat_map = &EMPTY_INTERNED_MAP;
+static Vector *macro_stat_list = &EMPTY_VECTOR;
+static int expand_depth;
+
+static void count_expansion(char *name, Vector *tokens, Set *hideset, long start) {
+    MacroStat *s = map_get(macro_stat_map, name);
+    if (!s) {
+        s = calloc(1, sizeof(MacroStat));
+        s->name = name;
+        map_put(macro_stat_map, name, s);
+        vec_push(macro_stat_list, s);
+    }
+    s->count++;
+    s->ntokens += vec_len(tokens);
+    if (hideset && hideset->len > s->hideset)
+        s->hideset = hideset->len;
+    if (expand_depth > s->depth)
+        s->depth = expand_depth;
+    s->nsec += timer_now() - start;
+}
+
+static int comp_macro_stat(const void *x, const void *y) {
+    long a = (*(MacroStat **)x)->nsec;
+    long b = (*(MacroStat **)y)->nsec;
+    return (a < b) - (a > b);
+}
+
+// Prints the macros that took the most time to expand.
+void print_macro_stats() {
+    int n = vec_len(macro_stat_list);
+    MacroStat **v = malloc(n * sizeof(MacroStat *));
+    for (int i = 0; i < n; i++)
+        v[i] = vec_get(macro_stat_list, i);
+    qsort(v, n, sizeof(MacroStat *), comp_macro_stat);
+    fprintf(stderr, "macro-stats: macro                        count     tokens hideset depth         us\n");
+    for (int i = 0; i < n && i < MACRO_STATS_TOP; i++) {
+        MacroStat *s = v[i];
+        fprintf(stderr, "macro-stats: %-24s %9ld %10ld ", s->name, s->count, s->ntokens);
+        fprintf(stderr, "%7d %5d %10ld\n", s->hideset, s->depth, s->nsec / 1000);
+    }
+    fprintf(stderr, "macro-stats: %d macros expanded\n", n);
+}
+
 static Vector *expand_all(Vector *tokens, Token *tmpl) {
+    timer_start(TIMER_EXPAND_ALL);
+    expand_depth++;
     token_buffer_stash(vec_reverse(tokens));
     Vector *r = make_vector();
     for (;;) {
@@ -258,10 +328,13 @@ static Vector *expand_all(Vector *tokens, Token *tmpl) {
     }
     propagate_space(r, tmpl);
     token_buffer_unstash();
+    expand_depth--;
+    timer_stop(TIMER_EXPAND_ALL);
     return r;
 }
 
 static Vector *subst(Macro *macro, Vector *args, Set *hideset) {
+    timer_start(TIMER_SUBST);
     Vector *r = make_vector();
     int len = vec_len(macro->body);
     for (int i = 0; i < len; i++) {
@@ -315,7 +388,9 @@ static Vector *subst(Macro *macro, Vector *args, Set *hideset) {
         }
         vec_push(r, t0);
     }
-    return add_hide_set(r, hideset);
+    r = add_hide_set(r, hideset);
+    timer_stop(TIMER_SUBST);
+    return r;
 }
 
 static void unget_all(Vector *tokens) {
@@ -335,8 +410,11 @@ static Token *read_expand_newline() {
 
     switch (macro->kind) {
     case MACRO_OBJ: {
+        long start = macro_stats ? timer_now() : 0;
         Set *hideset = set_add(tok->hideset, name);
         Vector *tokens = subst(macro, NULL, hideset);
+        if (macro_stats)
+            count_expansion(name, tokens, hideset, start);
         propagate_space(tokens, tok);
         unget_all(tokens);
         return read_expand();
@@ -344,11 +422,14 @@ static Token *read_expand_newline() {
     case MACRO_FUNC: {
         if (!next('('))
             return tok;
+        long start = macro_stats ? timer_now() : 0;
         Vector *args = read_args(tok, macro);
         Token *rparen = peek_token();
         expect(')');
         Set *hideset = set_add(set_intersection(tok->hideset, rparen->hideset), name);
         Vector *tokens = subst(macro, args, hideset);
+        if (macro_stats)
+            count_expansion(name, tokens, hideset, start);
         propagate_space(tokens, tok);
         unget_all(tokens);
         return read_expand();
@@ -362,11 +443,12 @@ static Token *read_expand_newline() {
 }
 
 static Token *read_expand() {
-    for (;;) {
-        Token *tok = read_expand_newline();
-        if (tok->kind != TNEWLINE)
-            return tok;
-    }
+    timer_start(TIMER_CPP);
+    Token *tok = read_expand_newline();
+    while (tok->kind == TNEWLINE)
+        tok = read_expand_newline();
+    timer_stop(TIMER_CPP);
+    return tok;
 }
 
 static bool read_funclike_macro_params(Token *name, Map *param) {
@@ -599,7 +681,7 @@ static void read_endif(Token *hash) {
         return;
     Token *last = skip_newlines();
     if (ci->file != last->file)
-        map_put(include_guard, ci->file->name, ci->include_guard);
+        map_put(include_guard, intern(ci->file->name), ci->include_guard);
 }
 
 /*
@@ -668,28 +750,68 @@ static char *read_cpp_header_name(Token *hash, bool *std) {
     return join_paths(tokens);
 }
 
+// Include path resolution cache. Maps a directory to a map from file
+// names to full paths, or to NOT_FOUND if there's no such file in the
+// directory. Headers are looked up in the same directories over and over,
+// so this saves a fullpath() and an fopen() for most lookups.
+static char NOT_FOUND[] = "";
+
+static int nopen;          // number of headers opened
+static int nopen_missing;  // opens avoided because the file is known to be missing
+static int nopen_skipped;  // opens avoided because of #pragma once or an include guard
+
+static Map *dir_cache(char *dir) {
+    dir = intern(dir);
+    Map *r = map_get(include_cache, dir);
+    if (!r) {
+        r = make_interned_map();
+        map_put(include_cache, dir, r);
+    }
+    return r;
+}
+
 static bool guarded(char *path) {
-    char *guard = map_get(include_guard, path);
+    char *guard = map_get(include_guard, intern(path));
     bool r = (guard && map_get(macros, guard));
     define_obj_macro("__8cc_include_guard", r ? cpp_token_one : cpp_token_zero);
     return r;
 }
 
-static bool try_include(char *dir, char *filename, bool isimport) {
-    char *path = fullpath(format("%s/%s", dir, filename));
-    if (map_get(once, path))
-        return true;
-    if (guarded(path))
+static bool do_try_include(char *dir, char *filename, bool isimport) {
+    Map *cache = dir_cache(dir);
+    filename = intern(filename);
+    char *path = map_get(cache, filename);
+    if (path == NOT_FOUND) {
+        nopen_missing++;
+        return false;
+    }
+    if (!path)
+        path = intern(fullpath(format("%s/%s", dir, filename)));
+    if (map_get(once, path) || guarded(path)) {
+        nopen_skipped++;
+        map_put(cache, filename, path);
         return true;
+    }
     FILE *fp = fopen(path, "r");
-    if (!fp)
+    nopen++;
+    if (!fp) {
+        map_put(cache, filename, NOT_FOUND);
         return false;
+    }
+    map_put(cache, filename, path);
     if (isimport)
         map_put(once, path, (void *)1);
-    stream_push(make_file(fp, path));
+    stream_push(hcache_open(fp, path));
     return true;
 }
 
+static bool try_include(char *dir, char *filename, bool isimport) {
+    timer_start(TIMER_INCLUDE);
+    bool r = do_try_include(dir, filename, isimport);
+    timer_stop(TIMER_INCLUDE);
+    return r;
+}
+
 static void read_include(Token *hash, File *file, bool isimport) {
     bool std;
     char *filename = read_cpp_header_name(hash, &std);
@@ -738,6 +860,11 @@ static void read_include_next(Token *hash, File *file) {
     errort(hash, "cannot find header file: %s", filename);
 }
 
+void print_include_stat() {
+    fprintf(stderr, "stat-io: #include: %d opens, %d avoided (%d missing, %d guarded)\n",
+            nopen, nopen_missing + nopen_skipped, nopen_missing, nopen_skipped);
+}
+
 /*
  * #pragma
  */
@@ -898,11 +1025,10 @@ static void handle_pragma_macro(Token *tmpl) {
 }
 
 static void handle_base_file_macro(Token *tmpl) {
-    make_token_pushback(tmpl, TSTRING, get_base_file());
+    make_token_pushback(tmpl, TSTRING, base_file);
 }
 
 static void handle_counter_macro(Token *tmpl) {
-    static int counter = 0;
     make_token_pushback(tmpl, TNUMBER, format("%d", counter++));
 }
 
@@ -914,21 +1040,25 @@ static void handle_include_level_macro(Token *tmpl) {
  * Initializer
  */
 
+void set_base_file(char *path) {
+    base_file = path;
+}
+
 void add_include_path(char *path) {
     vec_push(std_include_path, path);
 }
 
 static void define_obj_macro(char *name, Token *value) {
-    map_put(macros, name, make_obj_macro(make_vector1(value)));
+    map_put(macros, intern(name), make_obj_macro(make_vector1(value)));
 }
 
 static void define_special_macro(char *name, SpecialMacroHandler *fn) {
-    map_put(macros, name, make_special_macro(fn));
+    map_put(macros, intern(name), make_special_macro(fn));
 }
 
 static void init_keywords() {
-#define op(id, str)         map_put(keywords, str, (void *)id);
-#define keyword(id, str, _) map_put(keywords, str, (void *)id);
+#define op(id, str)         map_put(keywords, intern(str), (void *)id);
+#define keyword(id, str, _) map_put(keywords, intern(str), (void *)id);
 #include "keyword.inc"
 #undef keyword
 #undef op
@@ -1001,6 +1131,8 @@ Token *peek_token() {
 }
 
 Token *read_token() {
+    if (current_file()->preprocessed)
+        return lex();
     Token *tok;
     for (;;) {
         tok = read_expand();
@@ -1012,3 +1144,80 @@ Token *read_token() {
         return maybe_convert_keyword(tok);
     }
 }
+
+/*
+ * Compiler contexts
+ */
+
+typedef struct {
+    Map *macros;
+    Map *once;
+    Map *keywords;
+    Map *include_guard;
+    Vector *cond_incl_stack;
+    Vector *std_include_path;
+    Map *include_cache;
+    struct tm now;
+    int counter;
+    char *base_file;
+    int nopen;
+    int nopen_missing;
+    int nopen_skipped;
+    Map *macro_stat_map;
+    Vector *macro_stat_list;
+    int expand_depth;
+} CppState;
+
+void *cpp_save_state() {
+    CppState *s = malloc(sizeof(CppState));
+    s->macros = macros;
+    s->once = once;
+    s->keywords = keywords;
+    s->include_guard = include_guard;
+    s->cond_incl_stack = cond_incl_stack;
+    s->std_include_path = std_include_path;
+    s->include_cache = include_cache;
+    s->now = now;
+    s->counter = counter;
+    s->base_file = base_file;
+    s->nopen = nopen;
+    s->nopen_missing = nopen_missing;
+    s->nopen_skipped = nopen_skipped;
+    s->macro_stat_map = macro_stat_map;
+    s->macro_stat_list = macro_stat_list;
+    s->expand_depth = expand_depth;
+    return s;
+}
+
+// NULL is the state before cpp_init().
+void cpp_restore_state(void *state) {
+    CppState *s = state;
+    if (!s) {
+        s = calloc(1, sizeof(CppState));
+        s->macros = make_interned_map();
+        s->once = make_map();
+        s->keywords = make_interned_map();
+        s->include_guard = make_interned_map();
+        s->cond_incl_stack = make_vector();
+        s->std_include_path = make_vector();
+        s->include_cache = make_interned_map();
+        s->macro_stat_map = make_interned_map();
+        s->macro_stat_list = make_vector();
+    }
+    macros = s->macros;
+    once = s->once;
+    keywords = s->keywords;
+    include_guard = s->include_guard;
+    cond_incl_stack = s->cond_incl_stack;
+    std_include_path = s->std_include_path;
+    include_cache = s->include_cache;
+    now = s->now;
+    counter = s->counter;
+    base_file = s->base_file;
+    nopen = s->nopen;
+    nopen_missing = s->nopen_missing;
+    nopen_skipped = s->nopen_skipped;
+    macro_stat_map = s->macro_stat_map;
+    macro_stat_list = s->macro_stat_list;
+    expand_depth = s->expand_depth;
+}
@@ -68,12 +68,22 @@ char *ty2s(Type *ty) {
     return do_ty2s(make_dict(), ty);
 }
 
+static void do_node2s(Buffer *b, Node *node);
+
+// Operands are written to the same buffer rather than formatted separately
+// and copied, which would be quadratic in the depth of the expression.
 static void uop_to_string(Buffer *b, char *op, Node *node) {
-    buf_printf(b, "(%s %s)", op, node2s(node->operand));
+    buf_printf(b, "(%s ", op);
+    do_node2s(b, node->operand);
+    buf_printf(b, ")");
 }
 
 static void binop_to_string(Buffer *b, char *op, Node *node) {
-    buf_printf(b, "(%s %s %s)", op, node2s(node->left), node2s(node->right));
+    buf_printf(b, "(%s ", op);
+    do_node2s(b, node->left);
+    buf_printf(b, " ");
+    do_node2s(b, node->right);
+    buf_printf(b, ")");
 }
 
 static void a2s_declinit(Buffer *b, Vector *initlist) {
@@ -99,6 +109,8 @@ static void do_node2s(Buffer *b, Node *node) {
             else if (node->ival == '\0') buf_printf(b, "'\\0'");
             else buf_printf(b, "'%c'", node->ival);
             break;
+        case KIND_BOOL:
+        case KIND_SHORT:
         case KIND_INT:
             buf_printf(b, "%d", node->ival);
             break;
@@ -137,7 +149,7 @@ static void do_node2s(Buffer *b, Node *node) {
     case AST_FUNCALL:
     case AST_FUNCPTR_CALL: {
         buf_printf(b, "(%s)%s(", ty2s(node->ty),
-                   node->kind == AST_FUNCALL ? node->fname : node2s(node));
+                   node->kind == AST_FUNCALL ? node->fname : node2s(node->fptr));
         for (int i = 0; i < vec_len(node->args); i++) {
             if (i > 0)
                 buf_printf(b, ",");
@@ -165,6 +177,19 @@ static void do_node2s(Buffer *b, Node *node) {
     case AST_GOTO:
         buf_printf(b, "goto(%s)", node->label);
         break;
+    case AST_SWITCH: {
+        static char *strategy[] = { "linear", "bsearch", "table" };
+        buf_printf(b, "(switch-%s %s", strategy[node->strategy], node2s(node->switchvar));
+        for (int i = 0; i < vec_len(node->cases); i++) {
+            Case *c = vec_get(node->cases, i);
+            if (c->beg == c->end)
+                buf_printf(b, " %ld=>%s", c->beg, c->label);
+            else
+                buf_printf(b, " %ld...%ld=>%s", c->beg, c->end, c->label);
+        }
+        buf_printf(b, " default=>%s)", node->defaultlabel);
+        break;
+    }
     case AST_DECL:
         buf_printf(b, "(decl %s %s",
                    ty2s(node->declvar->ty),
@@ -179,7 +204,9 @@ static void do_node2s(Buffer *b, Node *node) {
         buf_printf(b, "%s@%d", node2s(node->initval), node->initoff, ty2s(node->totype));
         break;
     case AST_CONV:
-        buf_printf(b, "(conv %s=>%s)", node2s(node->operand), ty2s(node->ty));
+        buf_printf(b, "(conv ");
+        do_node2s(b, node->operand);
+        buf_printf(b, "=>%s)", ty2s(node->ty));
         break;
     case AST_IF:
         buf_printf(b, "(if %s %s",
@@ -250,15 +277,11 @@ static void do_node2s(Buffer *b, Node *node) {
     case OP_LABEL_ADDR:
         buf_printf(b, "&&%s", node->label);
         break;
-    default: {
-        char *left = node2s(node->left);
-        char *right = node2s(node->right);
+    default:
         if (node->kind == OP_EQ)
-            buf_printf(b, "(== ");
+            binop_to_string(b, "==", node);
         else
-            buf_printf(b, "(%c ", node->kind);
-        buf_printf(b, "%s %s)", left, right);
-    }
+            binop_to_string(b, format("%c", node->kind), node);
     }
 }
 
@@ -313,6 +336,8 @@ char *tok2s(Token *tok) {
         return "(space)";
     case TMACRO_PARAM:
         return "(macro-param)";
+    case THEADER_NAME:
+        return tok->sval;
     }
     error("internal error: unknown token kind: %d", tok->kind);
 }
@@ -8,6 +8,17 @@
 bool enable_warning = true;
 bool warning_is_error = false;
 
+// If set, errors and warnings jump here instead of being reported.
+// This lets the header cache try to tokenize a file without committing
+// to the diagnostics that the attempt may produce.
+jmp_buf *error_jmp;
+
+// If set, diagnostics are appended to this vector as Diagnostic records
+// instead of being printed, and errors jump to diag_jmp instead of exiting.
+// Used by the library interface in lib8cc.c.
+Vector *diagnostics;
+jmp_buf *diag_jmp;
+
 static void print_error(char *line, char *pos, char *label, char *fmt, va_list args) {
     fprintf(stderr, isatty(fileno(stderr)) ? "\e[1;31m[%s]\e[0m " : "[%s] ", label);
     fprintf(stderr, "%s: %s: ", line, pos);
@@ -15,20 +26,46 @@ static void print_error(char *line, char *pos, char *label, char *fmt, va_list a
     fprintf(stderr, "\n");
 }
 
+static void add_diagnostic(bool error, char *pos, char *fmt, va_list args) {
+    Diagnostic *d = malloc(sizeof(Diagnostic));
+    d->error = error;
+    d->pos = pos;
+    d->msg = vformat(fmt, args);
+    vec_push(diagnostics, d);
+}
+
 void errorf(char *line, char *pos, char *fmt, ...) {
+    if (error_jmp)
+        longjmp(*error_jmp, 1);
     va_list args;
     va_start(args, fmt);
+    if (diagnostics) {
+        add_diagnostic(true, pos, fmt, args);
+        va_end(args);
+        longjmp(*diag_jmp, 1);
+    }
     print_error(line, pos, "ERROR", fmt, args);
     va_end(args);
     exit(1);
 }
 
 void warnf(char *line, char *pos, char *fmt, ...) {
+    // Check error_jmp first: a header that warns must not be cached even
+    // under -w, or a later build without -w would lose the warning.
+    if (error_jmp)
+        longjmp(*error_jmp, 1);
     if (!enable_warning)
         return;
     char *label = warning_is_error ? "ERROR" : "WARN";
     va_list args;
     va_start(args, fmt);
+    if (diagnostics) {
+        add_diagnostic(warning_is_error, pos, fmt, args);
+        va_end(args);
+        if (warning_is_error)
+            longjmp(*diag_jmp, 1);
+        return;
+    }
     print_error(line, pos, label, fmt, args);
     va_end(args);
     if (warning_is_error)
@@ -42,3 +79,29 @@ char *token_pos(Token *tok) {
     char *name = f->name ? f->name : "(unknown)";
     return format("%s:%d:%d", name, tok->line, tok->column);
 }
+
+/*
+ * Compiler contexts
+ */
+
+typedef struct {
+    jmp_buf *error_jmp;
+    Vector *diagnostics;
+    jmp_buf *diag_jmp;
+} ErrorState;
+
+void *error_save_state() {
+    ErrorState *s = malloc(sizeof(ErrorState));
+    s->error_jmp = error_jmp;
+    s->diagnostics = diagnostics;
+    s->diag_jmp = diag_jmp;
+    return s;
+}
+
+// NULL is the state in which diagnostics are printed.
+void error_restore_state(void *state) {
+    ErrorState *s = state ? state : &(ErrorState){};
+    error_jmp = s->error_jmp;
+    diagnostics = s->diagnostics;
+    diag_jmp = s->diag_jmp;
+}
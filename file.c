@@ -2,8 +2,11 @@
 
 /*
  * This file provides character input stream for C source code.
- * An input stream is either backed by stdio's FILE * or
- * backed by a string.
+ * An input stream is either backed by stdio's FILE *, backed by
+ * a memory-mapped file, or backed by a string. Regular files are
+ * mapped as a whole; FILE * is used only for pipes and stdin.
+ * A header loaded from the header cache (hcache.c) has no characters
+ * at all; the lexer returns its saved tokens instead.
  * The following input processing is done at this stage.
  *
  * - C11 5.1.1.2p1: "\r\n" or "\r" are canonicalized to "\n".
@@ -24,13 +27,65 @@
 // family of functions. These functions are used to get information about a file.
 #include <sys/stat.h>
 
+// The sys/mman.h header declares mmap(), which maps the contents of a file
+// directly into our address space, so reading a byte is a pointer dereference
+// rather than a call into stdio.
+#include <sys/mman.h>
+
 #include <sys/types.h>
 #include <unistd.h>
 #include "8cc.h"
 
+bool stat_io = false;
+
 static Vector *files = &EMPTY_VECTOR;
 static Vector *stashed = &EMPTY_VECTOR;
 
+// All files created by make_file(), in the order they were opened. Used only
+// to print the -fstat-io report, so files are recorded only with -fstat-io.
+static Vector *opened = &EMPTY_VECTOR;
+
+// Canonicalize "\r\n" and "\r" to "\n" in place, and return the new end of
+// the buffer. Most files contain no carriage returns at all, so we look for
+// the first one with memchr() and leave the buffer untouched if there is none.
+static char *canonicalize_newlines(char *p, char *end) {
+    char *q = memchr(p, '\r', end - p);
+    if (!q)
+        return end;
+    char *w = q;
+    for (char *r = q; r < end; r++) {
+        if (*r != '\r') {
+            *w++ = *r;
+            continue;
+        }
+        *w++ = '\n';
+        if (r + 1 < end && r[1] == '\n')
+            r++;
+    }
+    return w;
+}
+
+// Map the whole content of a regular file into memory. The mapping is private
+// and writable so that canonicalize_newlines() can rewrite it in place without
+// touching the file on disk. Returns false if the file cannot be mapped, in
+// which case the caller falls back to reading through stdio.
+static bool map_file(File *f, int fd, off_t size) {
+    if (size == 0) {
+        f->p = f->end = "";
+        return true;
+    }
+    char *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    f->nsyscall++;
+    if (p == MAP_FAILED)
+        return false;
+    f->map = p;
+    f->maplen = size;
+    f->p = p;
+    f->end = canonicalize_newlines(p, p + size);
+    f->nread = size;
+    return true;
+}
+
 // Convert the C standard type 'FILE' to the 8cc type 'File'. FILE used to be a
 // macro, before typedefs were added to C, which is why it was given the 
 // all-caps name. Note the all caps, it will be important to make sense of
@@ -55,9 +110,21 @@ File *make_file(FILE *file, char *name) {
     // imformation about the file and writes it to the struct st.
     if (fstat(fileno(file), &st) == -1)
         error("fstat failed: %s", strerror(errno));
+    r->nsyscall++;
 
     // st_mtime stores the time that the data in the file was last modified.
     r->mtime = st.st_mtime;
+
+    // If this is a regular file, we map it into memory and close the FILE,
+    // since we won't need stdio for it anymore. Pipes and terminals can't be
+    // mapped, so they keep using the FILE * we were given.
+    if (S_ISREG(st.st_mode) && map_file(r, fileno(file), st.st_size)) {
+        fclose(file);
+        r->file = NULL;
+        r->nsyscall++;
+    }
+    if (stat_io)
+        vec_push(opened, r);
     return r;
 }
 
@@ -73,17 +140,42 @@ File *make_file_string(char *s) {
     return r;
 }
 
-// Close the file handle of a File f.
-static void close_file(File *f) {
+// Create a file whose content has already been tokenized, such as a header
+// replayed from the header cache. The caller fills in the tokens. Such a file
+// is never read character by character: the lexer checks for it and hands
+// out the saved tokens instead.
+File *make_file_tokens(char *name, time_t mtime) {
+    File *r = calloc(1, sizeof(File));
+    r->name = name;
+    r->line = 1;
+    r->column = 1;
+    r->mtime = mtime;
+    r->tokens = make_vector();
+    if (stat_io)
+        vec_push(opened, r);
+    return r;
+}
+
+// Close the file handle of a File f, or unmap its content. The File can't
+// be read afterwards. Closing a File twice is harmless.
+void close_file(File *f) {
     // If our File is backed by a FILE, close it.
-    if (f->file)
+    if (f->file) {
         fclose(f->file);
+        f->file = NULL;
+    }
+    if (f->map) {
+        munmap(f->map, f->maplen);
+        f->map = NULL;
+    }
 }
 
 // Read a character from a FILE-backed File.
 static int readc_file(File *f) {
     // getc() reads the next character from a file.
     int c = getc(f->file);
+    if (c != EOF)
+        f->nread++;
 
     // If the current character is EOF, we check to see what the last character
     // was. If it wasn't an EOF or a newline, we need to return a newline, for
@@ -107,6 +199,8 @@ static int readc_file(File *f) {
         // the ungetc() function. Another example of C's silliness.
         if (c2 != '\n')
             ungetc(c2, f->file);
+        else
+            f->nread++;
         c = '\n';
     }
     // Update the character that was last read.
@@ -114,6 +208,27 @@ static int readc_file(File *f) {
     return c;
 }
 
+// Read a character from a memory-mapped File. Carriage returns were already
+// canonicalized when the file was mapped, so the only work left is splicing
+// backslash-newline pairs, which we do here while we have the raw pointer in
+// hand. This saves readc() from having to read and unread a lookahead
+// character for every backslash.
+static int readc_mmap(File *f) {
+    while (f->p + 1 < f->end && f->p[0] == '\\' && f->p[1] == '\n') {
+        f->p += 2;
+        f->line++;
+        f->column = 1;
+        f->last = '\n';
+    }
+    int c;
+    if (f->p == f->end)
+        c = (f->last == '\n' || f->last == EOF) ? EOF : '\n';
+    else
+        c = (unsigned char)*f->p++;
+    f->last = c;
+    return c;
+}
+
 // Read a character from a File backed by a string.
 static int readc_string(File *f) {
     int c;
@@ -152,6 +267,11 @@ static int get() {
     else if (f->file) {
         c = readc_file(f);
     } 
+
+    // A File with an end pointer is a memory-mapped file.
+    else if (f->end) {
+        c = readc_mmap(f);
+    }
     
     // Otherwise, the File must be backed by a string, so we read from that.
     else {
@@ -238,6 +358,14 @@ void stream_push(File *f) {
     vec_push(files, f);
 }
 
+// Pop the current file off the files vector. readc() does this on its own
+// when it hits the end of a file, but a pre-tokenized file is never read
+// with readc(), so the lexer pops it with this function when it runs out
+// of tokens.
+void stream_pop() {
+    close_file(vec_pop(files));
+}
+
 // Get the number of files.
 int stream_depth() {
     return vec_len(files);
@@ -261,3 +389,61 @@ void stream_stash(File *f) {
 void stream_unstash() {
     files = vec_pop(stashed);
 }
+
+// Close all files, including stashed ones. Called when a compilation
+// ends, which may be in the middle of a header if there was an error.
+void stream_close_all() {
+    for (;;) {
+        while (vec_len(files) > 0)
+            close_file(vec_pop(files));
+        if (vec_len(stashed) == 0)
+            return;
+        stream_unstash();
+    }
+}
+
+// Print the number of bytes read and system calls made for each input file.
+// Files read through stdio don't have a syscall count, because stdio does its
+// own buffering behind our back.
+void print_stat_io() {
+    long total = 0;
+    for (int i = 0; i < vec_len(opened); i++) {
+        File *f = vec_get(opened, i);
+        total += f->nread;
+        if (f->tokens && !f->end)
+            fprintf(stderr, "stat-io: %s: %d tokens (header cache)\n",
+                    f->name, vec_len(f->tokens));
+        else if (f->end)
+            fprintf(stderr, "stat-io: %s: %ld bytes, %d syscalls (mmap)\n",
+                    f->name, f->nread, f->nsyscall);
+        else
+            fprintf(stderr, "stat-io: %s: %ld bytes (stdio)\n", f->name, f->nread);
+    }
+    fprintf(stderr, "stat-io: total: %d files, %ld bytes\n", vec_len(opened), total);
+}
+
+// The stream state of a compilation, saved and restored by context.c when
+// switching between compiler contexts.
+typedef struct {
+    Vector *files;
+    Vector *stashed;
+    Vector *opened;
+} FileState;
+
+// Copy the current stream state into a newly allocated FileState.
+void *file_save_state() {
+    FileState *s = malloc(sizeof(FileState));
+    s->files = files;
+    s->stashed = stashed;
+    s->opened = opened;
+    return s;
+}
+
+// Reinstate a state saved by file_save_state(). NULL means the state of a
+// new compilation, in which no file has been opened yet.
+void file_restore_state(void *state) {
+    FileState *s = state;
+    files = s ? s->files : make_vector();
+    stashed = s ? s->stashed : make_vector();
+    opened = s ? s->opened : make_vector();
+}
@@ -1,5 +1,6 @@
 // Copyright 2012 Rui Ueyama. Released under the MIT license.
 
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +11,7 @@
 
 bool dumpstack = false;
 bool dumpsource = true;
+int optimize_level = 0;
 
 static char *REGS[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 static char *SREGS[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
@@ -20,9 +22,13 @@ static int stackpos;
 static int numgp;
 static int numfp;
 static FILE *outputfp;
+static Buffer *outputbuf; // with -fintegrated-as, assembly is kept here instead
 static Map *source_files = &EMPTY_MAP;
 static Map *source_lines = &EMPTY_MAP;
 static char *last_loc = "";
+static Vector *saved_regs = &EMPTY_VECTOR; // callee-saved registers used by the current function
+static int saved_regs_off;
+static Vector *func_lines; // the current function's output, kept for peephole()
 
 static void emit_addr(Node *node);
 static void emit_expr(Node *node);
@@ -31,6 +37,24 @@ static void do_emit_data(Vector *inits, int size, int off, int depth);
 static void emit_data(Node *v, int off, int depth);
 
 #define REGAREA_SIZE 176
+#define OUTBUF_SIZE 65536
+
+// A format string passed to emit(), translated for printf. Formats are
+// string literals, so they are looked up by address and translated once.
+typedef struct {
+    char *fmt;
+    char *tmpl;
+    int len;
+    bool plain; // true if tmpl has no conversions and can be copied as is
+} Template;
+
+// Assembly is written to this buffer and flushed with a single write()
+// when it fills up.
+static char outbuf[OUTBUF_SIZE];
+static int outlen;
+static Template **templates;
+static int ntemplates;
+static int templatesize;
 
 #define emit(...)        emitf(__LINE__, "\t" __VA_ARGS__)
 #define emit_noindent(...)  emitf(__LINE__, __VA_ARGS__)
@@ -60,51 +84,174 @@ static char *get_caller_list() {
     return buf_body(b);
 }
 
+static void write_all(char *p, int len) {
+    if (outputbuf) {
+        buf_append(outputbuf, p, len);
+        return;
+    }
+    while (len > 0) {
+        int n = write(fileno(outputfp), p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            error("write failed: %s", strerror(errno));
+        p += n;
+        len -= n;
+    }
+}
+
+static void flush_output() {
+    write_all(outbuf, outlen);
+    outlen = 0;
+}
+
+static void out(char *s, int len) {
+    if (outlen + len > OUTBUF_SIZE)
+        flush_output();
+    if (len > OUTBUF_SIZE) {
+        write_all(s, len);
+        return;
+    }
+    memcpy(outbuf + outlen, s, len);
+    outlen += len;
+}
+
+// Returns the number of bytes written.
+static int out_vprintf(char *fmt, va_list ap) {
+    int avail = OUTBUF_SIZE - outlen;
+    va_list aq;
+    va_copy(aq, ap);
+    int n = vsnprintf(outbuf + outlen, avail, fmt, aq);
+    va_end(aq);
+    if (n < avail) {
+        outlen += n;
+        return n;
+    }
+    out(vformat(fmt, ap), n);
+    return n;
+}
+
 void set_output_file(FILE *fp) {
+    fflush(fp);
     outputfp = fp;
 }
 
+void set_output_buffer(Buffer *b) {
+    outputbuf = b;
+}
+
 void close_output_file() {
-    fclose(outputfp);
+    flush_output();
+    if (outputfp)
+        fclose(outputfp);
 }
 
-static void emitf(int line, char *fmt, ...) {
-    // Replace "#" with "%%" so that vfprintf prints out "#" as "%".
-    char buf[256];
-    int i = 0;
+static int template_index(char *fmt) {
+    return (((uintptr_t)fmt >> 2) * 2654435761u) & (templatesize - 1);
+}
+
+static void grow_templates() {
+    Template **old = templates;
+    int oldsize = templatesize;
+    templatesize = templatesize ? templatesize * 2 : 1024;
+    templates = calloc(templatesize, sizeof(Template *));
+    for (int i = 0; i < oldsize; i++) {
+        if (!old[i])
+            continue;
+        int j = template_index(old[i]->fmt);
+        while (templates[j])
+            j = (j + 1) & (templatesize - 1);
+        templates[j] = old[i];
+    }
+    free(old);
+}
+
+// Replaces "#" with "%%" so that printf prints out "#" as "%". A format
+// without conversions is translated to its output instead.
+static Template *make_template(char *fmt) {
+    Template *t = malloc(sizeof(Template));
+    t->fmt = fmt;
+    t->plain = !strchr(fmt, '%');
+    Buffer *b = make_buffer();
     for (char *p = fmt; *p; p++) {
-        assert(i < sizeof(buf) - 3);
-        if (*p == '#') {
-            buf[i++] = '%';
-            buf[i++] = '%';
-        } else {
-            buf[i++] = *p;
-        }
+        if (*p != '#')
+            buf_write(b, *p);
+        else if (t->plain)
+            buf_write(b, '%');
+        else
+            buf_append(b, "%%", 2);
     }
-    buf[i] = '\0';
+    t->len = buf_len(b);
+    buf_write(b, '\0');
+    t->tmpl = buf_body(b);
+    return t;
+}
 
-    va_list args;
-    va_start(args, fmt);
-    int col = vfprintf(outputfp, buf, args);
-    va_end(args);
+static Template *get_template(char *fmt) {
+    if (ntemplates >= templatesize / 2)
+        grow_templates();
+    int i = template_index(fmt);
+    for (; templates[i]; i = (i + 1) & (templatesize - 1))
+        if (templates[i]->fmt == fmt)
+            return templates[i];
+    templates[i] = make_template(fmt);
+    ntemplates++;
+    return templates[i];
+}
+
+static char *stack_note(char *fmt, int col, int line) {
+    for (char *p = fmt; *p; p++)
+        if (*p == '\t')
+            col += TAB - 1;
+    int space = (28 - col) > 0 ? (30 - col) : 2;
+    return format("%*c %s:%d", space, '#', get_caller_list(), line);
+}
 
+static void emitf(int line, char *fmt, ...) {
+    Template *t = get_template(fmt);
+    if (func_lines) {
+        char *s = t->tmpl;
+        if (!t->plain) {
+            va_list args;
+            va_start(args, fmt);
+            s = vformat(t->tmpl, args);
+            va_end(args);
+        }
+        if (dumpstack)
+            s = format("%s%s", s, stack_note(fmt, strlen(s), line));
+        vec_push(func_lines, s);
+        return;
+    }
+
+    int col;
+    if (t->plain) {
+        out(t->tmpl, t->len);
+        col = t->len;
+    } else {
+        va_list args;
+        va_start(args, fmt);
+        col = out_vprintf(t->tmpl, args);
+        va_end(args);
+    }
     if (dumpstack) {
-        for (char *p = fmt; *p; p++)
-            if (*p == '\t')
-                col += TAB - 1;
-        int space = (28 - col) > 0 ? (30 - col) : 2;
-        fprintf(outputfp, "%*c %s:%d", space, '#', get_caller_list(), line);
+        char *note = stack_note(fmt, col, line);
+        out(note, strlen(note));
     }
-    fprintf(outputfp, "\n");
+    out("\n", 1);
 }
 
 static void emit_nostack(char *fmt, ...) {
-    fprintf(outputfp, "\t");
     va_list args;
     va_start(args, fmt);
-    vfprintf(outputfp, fmt, args);
+    if (func_lines) {
+        vec_push(func_lines, format("\t%s", vformat(fmt, args)));
+        va_end(args);
+        return;
+    }
+    out("\t", 1);
+    out_vprintf(fmt, args);
     va_end(args);
-    fprintf(outputfp, "\n");
+    out("\n", 1);
 }
 
 static char *get_int_reg(Type *ty, char r) {
@@ -304,6 +451,20 @@ static void emit_lsave(Type *ty, int off) {
     }
 }
 
+// A variable in a register holds its value sign-extended to 64 bits,
+// the same as what emit_lload() would read from memory.
+static void emit_rsave(Type *ty, char *reg) {
+    SAVE;
+    switch (ty->size) {
+    case 1: emit("movsbq #al, #%s", reg); break;
+    case 2: emit("movswq #ax, #%s", reg); break;
+    case 4: emit("movslq #eax, #%s", reg); break;
+    case 8: emit("mov #rax, #%s", reg); break;
+    default:
+        error("Unknown data size: %s: %d", ty2s(ty), ty->size);
+    }
+}
+
 static void do_emit_assign_deref(Type *ty, int off) {
     SAVE;
     emit("mov (#rsp), #rcx");
@@ -408,6 +569,10 @@ static void emit_store(Node *var) {
     case AST_DEREF: emit_assign_deref(var); break;
     case AST_STRUCT_REF: emit_assign_struct_ref(var->struc, var->ty, 0); break;
     case AST_LVAR:
+        if (var->lreg) {
+            emit_rsave(var->ty, var->lreg);
+            break;
+        }
         ensure_lvar_init(var);
         emit_lsave(var->ty, var->loff);
         break;
@@ -431,7 +596,49 @@ static void emit_to_bool(Type *ty) {
     emit("movzb #al, #eax");
 }
 
-static void emit_comp(char *inst, char *usiginst, Node *node) {
+// At -O1, a right operand that can be loaded by a single instruction
+// is loaded directly into a scratch register instead of being computed
+// in #rax and shuffled through the stack.
+static bool is_simple_operand(Node *node) {
+    if (!optimize_level)
+        return false;
+    switch (node->kind) {
+    case AST_LITERAL:
+        return is_inttype(node->ty);
+    case AST_LVAR:
+        if (node->lreg)
+            return true;
+        // fall through
+    case AST_GVAR:
+        return (is_inttype(node->ty) || node->ty->kind == KIND_PTR) && !node->lvarinit;
+    default:
+        return false;
+    }
+}
+
+static void emit_simple_operand(Node *node, char *reg) {
+    SAVE;
+    switch (node->kind) {
+    case AST_LITERAL:
+        emit("mov $%ld, #%s", node->ival, reg);
+        break;
+    case AST_LVAR:
+        if (node->lreg)
+            emit("mov #%s, #%s", node->lreg, reg);
+        else
+            emit("%s %d(#rbp), #%s", get_load_inst(node->ty), node->loff, reg);
+        break;
+    case AST_GVAR:
+        emit("%s %s(#rip), #%s", get_load_inst(node->ty), node->glabel, reg);
+        break;
+    default:
+        error("internal error: %s", node2s(node));
+    }
+}
+
+// Compares the operands of a comparison and returns the condition code
+// under which it's true.
+static char *emit_cmp(Node *node) {
     SAVE;
     if (is_flotype(node->left->ty)) {
         emit_expr(node->left);
@@ -444,19 +651,33 @@ static void emit_comp(char *inst, char *usiginst, Node *node) {
             emit("ucomisd #xmm0, #xmm1");
     } else {
         emit_expr(node->left);
-        push("rax");
-        emit_expr(node->right);
-        pop("rcx");
+        if (is_simple_operand(node->right)) {
+            emit("mov #rax, #rcx");
+            emit_simple_operand(node->right, "rax");
+        } else {
+            push("rax");
+            emit_expr(node->right);
+            pop("rcx");
+        }
         int kind = node->left->ty->kind;
         if (kind == KIND_LONG || kind == KIND_LLONG)
           emit("cmp #rax, #rcx");
         else
           emit("cmp #eax, #ecx");
     }
-    if (is_flotype(node->left->ty) || node->left->ty->usig)
-        emit("%s #al", usiginst);
-    else
-        emit("%s #al", inst);
+    bool usig = is_flotype(node->left->ty) || node->left->ty->usig;
+    switch (node->kind) {
+    case '<': return usig ? "b" : "l";
+    case OP_EQ: return "e";
+    case OP_LE: return usig ? "be" : "le";
+    case OP_NE: return "ne";
+    default: error("internal error: %s", node2s(node));
+    }
+}
+
+static void emit_comp(Node *node) {
+    SAVE;
+    emit("set%s #al", emit_cmp(node));
     emit("movzb #al, #eax");
 }
 
@@ -475,10 +696,14 @@ static void emit_binop_int_arith(Node *node) {
     default: error("invalid operator '%d'", node->kind);
     }
     emit_expr(node->left);
-    push("rax");
-    emit_expr(node->right);
-    emit("mov #rax, #rcx");
-    pop("rax");
+    if (is_simple_operand(node->right)) {
+        emit_simple_operand(node->right, "rcx");
+    } else {
+        push("rax");
+        emit_expr(node->right);
+        emit("mov #rax, #rcx");
+        pop("rax");
+    }
     if (node->kind == '/' || node->kind == '%') {
         if (node->ty->usig) {
           emit("xor #edx, #edx");
@@ -535,6 +760,8 @@ static void emit_load_convert(Type *to, Type *from) {
 
 static void emit_ret() {
     SAVE;
+    for (int i = 0; i < vec_len(saved_regs); i++)
+        emit("mov %d(#rbp), #%s", saved_regs_off - i * 8, vec_get(saved_regs, i));
     emit("leave");
     emit("ret");
 }
@@ -546,10 +773,12 @@ static void emit_binop(Node *node) {
         return;
     }
     switch (node->kind) {
-    case '<': emit_comp("setl", "setb", node); return;
-    case OP_EQ: emit_comp("sete", "sete", node); return;
-    case OP_LE: emit_comp("setle", "setna", node); return;
-    case OP_NE: emit_comp("setne", "setne", node); return;
+    case '<':
+    case OP_EQ:
+    case OP_LE:
+    case OP_NE:
+        emit_comp(node);
+        return;
     }
     if (is_inttype(node->ty))
         emit_binop_int_arith(node);
@@ -591,6 +820,7 @@ static void emit_save_literal(Node *node, Type *totype, int off) {
 static void emit_addr(Node *node) {
     switch (node->kind) {
     case AST_LVAR:
+        assert(!node->lreg);
         ensure_lvar_init(node);
         emit("lea %d(#rbp), #rax", node->loff);
         break;
@@ -701,11 +931,6 @@ static void set_reg_nums(Vector *args) {
     }
 }
 
-static void emit_je(char *label) {
-    emit("test #rax, #rax");
-    emit("je %s", label);
-}
-
 static void emit_label(char *label) {
     emit("%s:", label);
 }
@@ -714,16 +939,65 @@ static void emit_jmp(char *label) {
     emit("jmp %s", label);
 }
 
+static char *negate_cc(char *cc) {
+    static char *pairs[] = { "e", "ne", "l", "ge", "le", "g", "b", "ae", "be", "a" };
+    for (int i = 0; i < 10; i++)
+        if (!strcmp(pairs[i], cc))
+            return pairs[i ^ 1];
+    error("internal error: %s", cc);
+}
+
+// Jumps to a label if a condition is false, or if it's true when 'truth'
+// is set. At -O1, comparisons jump on the flags they set instead of
+// materializing a boolean and testing it, and &&, || and ! become
+// control flow.
+static void emit_branch(Node *node, char *label, bool truth) {
+    SAVE;
+    if (optimize_level) {
+        switch (node->kind) {
+        case '<':
+        case OP_EQ:
+        case OP_LE:
+        case OP_NE: {
+            char *cc = emit_cmp(node);
+            emit("j%s %s", truth ? cc : negate_cc(cc), label);
+            return;
+        }
+        case '!':
+            emit_branch(node->operand, label, !truth);
+            return;
+        case OP_LOGAND:
+        case OP_LOGOR: {
+            // "a && b" is false if a is false, and "a || b" is true if a
+            // is true. Otherwise it's b.
+            bool shortcut = (node->kind == OP_LOGOR);
+            if (truth == shortcut) {
+                emit_branch(node->left, label, truth);
+                emit_branch(node->right, label, truth);
+            } else {
+                char *skip = make_label();
+                emit_branch(node->left, skip, shortcut);
+                emit_branch(node->right, label, truth);
+                emit_label(skip);
+            }
+            return;
+        }
+        }
+    }
+    emit_expr(node);
+    emit("test #rax, #rax");
+    emit("%s %s", truth ? "jne" : "je", label);
+}
+
 static void emit_literal(Node *node) {
     SAVE;
     switch (node->ty->kind) {
     case KIND_BOOL:
     case KIND_CHAR:
     case KIND_SHORT:
-        emit("mov $%u, #rax", node->ival);
-        break;
     case KIND_INT:
-        emit("mov $%u, #rax", node->ival);
+        // Negative values are sign-extended, as if they had been computed.
+        emit("mov $%ld, #rax", node->ival);
         break;
     case KIND_LONG:
     case KIND_LLONG: {
@@ -829,9 +1103,6 @@ static void maybe_print_source_line(char *file, int line) {
             return;
         map_put(source_lines, file, lines);
     }
-    int len = 0;
-    for (char **p = lines; *p; p++)
-        len++;
     emit_nostack("# %s", lines[line - 1]);
 }
 
@@ -855,6 +1126,10 @@ static void maybe_print_source_loc(Node *node) {
 
 static void emit_lvar(Node *node) {
     SAVE;
+    if (node->lreg) {
+        emit("mov #%s, #rax", node->lreg);
+        return;
+    }
     ensure_lvar_init(node);
     emit_lload(node->ty, "rbp", node->loff);
 }
@@ -940,24 +1215,6 @@ static void classify_args(Vector *ints, Vector *floats, Vector *rest, Vector *ar
     }
 }
 
-static void save_arg_regs(int nints, int nfloats) {
-    SAVE;
-    assert(nints <= 6);
-    assert(nfloats <= 8);
-    for (int i = 0; i < nints; i++)
-        push(REGS[i]);
-    for (int i = 1; i < nfloats; i++)
-        push_xmm(i);
-}
-
-static void restore_arg_regs(int nints, int nfloats) {
-    SAVE;
-    for (int i = nfloats - 1; i > 0; i--)
-        pop_xmm(i);
-    for (int i = nints - 1; i >= 0; i--)
-        pop(REGS[i]);
-}
-
 static int emit_args(Vector *vals) {
     SAVE;
     int r = 0;
@@ -979,16 +1236,82 @@ static int emit_args(Vector *vals) {
     return r;
 }
 
-static void pop_int_args(int nints) {
+// At -O1, an argument that can be loaded by a single instruction is
+// loaded directly into its register, after all the other arguments have
+// been evaluated.
+static bool is_simple_arg(Node *node) {
+    if (is_simple_operand(node))
+        return true;
+    if (!optimize_level)
+        return false;
+    if (node->kind == AST_FUNCDESG)
+        return true;
+    if (node->kind != AST_ADDR)
+        return false;
+    Node *v = node->operand;
+    return v->kind == AST_GVAR || (v->kind == AST_LVAR && !v->lvarinit);
+}
+
+static void emit_simple_arg(Node *node, char *reg) {
     SAVE;
-    for (int i = nints - 1; i >= 0; i--)
-        pop(REGS[i]);
+    if (node->kind == AST_FUNCDESG)
+        emit("lea %s(#rip), #%s", node->fname, reg);
+    else if (node->kind == AST_ADDR && node->operand->kind == AST_LVAR)
+        emit("lea %d(#rbp), #%s", node->operand->loff, reg);
+    else if (node->kind == AST_ADDR)
+        emit("lea %s(#rip), #%s", node->operand->glabel, reg);
+    else
+        emit_simple_operand(node, reg);
 }
 
-static void pop_float_args(int nfloats) {
+// Argument registers are named "xmm0" to "xmm7" for floating point values.
+static void pop_arg(char *reg) {
     SAVE;
-    for (int i = nfloats - 1; i >= 0; i--)
-        pop_xmm(i);
+    if (reg[0] == 'x')
+        pop_xmm(reg[3] - '0');
+    else
+        pop(reg);
+}
+
+// Evaluates the values to be passed in registers and puts them in the
+// registers. Each value is computed in #rax or #xmm0, and a function call
+// in one clobbers the argument registers, so the values are pushed onto
+// the stack and popped into the registers after all of them have been
+// computed. The last one is moved to its register right away, and simple
+// ones are loaded at the end without going through the stack. Nothing is
+// live in the argument registers while the values are computed, because
+// parameters are spilled to the stack in the prologue.
+static void emit_reg_args(Vector *vals, Vector *regs) {
+    SAVE;
+    int last = -1;
+    for (int i = 0; i < vec_len(vals); i++)
+        if (!is_simple_arg(vec_get(vals, i)))
+            last = i;
+    for (int i = 0; i < last; i++) {
+        Node *v = vec_get(vals, i);
+        if (is_simple_arg(v))
+            continue;
+        emit_expr(v);
+        if (is_flotype(v->ty))
+            push_xmm(0);
+        else
+            push("rax");
+    }
+    if (last >= 0) {
+        Node *v = vec_get(vals, last);
+        char *reg = vec_get(regs, last);
+        emit_expr(v);
+        if (!is_flotype(v->ty))
+            emit("mov #rax, #%s", reg);
+        else if (strcmp(reg, "xmm0"))
+            emit("movsd #xmm0, #%s", reg);
+    }
+    for (int i = last - 1; i >= 0; i--)
+        if (!is_simple_arg(vec_get(vals, i)))
+            pop_arg(vec_get(regs, i));
+    for (int i = 0; i < vec_len(vals); i++)
+        if (is_simple_arg(vec_get(vals, i)))
+            emit_simple_arg(vec_get(vals, i), vec_get(regs, i));
 }
 
 static void maybe_booleanize_retval(Type *ty) {
@@ -1007,7 +1330,6 @@ static void emit_func_call(Node *node) {
     Vector *floats = make_vector();
     Vector *rest = make_vector();
     classify_args(ints, floats, rest, node->args);
-    save_arg_regs(vec_len(ints), vec_len(floats));
 
     bool padding = stackpos % 16;
     if (padding) {
@@ -1016,16 +1338,22 @@ static void emit_func_call(Node *node) {
     }
 
     int restsize = emit_args(vec_reverse(rest));
+    Vector *vals = make_vector();
+    Vector *regs = make_vector();
     if (isptr) {
-        emit_expr(node->fptr);
-        push("rax");
+        vec_push(vals, node->fptr);
+        vec_push(regs, "r11");
+    }
+    for (int i = 0; i < vec_len(ints); i++) {
+        vec_push(vals, vec_get(ints, i));
+        vec_push(regs, REGS[i]);
+    }
+    for (int i = 0; i < vec_len(floats); i++) {
+        vec_push(vals, vec_get(floats, i));
+        vec_push(regs, format("xmm%d", i));
     }
-    emit_args(ints);
-    emit_args(floats);
-    pop_float_args(vec_len(floats));
-    pop_int_args(vec_len(ints));
+    emit_reg_args(vals, regs);
 
-    if (isptr) pop("r11");
     if (ftype->hasva)
         emit("mov $%u, #eax", vec_len(floats));
 
@@ -1042,14 +1370,39 @@ static void emit_func_call(Node *node) {
         emit("add $8, #rsp");
         stackpos -= 8;
     }
-    restore_arg_regs(vec_len(ints), vec_len(floats));
     assert(opos == stackpos);
 }
 
+static void emit_reg_decl_init(Vector *inits, Node *var) {
+    SAVE;
+    if (vec_len(inits) == 0)
+        emit("xor #%s, #%s", var->lreg, var->lreg);
+    for (int i = 0; i < vec_len(inits); i++) {
+        Node *node = vec_get(inits, i);
+        Node *val = node->initval;
+        if (val->kind == AST_LITERAL && is_inttype(val->ty)) {
+            long v = val->ival;
+            switch (var->ty->size) {
+            case 1: v = (signed char)v; break;
+            case 2: v = (short)v; break;
+            case 4: v = (int)v; break;
+            }
+            emit("mov $%ld, #%s", v, var->lreg);
+        } else {
+            emit_expr(val);
+            emit_rsave(var->ty, var->lreg);
+        }
+    }
+}
+
 static void emit_decl(Node *node) {
     SAVE;
     if (!node->declinit)
         return;
+    if (node->declvar->lreg) {
+        emit_reg_decl_init(node->declinit, node->declvar);
+        return;
+    }
     emit_decl_init(node->declinit, node->declvar->loff, node->declvar->ty->size);
 }
 
@@ -1068,9 +1421,8 @@ static void emit_deref(Node *node) {
 
 static void emit_ternary(Node *node) {
     SAVE;
-    emit_expr(node->cond);
     char *ne = make_label();
-    emit_je(ne);
+    emit_branch(node->cond, ne, false);
     if (node->then)
         emit_expr(node->then);
     if (node->els) {
@@ -1090,6 +1442,95 @@ static void emit_goto(Node *node) {
     emit_jmp(node->newlabel);
 }
 
+/*
+ * Switch
+ *
+ * The switch value is in #rax, extended to 64 bits in a way that matches
+ * the case values (see sort_cases() in parse.c). Cases are sorted.
+ */
+
+// Emits "inst $imm, #reg". An immediate that doesn't fit in 32 bits is
+// loaded into #rdx first.
+static void emit_imm_op(char *inst, long imm, char *reg) {
+    if (imm == (int)imm) {
+        emit("%s $%ld, #%s", inst, imm, reg);
+        return;
+    }
+    emit("mov $%ld, #rdx", imm);
+    emit("%s #rdx, #%s", inst, reg);
+}
+
+static void emit_case_jump(Case *c) {
+    SAVE;
+    if (c->beg == c->end) {
+        emit_imm_op("cmp", c->beg, "rax");
+        emit("je %s", c->label);
+        return;
+    }
+    // [GNU] case i ... j is compiled to if ((unsigned)(x - i) <= j - i) goto <label>.
+    emit("mov #rax, #rcx");
+    emit_imm_op("sub", c->beg, "rcx");
+    emit_imm_op("cmp", c->end - c->beg, "rcx");
+    emit("jbe %s", c->label);
+}
+
+static void emit_switch_bsearch(Node *node, int lo, int hi) {
+    SAVE;
+    if (hi - lo <= 3) {
+        for (int i = lo; i < hi; i++)
+            emit_case_jump(vec_get(node->cases, i));
+        emit_jmp(node->defaultlabel);
+        return;
+    }
+    int mid = (lo + hi) / 2;
+    Case *c = vec_get(node->cases, mid);
+    char *left = make_label();
+    emit_imm_op("cmp", c->beg, "rax");
+    bool usig = node->switchvar->ty->size == 8 && node->switchvar->ty->usig;
+    emit("%s %s", usig ? "jb" : "jl", left);
+    emit_switch_bsearch(node, mid, hi);
+    emit_label(left);
+    emit_switch_bsearch(node, lo, mid);
+}
+
+// The table holds the offsets of the case labels from the table itself,
+// so that it doesn't need relocations.
+static void emit_switch_table(Node *node) {
+    SAVE;
+    Vector *cases = node->cases;
+    long min = ((Case *)vec_head(cases))->beg;
+    unsigned long range = ((Case *)vec_tail(cases))->end - min;
+    char *table = make_label();
+    emit_imm_op("sub", min, "rax");
+    emit_imm_op("cmp", range, "rax");
+    emit("ja %s", node->defaultlabel);
+    emit("lea %s(#rip), #rcx", table);
+    emit("movslq (#rcx,#rax,4), #rax");
+    emit("add #rcx, #rax");
+    emit("jmp *#rax");
+    emit_label(table);
+    unsigned long v = 0;
+    for (int i = 0; i < vec_len(cases); i++) {
+        Case *c = vec_get(cases, i);
+        for (; v < (unsigned long)(c->beg - min); v++)
+            emit(".long %s-%s", node->defaultlabel, table);
+        for (; v <= (unsigned long)(c->end - min); v++)
+            emit(".long %s-%s", c->label, table);
+    }
+}
+
+static void emit_switch(Node *node) {
+    SAVE;
+    Type *ty = node->switchvar->ty;
+    emit_expr(node->switchvar);
+    if (ty->size == 4 && ty->usig)
+        emit("mov #eax, #eax");
+    if (node->strategy == SWITCH_TABLE)
+        emit_switch_table(node);
+    else
+        emit_switch_bsearch(node, 0, vec_len(node->cases));
+}
+
 static void emit_return(Node *node) {
     SAVE;
     if (node->retval) {
@@ -1146,18 +1587,26 @@ static void emit_lognot(Node *node) {
 static void emit_bitand(Node *node) {
     SAVE;
     emit_expr(node->left);
-    push("rax");
-    emit_expr(node->right);
-    pop("rcx");
+    if (is_simple_operand(node->right)) {
+        emit_simple_operand(node->right, "rcx");
+    } else {
+        push("rax");
+        emit_expr(node->right);
+        pop("rcx");
+    }
     emit("and #rcx, #rax");
 }
 
 static void emit_bitor(Node *node) {
     SAVE;
     emit_expr(node->left);
-    push("rax");
-    emit_expr(node->right);
-    pop("rcx");
+    if (is_simple_operand(node->right)) {
+        emit_simple_operand(node->right, "rcx");
+    } else {
+        push("rax");
+        emit_expr(node->right);
+        pop("rcx");
+    }
     emit("or #rcx, #rax");
 }
 
@@ -1203,7 +1652,7 @@ static void emit_computed_goto(Node *node) {
     emit("jmp *#rax");
 }
 
-static void emit_expr(Node *node) {
+static void do_emit_expr(Node *node) {
     SAVE;
     maybe_print_source_loc(node);
     switch (node->kind) {
@@ -1227,6 +1676,7 @@ static void emit_expr(Node *node) {
         emit_ternary(node);
         return;
     case AST_GOTO:    emit_goto(node); return;
+    case AST_SWITCH:  emit_switch(node); return;
     case AST_LABEL:
         if (node->newlabel)
             emit_label(node->newlabel);
@@ -1312,13 +1762,13 @@ static void emit_data_primtype(Type *ty, Node *val, int depth) {
         emit(".byte %d", !!eval_intexpr(val, NULL));
         break;
     case KIND_CHAR:
-        emit(".byte %d", eval_intexpr(val, NULL));
+        emit(".byte %d", (int)eval_intexpr(val, NULL));
         break;
     case KIND_SHORT:
-        emit(".short %d", eval_intexpr(val, NULL));
+        emit(".short %d", (int)eval_intexpr(val, NULL));
         break;
     case KIND_INT:
-        emit(".long %d", eval_intexpr(val, NULL));
+        emit(".long %d", (int)eval_intexpr(val, NULL));
         break;
     case KIND_LONG:
     case KIND_LLONG:
@@ -1327,7 +1777,9 @@ static void emit_data_primtype(Type *ty, Node *val, int depth) {
             emit(".quad %s", val->newlabel);
             break;
         }
-        bool is_char_ptr = (val->operand->ty->kind == KIND_ARRAY && val->operand->ty->ptr->kind == KIND_CHAR);
+        // Only a conversion has an operand. A literal's union holds its value.
+        bool is_char_ptr = (val->kind == AST_CONV && val->operand->ty->kind == KIND_ARRAY
+                            && val->operand->ty->ptr->kind == KIND_CHAR);
         if (is_char_ptr) {
             emit_data_charptr(val->operand->sval, depth);
         } else if (val->kind == AST_GVAR) {
@@ -1359,6 +1811,8 @@ static void do_emit_data(Vector *inits, int size, int off, int depth) {
         Node *node = vec_get(inits, i);
         Node *v = node->initval;
         emit_padding(node, off);
+        size -= node->initoff - off;
+        off = node->initoff;
         if (node->totype->bitsize > 0) {
             assert(node->totype->bitoff == 0);
             long data = eval_intexpr(v, NULL);
@@ -1494,6 +1948,8 @@ static void emit_func_prologue(Node *func) {
     push_func_params(func->params, off);
     off -= vec_len(func->params) * 8;
 
+    saved_regs = optimize_level ? alloc_regs(func) : make_vector();
+
     int localarea = 0;
     for (int i = 0; i < vec_len(func->localvars); i++) {
         Node *v = vec_get(func->localvars, i);
@@ -1503,21 +1959,121 @@ static void emit_func_prologue(Node *func) {
         v->loff = off;
         localarea += size;
     }
+    saved_regs_off = off - 8;
+    localarea += vec_len(saved_regs) * 8;
     if (localarea) {
         emit("sub $%d, #rsp", localarea);
         stackpos += localarea;
     }
+    for (int i = 0; i < vec_len(saved_regs); i++)
+        emit("mov #%s, %d(#rbp)", vec_get(saved_regs, i), saved_regs_off - i * 8);
+    for (int i = 0; i < vec_len(func->params); i++) {
+        Node *v = vec_get(func->params, i);
+        if (v->lreg)
+            emit("%s %d(#rbp), #%s", get_load_inst(v->ty), v->loff, v->lreg);
+    }
+}
+
+static void emit_expr(Node *node) {
+    timer_start(TIMER_EMIT_EXPR);
+    do_emit_expr(node);
+    timer_stop(TIMER_EMIT_EXPR);
 }
 
 void emit_toplevel(Node *v) {
+    timer_start(TIMER_GEN);
     stackpos = 8;
     if (v->kind == AST_FUNC) {
+        // At -O1, the function is kept in memory until it's complete and
+        // cleaned up by the peephole optimizer.
+        if (optimize_level)
+            func_lines = make_vector();
         emit_func_prologue(v);
         emit_expr(v->body);
         emit_ret();
+        if (func_lines) {
+            Vector *lines = peephole(func_lines);
+            func_lines = NULL;
+            for (int i = 0; i < vec_len(lines); i++) {
+                char *s = vec_get(lines, i);
+                out(s, strlen(s));
+                out("\n", 1);
+            }
+        }
     } else if (v->kind == AST_DECL) {
         emit_global_var(v);
     } else {
         error("internal error");
     }
+    timer_stop(TIMER_GEN);
+    if (v->kind == AST_FUNC)
+        timer_function(v->fname);
+}
+
+/*
+ * Compiler contexts
+ */
+
+typedef struct {
+    Vector *functions;
+    int stackpos;
+    int numgp;
+    int numfp;
+    FILE *outputfp;
+    Buffer *outputbuf;
+    Map *source_files;
+    Map *source_lines;
+    char *last_loc;
+    Vector *saved_regs;
+    int saved_regs_off;
+    Vector *func_lines;
+    char *pending; // unflushed output
+    int npending;
+} GenState;
+
+void *gen_save_state() {
+    GenState *s = malloc(sizeof(GenState));
+    s->functions = functions;
+    s->stackpos = stackpos;
+    s->numgp = numgp;
+    s->numfp = numfp;
+    s->outputfp = outputfp;
+    s->outputbuf = outputbuf;
+    s->source_files = source_files;
+    s->source_lines = source_lines;
+    s->last_loc = last_loc;
+    s->saved_regs = saved_regs;
+    s->saved_regs_off = saved_regs_off;
+    s->func_lines = func_lines;
+    s->pending = malloc(outlen);
+    s->npending = outlen;
+    memcpy(s->pending, outbuf, outlen);
+    return s;
+}
+
+// NULL is the state before any output is set.
+void gen_restore_state(void *state) {
+    GenState *s = state;
+    if (!s) {
+        s = calloc(1, sizeof(GenState));
+        s->functions = make_vector();
+        s->source_files = make_map();
+        s->source_lines = make_map();
+        s->last_loc = "";
+        s->saved_regs = make_vector();
+    }
+    functions = s->functions;
+    stackpos = s->stackpos;
+    numgp = s->numgp;
+    numfp = s->numfp;
+    outputfp = s->outputfp;
+    outputbuf = s->outputbuf;
+    source_files = s->source_files;
+    source_lines = s->source_lines;
+    last_loc = s->last_loc;
+    saved_regs = s->saved_regs;
+    saved_regs_off = s->saved_regs_off;
+    func_lines = s->func_lines;
+    memcpy(outbuf, s->pending, s->npending);
+    outlen = s->npending;
 }
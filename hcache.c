@@ -0,0 +1,288 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Header cache
+ *
+ * Most translation units include the same system headers, and lexing
+ * them over and over again for every compilation is a waste of time.
+ * If a cache directory is given with -fheader-cache=<dir>, a header is
+ * tokenized in one go the first time it's included, and its tokens are
+ * saved to a file in that directory. When the header is included again,
+ * by this or a later compilation, the tokens are read back from the
+ * cache and replayed to the preprocessor without running the lexer.
+ *
+ * What we cache is the output of the lexer, not of the preprocessor.
+ * Directives and macros in the header are processed anew each time the
+ * header is replayed, so the cached tokens don't depend on what macros
+ * are defined at the point of inclusion. A cache entry is therefore
+ * valid as long as the header itself is unchanged, which we check by
+ * its path, device and inode numbers, modification time to the
+ * nanosecond and size.
+ *
+ * A cache file consists of a magic string, the header's identity as
+ * listed above, the number of tokens and the tokens themselves.
+ * The cache is only an optimization. Files we cannot read or write are
+ * ignored, and we fall back to reading the header directly.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "8cc.h"
+
+#define MAGIC "8cc-hcache-2\n"
+
+char *header_cache_dir;
+
+typedef struct {
+    char *p;
+    char *end;
+    jmp_buf fail; // jumped to if the file is truncated
+} Reader;
+
+static char *cache_file_name(char *path) {
+    return format("%s/%08x.tok", header_cache_dir, intern_hash(intern(path)));
+}
+
+/*
+ * Writer
+ */
+
+static void write_int(Buffer *b, int v) {
+    buf_append(b, (char *)&v, sizeof(v));
+}
+
+static void write_long(Buffer *b, long v) {
+    buf_append(b, (char *)&v, sizeof(v));
+}
+
+static void write_str(Buffer *b, char *s, int len) {
+    write_int(b, len);
+    buf_append(b, s, len);
+}
+
+static void write_tok(Buffer *b, Token *tok) {
+    buf_write(b, tok->kind);
+    if (tok->kind == TNEWLINE)
+        return;
+    buf_write(b, tok->space | (tok->bol << 1));
+    write_int(b, tok->line);
+    write_int(b, tok->column);
+    write_int(b, tok->count);
+    switch (tok->kind) {
+    case TIDENT:
+    case TNUMBER:
+        write_str(b, tok->sval, strlen(tok->sval));
+        break;
+    case TSTRING:
+        write_str(b, tok->sval, tok->slen);
+        write_int(b, tok->enc);
+        break;
+    case TCHAR:
+        write_int(b, tok->c);
+        write_int(b, tok->enc);
+        break;
+    case TKEYWORD:
+        write_int(b, tok->id);
+        break;
+    case TINVALID:
+        write_int(b, tok->c);
+        break;
+    case THEADER_NAME:
+        write_str(b, tok->sval, strlen(tok->sval));
+        write_int(b, tok->c);
+        break;
+    default:
+        error("internal error: cannot cache token: %s", tok2s(tok));
+    }
+}
+
+// Write to a temporary file first and rename it, so that a concurrent
+// compilation never sees a partially written cache file.
+static void write_cache(char *filename, char *path, struct stat *st, Vector *tokens) {
+    Buffer *b = make_buffer();
+    buf_append(b, MAGIC, strlen(MAGIC));
+    write_long(b, st->st_dev);
+    write_long(b, st->st_ino);
+    write_long(b, st->st_mtim.tv_sec);
+    write_long(b, st->st_mtim.tv_nsec);
+    write_long(b, st->st_size);
+    write_str(b, path, strlen(path));
+    write_int(b, vec_len(tokens));
+    for (int i = 0; i < vec_len(tokens); i++)
+        write_tok(b, vec_get(tokens, i));
+
+    mkdir(header_cache_dir, 0777);
+    char *tmp = format("%s.XXXXXX", filename);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return;
+    bool ok = (write(fd, buf_body(b), buf_len(b)) == buf_len(b));
+    close(fd);
+    if (!ok || rename(tmp, filename) < 0)
+        unlink(tmp);
+}
+
+/*
+ * Reader
+ */
+
+static char *read_bytes(Reader *r, int n) {
+    if (n < 0 || r->end - r->p < n)
+        longjmp(r->fail, 1);
+    char *p = r->p;
+    r->p += n;
+    return p;
+}
+
+static int read_int(Reader *r) {
+    int v;
+    memcpy(&v, read_bytes(r, sizeof(v)), sizeof(v));
+    return v;
+}
+
+static long read_long(Reader *r) {
+    long v;
+    memcpy(&v, read_bytes(r, sizeof(v)), sizeof(v));
+    return v;
+}
+
+static char *read_str(Reader *r, int *len) {
+    int n = read_int(r);
+    char *s = arena_alloc(ARENA_STRING, n + 1);
+    memcpy(s, read_bytes(r, n), n);
+    if (len)
+        *len = n;
+    return s;
+}
+
+static Token *read_tok(Reader *r) {
+    Token *tok = arena_alloc(ARENA_TOKEN, sizeof(Token));
+    tok->kind = *read_bytes(r, 1);
+    if (tok->kind == TNEWLINE)
+        return tok;
+    int flags = *read_bytes(r, 1);
+    tok->space = flags & 1;
+    tok->bol = (flags >> 1) & 1;
+    tok->line = read_int(r);
+    tok->column = read_int(r);
+    tok->count = read_int(r);
+    switch (tok->kind) {
+    case TIDENT:
+        tok->sval = intern(read_str(r, NULL));
+        break;
+    case TNUMBER:
+        tok->sval = read_str(r, NULL);
+        break;
+    case TSTRING:
+        tok->sval = read_str(r, &tok->slen);
+        tok->enc = read_int(r);
+        break;
+    case TCHAR:
+        tok->c = read_int(r);
+        tok->enc = read_int(r);
+        break;
+    case TKEYWORD:
+        tok->id = read_int(r);
+        break;
+    case TINVALID:
+        tok->c = read_int(r);
+        break;
+    case THEADER_NAME:
+        tok->sval = read_str(r, NULL);
+        tok->c = read_int(r);
+        break;
+    default:
+        longjmp(r->fail, 1);
+    }
+    return tok;
+}
+
+// Returns the tokens in the content of a cache file, or NULL if the file
+// is not for the header at path or is stale. The tokens don't point into
+// the content.
+static Vector *read_tokens(char *buf, long size, char *path, struct stat *st) {
+    Reader r = { buf, buf + size };
+    if (setjmp(r.fail))
+        return NULL;
+    if (memcmp(read_bytes(&r, strlen(MAGIC)), MAGIC, strlen(MAGIC)))
+        return NULL;
+    if (read_long(&r) != st->st_dev || read_long(&r) != st->st_ino)
+        return NULL;
+    if (read_long(&r) != st->st_mtim.tv_sec || read_long(&r) != st->st_mtim.tv_nsec)
+        return NULL;
+    if (read_long(&r) != st->st_size)
+        return NULL;
+    if (strcmp(read_str(&r, NULL), path))
+        return NULL;
+    int n = read_int(&r);
+    Vector *tokens = make_vector();
+    for (int i = 0; i < n; i++)
+        vec_push(tokens, read_tok(&r));
+    return tokens;
+}
+
+// Returns the cached tokens of the header at path, or NULL if the cache
+// file doesn't exist or is stale.
+static Vector *read_cache(char *filename, char *path, struct stat *st) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        return NULL;
+    struct stat cst;
+    if (fstat(fileno(fp), &cst) == -1) {
+        fclose(fp);
+        return NULL;
+    }
+    char *buf = malloc(cst.st_size);
+    size_t nread = fread(buf, 1, cst.st_size, fp);
+    fclose(fp);
+    Vector *tokens = NULL;
+    if (nread == cst.st_size)
+        tokens = read_tokens(buf, cst.st_size, path, st);
+    free(buf);
+    return tokens;
+}
+
+/*
+ * Entry point
+ */
+
+// Returns a File to read the header at path from. fp is an open stream
+// of the header, which is closed if the tokens come from the cache.
+File *hcache_open(FILE *fp, char *path) {
+    struct stat st;
+    if (!header_cache_dir || fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode))
+        return make_file(fp, path);
+
+    char *filename = cache_file_name(path);
+    Vector *tokens = read_cache(filename, path, &st);
+    if (tokens) {
+        fclose(fp);
+        File *f = make_file_tokens(path, st.st_mtime);
+        for (int i = 0; i < vec_len(tokens); i++) {
+            Token *tok = vec_get(tokens, i);
+            tok->file = f;
+            vec_push(f->tokens, tok);
+        }
+        return f;
+    }
+
+    // Cache miss. Tokenize the header and save the tokens for next time.
+    File *f = make_file(fp, path);
+    tokens = lex_all(f);
+    // The characters aren't needed anymore. Either we have the tokens or
+    // the header is opened again below.
+    close_file(f);
+    if (!tokens) {
+        // The header has to be read the usual way. Start over.
+        fp = fopen(path, "r");
+        if (!fp)
+            error("cannot reopen %s", path);
+        return make_file(fp, path);
+    }
+    write_cache(filename, path, &st, tokens);
+    f->tokens = tokens;
+    f->line = 1;
+    return f;
+}
@@ -0,0 +1,497 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Function inliner
+ *
+ * A function call costs a lot more than the instructions of a small
+ * function: the arguments are moved to registers, the callee sets up and
+ * tears down a stack frame, and the caller's values in caller-saved
+ * registers are lost. At -O1, calls to small static functions defined in
+ * the same file are replaced with copies of their bodies. Those are
+ * usually accessors and other helpers, often static inline functions in
+ * headers.
+ *
+ * Only leaf functions, which don't call any function themselves, are
+ * inlined, so that inlining never has to stop for recursion. Their bodies
+ * must not have more than inline_limit nodes, which -finline-limit=<n>
+ * sets. A call "f(x, y)" to "T f(A a, B b) { ... }" becomes a statement
+ * expression
+ *
+ *   ({ A a2; B b2; T r; a2 = x; b2 = y; ...; end: r; })
+ *
+ * where the body is copied with fresh local variables and labels, and
+ * each "return e;" becomes "r = e; goto end;". The new variables are
+ * added to the caller's local variables. Once all calls to a function are
+ * inlined, opt.c drops it as unused.
+ *
+ * With -fdump-inline, each call that is inlined and each static function
+ * that can't be inlined is printed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+bool dump_inline;
+int inline_limit = 40;
+
+static Map *candidates; // name -> static function that can be inlined
+
+// The parser shares the left side of "a op= b" between the two sides of
+// "a = a op b", so a call in it is reachable twice. If it were expanded,
+// the expansion would be emitted twice with the same labels. Such calls
+// are found before any call of a function is expanded and left alone.
+static Map *seen;   // "%p" of a call -> call, while looking for shared calls
+static Map *shared; // "%p" of a call -> call reachable more than once
+
+// The call being expanded
+static Node *callee;
+static Node *caller;
+static Vector *old_vars;
+static Vector *new_vars;
+static Map *new_labels;
+static Node *retvar;
+static char *retlabel;
+
+static Node *copy_node(Node *tmpl) {
+    Node *r = arena_alloc(ARENA_AST, sizeof(Node));
+    *r = *tmpl;
+    return r;
+}
+
+static bool is_scalar(Type *ty) {
+    return is_inttype(ty) || is_flotype(ty) || ty->kind == KIND_PTR;
+}
+
+/*
+ * Candidates
+ */
+
+static int count_vec(Vector *v, char **why);
+
+// Returns the number of nodes of a tree. why is set if the tree has
+// something that can't be inlined.
+static int count_nodes(Node *node, char **why) {
+    if (!node)
+        return 0;
+    switch (node->kind) {
+    case AST_LITERAL:
+    case AST_GVAR:
+    case AST_FUNCDESG:
+    case AST_GOTO:
+    case AST_LABEL:
+        return 1;
+    case AST_LVAR:
+        return 1 + (node->lvarinit ? count_vec(node->lvarinit, why) : 0);
+    case AST_FUNCALL:
+    case AST_FUNCPTR_CALL:
+        *why = "calls a function";
+        return 1;
+    case OP_LABEL_ADDR:
+    case AST_COMPUTED_GOTO:
+        *why = "takes the address of a label";
+        return 1;
+    case AST_DECL:
+        return 1 + (node->declinit ? count_vec(node->declinit, why) : 0);
+    case AST_INIT:
+        return 1 + count_nodes(node->initval, why);
+    case AST_IF:
+    case AST_TERNARY:
+        return 1 + count_nodes(node->cond, why) + count_nodes(node->then, why)
+            + count_nodes(node->els, why);
+    case AST_SWITCH:
+        return 1 + count_nodes(node->switchvar, why);
+    case AST_RETURN:
+        return 1 + count_nodes(node->retval, why);
+    case AST_COMPOUND_STMT:
+        return 1 + count_vec(node->stmts, why);
+    case AST_STRUCT_REF:
+        return 1 + count_nodes(node->struc, why);
+    case AST_CONV:
+    case AST_ADDR:
+    case AST_DEREF:
+    case OP_CAST:
+    case OP_PRE_INC:
+    case OP_PRE_DEC:
+    case OP_POST_INC:
+    case OP_POST_DEC:
+    case '!':
+    case '~':
+        return 1 + count_nodes(node->operand, why);
+    default:
+        return 1 + count_nodes(node->left, why) + count_nodes(node->right, why);
+    }
+}
+
+static int count_vec(Vector *v, char **why) {
+    int r = 0;
+    for (int i = 0; i < vec_len(v); i++)
+        r += count_nodes(vec_get(v, i), why);
+    return r;
+}
+
+// Returns why a function can't be inlined, or NULL if it can.
+static char *check_func(Node *func) {
+    Type *ty = func->ty;
+    if (ty->hasva)
+        return "takes variable arguments";
+    if (ty->rettype->kind != KIND_VOID && !is_scalar(ty->rettype))
+        return "returns a struct";
+    for (int i = 0; i < vec_len(func->params); i++)
+        if (!is_scalar(((Node *)vec_get(func->params, i))->ty))
+            return "takes a struct";
+    char *why = NULL;
+    int n = count_nodes(func->body, &why);
+    if (why)
+        return why;
+    if (n > inline_limit)
+        return format("has %d nodes, more than the limit of %d", n, inline_limit);
+    return NULL;
+}
+
+/*
+ * Copying a function body
+ */
+
+static Node *copy(Node *node);
+
+static Vector *copy_vec(Vector *v) {
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(v); i++)
+        vec_push(r, copy(vec_get(v, i)));
+    return r;
+}
+
+static Node *new_var(Node *var) {
+    for (int i = 0; i < vec_len(old_vars); i++)
+        if (vec_get(old_vars, i) == var)
+            return vec_get(new_vars, i);
+    error("internal error: unknown variable %s in %s", var->varname, callee->fname);
+}
+
+static char *new_label(char *label) {
+    char *r = map_get(new_labels, label);
+    if (!r) {
+        r = make_label();
+        map_put(new_labels, label, r);
+    }
+    return r;
+}
+
+static Node *make_goto(Node *orig, char *label) {
+    return copy_node(&(Node){ AST_GOTO, NULL, orig->sourceLoc, .label = label, .newlabel = label });
+}
+
+static Node *make_block(Node *orig, Type *ty, Vector *stmts) {
+    return copy_node(&(Node){ AST_COMPOUND_STMT, ty, orig->sourceLoc, .stmts = stmts });
+}
+
+static Node *make_assign(Node *var, Node *val) {
+    return copy_node(&(Node){ '=', var->ty, val->sourceLoc, .left = var, .right = val });
+}
+
+// "return e;" becomes "r = e; goto end;".
+static Node *copy_return(Node *node) {
+    Vector *v = make_vector();
+    if (node->retval) {
+        Node *val = copy(node->retval);
+        vec_push(v, retvar ? make_assign(retvar, val) : val);
+    }
+    vec_push(v, make_goto(node, retlabel));
+    return make_block(node, NULL, v);
+}
+
+static Node *copy(Node *node) {
+    if (!node)
+        return NULL;
+    if (node->kind == AST_LVAR)
+        return new_var(node);
+    Node *r = copy_node(node);
+    switch (node->kind) {
+    case AST_LITERAL:
+    case AST_GVAR:
+    case AST_FUNCDESG:
+        return r;
+    case AST_GOTO:
+        r->label = r->newlabel = new_label(node->newlabel);
+        return r;
+    case AST_LABEL:
+        if (node->newlabel)
+            r->label = r->newlabel = new_label(node->newlabel);
+        return r;
+    case AST_DECL:
+        r->declvar = new_var(node->declvar);
+        if (node->declinit)
+            r->declinit = copy_vec(node->declinit);
+        return r;
+    case AST_INIT:
+        r->initval = copy(node->initval);
+        return r;
+    case AST_IF:
+    case AST_TERNARY:
+        r->cond = copy(node->cond);
+        r->then = copy(node->then);
+        r->els = copy(node->els);
+        return r;
+    case AST_SWITCH:
+        r->switchvar = copy(node->switchvar);
+        r->cases = make_vector();
+        for (int i = 0; i < vec_len(node->cases); i++) {
+            Case *c = vec_get(node->cases, i);
+            Case *c2 = malloc(sizeof(Case));
+            *c2 = *c;
+            c2->label = new_label(c->label);
+            vec_push(r->cases, c2);
+        }
+        r->defaultlabel = new_label(node->defaultlabel);
+        return r;
+    case AST_RETURN:
+        return copy_return(node);
+    case AST_COMPOUND_STMT:
+        r->stmts = copy_vec(node->stmts);
+        return r;
+    case AST_STRUCT_REF:
+        r->struc = copy(node->struc);
+        return r;
+    case AST_CONV:
+    case AST_ADDR:
+    case AST_DEREF:
+    case OP_CAST:
+    case OP_PRE_INC:
+    case OP_PRE_DEC:
+    case OP_POST_INC:
+    case OP_POST_DEC:
+    case '!':
+    case '~':
+        r->operand = copy(node->operand);
+        return r;
+    default:
+        r->left = copy(node->left);
+        r->right = copy(node->right);
+        return r;
+    }
+}
+
+// Makes a fresh local variable of the caller for a variable of the callee.
+static Node *add_var(Node *var) {
+    Node *r = copy_node(var);
+    r->loff = 0;
+    r->lreg = NULL;
+    vec_push(old_vars, var);
+    vec_push(new_vars, r);
+    vec_push(caller->localvars, r);
+    return r;
+}
+
+// Returns a statement expression that does what a call does.
+static Node *expand(Node *call, Node *func) {
+    callee = func;
+    old_vars = make_vector();
+    new_vars = make_vector();
+    new_labels = make_map();
+    Vector *v = make_vector();
+    for (int i = 0; i < vec_len(func->params); i++)
+        vec_push(v, copy_node(&(Node){ AST_DECL, NULL, call->sourceLoc,
+                                       .declvar = add_var(vec_get(func->params, i)) }));
+    for (int i = 0; i < vec_len(func->localvars); i++)
+        add_var(vec_get(func->localvars, i));
+    for (int i = 0; i < vec_len(func->localvars); i++) {
+        Node *var = vec_get(new_vars, vec_len(func->params) + i);
+        if (var->lvarinit)
+            var->lvarinit = copy_vec(var->lvarinit);
+    }
+    retvar = NULL;
+    if (func->ty->rettype->kind != KIND_VOID) {
+        retvar = copy_node(&(Node){ AST_LVAR, func->ty->rettype, call->sourceLoc,
+                                    .varname = "(return value)" });
+        vec_push(caller->localvars, retvar);
+        vec_push(v, copy_node(&(Node){ AST_DECL, NULL, call->sourceLoc, .declvar = retvar }));
+    }
+    for (int i = 0; i < vec_len(call->args); i++)
+        vec_push(v, make_assign(vec_get(new_vars, i), vec_get(call->args, i)));
+    retlabel = make_label();
+    vec_push(v, copy(func->body));
+    vec_push(v, copy_node(&(Node){ AST_LABEL, NULL, call->sourceLoc, .label = retlabel, .newlabel = retlabel }));
+    if (retvar)
+        vec_push(v, retvar);
+    return make_block(call, call->ty, v);
+}
+
+/*
+ * Call sites
+ */
+
+// The arguments must have the types of the parameters, since the copies
+// of the parameters are assigned as they are. They may not if the function
+// has an old-style definition, whose arguments are only promoted.
+static bool args_match(Node *call, Node *func) {
+    if (vec_len(call->args) != vec_len(func->params))
+        return false;
+    for (int i = 0; i < vec_len(call->args); i++) {
+        Type *a = ((Node *)vec_get(call->args, i))->ty;
+        Type *p = ((Node *)vec_get(func->params, i))->ty;
+        if (a->kind != p->kind)
+            return false;
+    }
+    return true;
+}
+
+static void inline_vec(Vector *v);
+
+static void inline_calls(Node *node) {
+    if (!node)
+        return;
+    switch (node->kind) {
+    case AST_LITERAL:
+    case AST_GVAR:
+    case AST_FUNCDESG:
+    case AST_GOTO:
+    case AST_LABEL:
+    case OP_LABEL_ADDR:
+        return;
+    case AST_LVAR:
+        if (node->lvarinit)
+            inline_vec(node->lvarinit);
+        return;
+    case AST_FUNCALL: {
+        inline_vec(node->args);
+        Node *func = map_get(candidates, node->fname);
+        if (!func)
+            return;
+        char *key = format("%p", node);
+        if (seen) {
+            if (map_get(seen, key))
+                map_put(shared, key, node);
+            map_put(seen, key, node);
+            return;
+        }
+        if (map_get(shared, key) || !args_match(node, func))
+            return;
+        if (dump_inline)
+            fprintf(stderr, "inline: %s: inlined %s\n", caller->fname, func->fname);
+        *node = *expand(node, func);
+        return;
+    }
+    case AST_FUNCPTR_CALL:
+        inline_calls(node->fptr);
+        inline_vec(node->args);
+        return;
+    case AST_DECL:
+        if (node->declinit)
+            inline_vec(node->declinit);
+        return;
+    case AST_INIT:
+        inline_calls(node->initval);
+        return;
+    case AST_IF:
+    case AST_TERNARY:
+        inline_calls(node->cond);
+        inline_calls(node->then);
+        inline_calls(node->els);
+        return;
+    case AST_SWITCH:
+        inline_calls(node->switchvar);
+        return;
+    case AST_RETURN:
+        inline_calls(node->retval);
+        return;
+    case AST_COMPOUND_STMT:
+        inline_vec(node->stmts);
+        return;
+    case AST_STRUCT_REF:
+        inline_calls(node->struc);
+        return;
+    case AST_CONV:
+    case AST_ADDR:
+    case AST_DEREF:
+    case AST_COMPUTED_GOTO:
+    case OP_CAST:
+    case OP_PRE_INC:
+    case OP_PRE_DEC:
+    case OP_POST_INC:
+    case OP_POST_DEC:
+    case '!':
+    case '~':
+        inline_calls(node->operand);
+        return;
+    default:
+        inline_calls(node->left);
+        inline_calls(node->right);
+    }
+}
+
+static void inline_vec(Vector *v) {
+    for (int i = 0; i < vec_len(v); i++)
+        inline_calls(vec_get(v, i));
+}
+
+void inline_functions(Vector *toplevels) {
+    candidates = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind != AST_FUNC || !v->ty->isstatic)
+            continue;
+        char *why = check_func(v);
+        if (!why)
+            map_put(candidates, v->fname, v);
+        else if (dump_inline)
+            fprintf(stderr, "inline: %s: not inlined: %s\n", v->fname, why);
+    }
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        caller = vec_get(toplevels, i);
+        if (caller->kind != AST_FUNC)
+            continue;
+        seen = make_map();
+        shared = make_map();
+        inline_calls(caller->body);
+        seen = NULL;
+        inline_calls(caller->body);
+    }
+}
+
+/*
+ * Compiler contexts
+ */
+
+typedef struct {
+    Map *candidates;
+    Map *seen;
+    Map *shared;
+    Node *callee;
+    Node *caller;
+    Vector *old_vars;
+    Vector *new_vars;
+    Map *new_labels;
+    Node *retvar;
+    char *retlabel;
+} InlineState;
+
+void *inline_save_state() {
+    InlineState *s = malloc(sizeof(InlineState));
+    s->candidates = candidates;
+    s->seen = seen;
+    s->shared = shared;
+    s->callee = callee;
+    s->caller = caller;
+    s->old_vars = old_vars;
+    s->new_vars = new_vars;
+    s->new_labels = new_labels;
+    s->retvar = retvar;
+    s->retlabel = retlabel;
+    return s;
+}
+
+// NULL is the state before inline_functions() is called.
+void inline_restore_state(void *state) {
+    InlineState *s = state ? state : &(InlineState){};
+    candidates = s->candidates;
+    seen = s->seen;
+    shared = s->shared;
+    callee = s->callee;
+    caller = s->caller;
+    old_vars = s->old_vars;
+    new_vars = s->new_vars;
+    new_labels = s->new_labels;
+    retvar = s->retvar;
+    retlabel = s->retlabel;
+}
@@ -0,0 +1,89 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * String interning.
+ *
+ * intern() returns a canonical copy of a string, so that two interned
+ * strings are equal if and only if they are the same pointer. The lexer
+ * interns every identifier it reads, which lets the symbol tables that are
+ * keyed by identifiers (macros, keywords, variables, tags) compare keys
+ * with == instead of strcmp().
+ *
+ * The hash of an interned string is computed once, when the string is
+ * first interned, and is stored right in front of the string's first
+ * character. intern_hash() reads it back without looking at the string.
+ * Each interned string is also numbered in the order it was interned;
+ * intern_id() returns that number.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+#define INIT_SIZE 1024
+
+typedef struct {
+    int id;
+    uint32_t hash;
+    char str[];
+} Interned;
+
+static char **table;
+static int size;
+static int nelem;
+
+static Interned *header(char *s) {
+    return (Interned *)(s - offsetof(Interned, str));
+}
+
+uint32_t intern_hash(char *s) {
+    return header(s)->hash;
+}
+
+int intern_id(char *s) {
+    return header(s)->id;
+}
+
+static void insert(char **tab, int mask, char *s) {
+    int i = intern_hash(s) & mask;
+    while (tab[i])
+        i = (i + 1) & mask;
+    tab[i] = s;
+}
+
+static void grow() {
+    int newsize = size ? size * 2 : INIT_SIZE;
+    char **tab = calloc(newsize, sizeof(char *));
+    for (int i = 0; i < size; i++)
+        if (table[i])
+            insert(tab, newsize - 1, table[i]);
+    table = tab;
+    size = newsize;
+}
+
+// Interns the first len bytes of s, which need not be NUL-terminated.
+char *intern_len(char *s, int len) {
+    if (nelem >= size / 2)
+        grow();
+    uint32_t h = hash_bytes(s, len);
+    int mask = size - 1;
+    int i = h & mask;
+    for (; table[i]; i = (i + 1) & mask) {
+        char *t = table[i];
+        if (intern_hash(t) == h && !strncmp(t, s, len) && t[len] == '\0')
+            return t;
+    }
+    Interned *r = arena_alloc(ARENA_STRING, sizeof(Interned) + len + 1);
+    r->id = nelem;
+    r->hash = h;
+    memcpy(r->str, s, len);
+    r->str[len] = '\0';
+    table[i] = r->str;
+    nelem++;
+    return r->str;
+}
+
+char *intern(char *s) {
+    return intern_len(s, strlen(s));
+}
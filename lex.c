@@ -50,11 +50,17 @@ static char *pos_string(Pos *p) {
 
 static void skip_block_comment(void);
 
-void lex_init(char *filename) {
+void lex_init() {
 
     // A vector is a resizeable container of pointers. Here, we create a 
     // new empty vector and push it onto the 'buffers' vector.
     vec_push(buffers, make_vector());
+}
+
+// Opens the main input file. This is separate from lex_init() because the
+// predefined macros are read before we know which file to compile when 8cc
+// is given more than one.
+void lex_open(char *filename) {
 
     // If the filename equals "-"...
     if (!strcmp(filename, "-")) {
@@ -68,8 +74,9 @@ void lex_init(char *filename) {
     if (!fp)
         error("Cannot open %s: %s", filename, strerror(errno));
 
-    // Push the file onto the vector.
-    stream_push(make_file(fp, filename));
+    // Push the file onto the vector. The file may be the output of
+    // "8cc -E --binary", in which case tokstream_open() reads its tokens.
+    stream_push(tokstream_open(fp, filename));
 }
 
 // Get the position in the current file, including a delta from the current column.
@@ -85,8 +92,8 @@ static void mark() {
 
 // Make a token struct.
 static Token *make_token(Token *tmpl) {
-    // Allocate memory for the token.
-    Token *r = malloc(sizeof(Token));
+    // Allocate memory for the token from the token arena.
+    Token *r = arena_alloc(ARENA_TOKEN, sizeof(Token));
 
     // Set the token's contents to be like the provided template.
     *r = *tmpl;
@@ -105,7 +112,8 @@ static Token *make_token(Token *tmpl) {
     return r;
 }
 
-// Make an identifier token.
+// Make an identifier token. p has to be an interned string, so that the
+// symbol tables in the preprocessor and the parser can compare it by pointer.
 static Token *make_ident(char *p) {
     return make_token(&(Token){ TIDENT, .sval = p });
 }
@@ -233,12 +241,42 @@ static void skip_string() {
             readc();
 }
 
+// The same as skip_cond_incl() below, for a file replayed from the header
+// cache. The file has already been tokenized, so we look for directives
+// among its tokens. The # of the directive that ends the block is left
+// in the file to be read next.
+static void skip_cond_incl_tokens(File *f) {
+    int nest = 0;
+    int len = vec_len(f->tokens);
+    while (f->tokpos < len - 1) {
+        Token *hash = vec_get(f->tokens, f->tokpos++);
+        if (!hash->bol || !is_keyword(hash, '#'))
+            continue;
+        Token *tok = vec_get(f->tokens, f->tokpos);
+        if (tok->kind != TIDENT)
+            continue;
+        if (!nest && (is_ident(tok, "else") || is_ident(tok, "elif") || is_ident(tok, "endif"))) {
+            f->tokpos--;
+            return;
+        }
+        if (is_ident(tok, "if") || is_ident(tok, "ifdef") || is_ident(tok, "ifndef"))
+            nest++;
+        else if (nest && is_ident(tok, "endif"))
+            nest--;
+    }
+    f->tokpos = len;
+}
+
 // Skips a block of code excluded from input by #if, #ifdef and the like.
 // C11 6.10 says that code within #if and #endif needs to be a sequence of
 // valid tokens even if skipped. However, in reality, most compilers don't
 // tokenize nor validate contents. We don't do that, too.
 // This function is to skip code until matching #endif as fast as we can.
 void skip_cond_incl() {
+    if (current_file()->tokens) {
+        skip_cond_incl_tokens(current_file());
+        return;
+    }
     int nest = 0;
     for (;;) {
         // 'bol' stands for 'beginning of line'.
@@ -542,13 +580,12 @@ static Token *read_ident(char c) {
             continue;
         }
 
-        // If the found character isn't a valid identifier character, unread it
-        // and finish the string with a \0.
+        // If the found character isn't a valid identifier character, unread it.
         unreadc(c);
-        buf_write(b, '\0');
 
-        // Create the identifier token.
-        return make_ident(buf_body(b));
+        // Create the identifier token. The identifier is hashed only once,
+        // here, when it's interned; later lookups reuse the hash.
+        return make_ident(intern_len(buf_body(b), buf_len(b)));
     }
 }
 
@@ -726,7 +763,7 @@ static Token *do_read_token() {
         if (next('.')) {
             if (next('.'))
                 return make_keyword(KELLIPSIS);
-            return make_ident("..");
+            return make_ident(intern(".."));
         }
         return make_keyword('.');
     
@@ -794,20 +831,10 @@ static bool buffer_empty() {
     return vec_len(buffers) == 1 && vec_len(vec_head(buffers)) == 0;
 }
 
-// Reads a header file name for #include.
-//
-// Filenames after #include need a special tokenization treatment.
-// A filename string may be quoted by < and > instead of "".
-// Even if it's quoted by "", it's still different from a regular string token.
-// For example, \ in this context is not interpreted as a quote.
-// Thus, we cannot use lex() to read a filename.
-//
-// That the C preprocessor requires a special lexer behavior only for
-// #include is a violation of layering. Ideally, the lexer should be
-// agnostic about higher layers status. But we need this for the C grammar.
-char *read_header_file_name(bool *std) {
-    if (!buffer_empty())
-        return NULL;
+// Reads a header file name, quoted by "" or <>, from the current file.
+// Sets *std to true if it's quoted by <>. Returns NULL if the file
+// doesn't continue with a quote.
+static char *read_header_name(bool *std) {
     skip_space();
     Pos p = get_pos(0);
     char close;
@@ -833,6 +860,36 @@ char *read_header_file_name(bool *std) {
     return buf_body(b);
 }
 
+// Reads a header file name for #include.
+//
+// Filenames after #include need a special tokenization treatment.
+// A filename string may be quoted by < and > instead of "".
+// Even if it's quoted by "", it's still different from a regular string token.
+// For example, \ in this context is not interpreted as a quote.
+// Thus, we cannot use lex() to read a filename.
+//
+// That the C preprocessor requires a special lexer behavior only for
+// #include is a violation of layering. Ideally, the lexer should be
+// agnostic about higher layers status. But we need this for the C grammar.
+//
+// A file replayed from the header cache has the file name saved as a
+// THEADER_NAME token by lex_all().
+char *read_header_file_name(bool *std) {
+    if (!buffer_empty())
+        return NULL;
+    File *f = current_file();
+    if (!f->tokens)
+        return read_header_name(std);
+    if (f->tokpos == vec_len(f->tokens))
+        return NULL;
+    Token *tok = vec_get(f->tokens, f->tokpos);
+    if (tok->kind != THEADER_NAME)
+        return NULL;
+    f->tokpos++;
+    *std = (tok->c == '<');
+    return tok->sval;
+}
+
 bool is_keyword(Token *tok, int c) {
     return (tok->kind == TKEYWORD) && (tok->id == c);
 }
@@ -870,13 +927,8 @@ Token *lex_string(char *s) {
     return r;
 }
 
-// The main lexer function.
-Token *lex() {
-    Vector *buf = vec_tail(buffers);
-    if (vec_len(buf) > 0)
-        return vec_pop(buf);
-    if (vec_len(buffers) > 1)
-        return eof_token;
+// Reads a token from the current file, skipping spaces.
+static Token *read_file_token() {
     bool bol = (current_file()->column == 1);
     Token *tok = do_read_token();
     while (tok->kind == TSPACE) {
@@ -886,3 +938,115 @@ Token *lex() {
     tok->bol = bol;
     return tok;
 }
+
+static bool is_include(Token *tok) {
+    return is_ident(tok, "include") || is_ident(tok, "include_next") || is_ident(tok, "import");
+}
+
+// Tokenizes the whole file f in one go, for the header cache (hcache.c).
+// The operand of #include is saved as a THEADER_NAME token, because the
+// cpp reads it with read_header_file_name() rather than lex().
+//
+// Returns NULL if the file cannot be replayed from tokens. That is the case
+// if lexing fails or warns -- such diagnostics must be reported only when
+// the offending code is actually read, as it may be in a skipped #if block --
+// or if the file has #line directives, which change the current position
+// while it's being read.
+Vector *lex_all(File *f) {
+    stream_stash(f);
+    Vector *r = make_vector();
+    jmp_buf jb;
+    error_jmp = &jb;
+    if (setjmp(jb)) {
+        error_jmp = NULL;
+        stream_unstash();
+        return NULL;
+    }
+    for (;;) {
+        Token *tok = read_file_token();
+        if (tok->kind == TEOF)
+            break;
+        vec_push(r, tok);
+        if (!tok->bol || !is_keyword(tok, '#'))
+            continue;
+        tok = read_file_token();
+        if (tok->kind == TNUMBER || is_ident(tok, "line"))
+            longjmp(jb, 1);
+        if (tok->kind != TEOF)
+            vec_push(r, tok);
+        if (!is_include(tok))
+            continue;
+        mark();
+        bool std;
+        char *name = read_header_name(&std);
+        if (!name)
+            continue;
+        Token *hdr = make_token(&(Token){ THEADER_NAME, .sval = name, .c = std ? '<' : '"' });
+        f->ntok--;
+        vec_push(r, hdr);
+    }
+    error_jmp = NULL;
+    stream_unstash();
+    return r;
+}
+
+// The main lexer function.
+static Token *do_lex() {
+    Vector *buf = vec_tail(buffers);
+    if (vec_len(buf) > 0)
+        return vec_pop(buf);
+    if (vec_len(buffers) > 1)
+        return eof_token;
+    // A file from the header cache is replayed token by token.
+    while (current_file()->tokens) {
+        File *f = current_file();
+        if (f->tokpos < vec_len(f->tokens)) {
+            // Keep the line number up to date for __LINE__.
+            Token *tok = vec_get(f->tokens, f->tokpos++);
+            if (tok->kind == TNEWLINE)
+                f->line++;
+            else
+                f->line = tok->line;
+            return tok;
+        }
+        if (stream_depth() == 1)
+            return eof_token;
+        stream_pop();
+    }
+    return read_file_token();
+}
+
+Token *lex() {
+    timer_start(TIMER_LEX);
+    Token *r = do_lex();
+    timer_stop(TIMER_LEX);
+    return r;
+}
+
+// The lexer state of a compilation, saved and restored by context.c when
+// switching between compiler contexts.
+typedef struct {
+    Vector *buffers;
+    Pos pos;
+} LexState;
+
+// Copy the current lexer state into a newly allocated LexState.
+void *lex_save_state() {
+    LexState *s = malloc(sizeof(LexState));
+    s->buffers = buffers;
+    s->pos = pos;
+    return s;
+}
+
+// Reinstate a state saved by lex_save_state(). NULL means the state of a new
+// compilation, before lex_init() is called.
+void lex_restore_state(void *state) {
+    LexState *s = state;
+    if (!s) {
+        buffers = make_vector();
+        pos = (Pos){ 0, 0 };
+        return;
+    }
+    buffers = s->buffers;
+    pos = s->pos;
+}
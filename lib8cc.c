@@ -0,0 +1,77 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Library interface
+ *
+ * compile_string() compiles C source text held in memory and returns the
+ * assembly or the object file in a buffer, so that a host program such as
+ * an editor, a test harness or a JIT can use 8cc without spawning it and
+ * without going through temporary files.
+ *
+ * Each call runs in a fresh compiler context (context.c), so calls don't
+ * see each other's macros or declarations. Calls may be made from several
+ * threads, but they are serialized. Options such as -O1 or -Werror are
+ * shared with the command line driver and apply to every call.
+ *
+ * Errors and warnings are not printed. They are appended to the caller's
+ * vector as Diagnostic records instead, and an error makes errorf() jump
+ * back here rather than exit the process, so compile_string() just returns
+ * false. Memory allocated for a failed compilation is not reclaimed, as
+ * usual in this compiler, but the files it opened are closed.
+ */
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include "8cc.h"
+
+static void compile(char *name, char *src, int output, Buffer *out) {
+    lex_init();
+    cpp_init();
+    parse_init();
+    Buffer *asmbuf = make_buffer();
+    set_output_buffer(asmbuf);
+
+    File *f = make_file_string(src);
+    f->name = name;
+    stream_push(f);
+    set_base_file(name);
+
+    Vector *toplevels = read_toplevels();
+    if (optimize_level)
+        toplevels = optimize(toplevels);
+    for (int i = 0; i < vec_len(toplevels); i++)
+        emit_toplevel(vec_get(toplevels, i));
+    close_output_file();
+
+    if (output == OUTPUT_ASM) {
+        buf_append(out, buf_body(asmbuf), buf_len(asmbuf));
+        return;
+    }
+    // There's no as(1) to fall back to here, so input the integrated
+    // assembler doesn't understand is an error.
+    if (!assemble_to_buffer(asmbuf, out))
+        error("%s: cannot assemble", name);
+}
+
+// Compiles src, which is named name in diagnostics and __FILE__, and
+// appends the result to out. Diagnostics are appended to diags. Returns
+// false, leaving out untouched, if there was an error.
+bool compile_string(char *name, char *src, int output, Buffer *out, Vector *diags) {
+    Vector *saved_diags = diagnostics;
+    jmp_buf *saved_jmp = diag_jmp;
+    jmp_buf env;
+    CompilerContext *ctx = make_context();
+    enter_context(ctx);
+    diagnostics = diags;
+    diag_jmp = &env;
+    bool ok = false;
+    if (!setjmp(env)) {
+        compile(name, src, output, out);
+        ok = true;
+    }
+    stream_close_all();
+    diagnostics = saved_diags;
+    diag_jmp = saved_jmp;
+    leave_context();
+    return ok;
+}
@@ -1,5 +1,11 @@
 // Copyright 2012 Rui Ueyama. Released under the MIT license.
 
+// Character classification functions such as isdigit().
+#include <ctype.h>
+
+// Defines 'errno', the variable that system calls set to say what went wrong.
+#include <errno.h>
+
 // libgen.h is a header file that, uh, 'for historical reasons', provides 
 // definitions for pattern matching functions. It's part of POSIX.
 #include <libgen.h>
@@ -29,10 +35,14 @@
 #include "8cc.h"
 
 static char *infile;
+static Vector *infiles = &EMPTY_VECTOR;
+static int jobs = 1;
 static char *outfile;
 static char *asmfile;
 static bool dumpast;
+static bool lexonly;
 static bool cpponly;
+static bool binary;
 static bool dumpasm;
 static bool dontlink;
 static Buffer *cppdefs;
@@ -40,23 +50,36 @@ static Vector *tmpfiles = &EMPTY_VECTOR;
 
 static void usage(int exitcode) {
     fprintf(exitcode ? stderr : stdout,
-            "Usage: 8cc [ -E ][ -a ] [ -h ] <file>\n\n"
+            "Usage: 8cc [ -E ][ -a ] [ -h ] <file>...\n\n"
             "\n"
             "  -I<path>          add to include path\n"
             "  -E                print preprocessed source code\n"
+            "  --binary          With -E, print tokens in binary for a later 8cc run\n"
             "  -D name           Predefine name as a macro\n"
             "  -D name=def\n"
             "  -S                Stop before assembly (default)\n"
             "  -c                Do not run linker (default)\n"
             "  -U name           Undefine name\n"
             "  -fdump-ast        print AST\n"
+            "  -flex-only        Tokenize the input without preprocessing it, for benchmarking\n"
             "  -fdump-stack      Print stacktrace\n"
             "  -fno-dump-source  Do not emit source code as assembly comment\n"
+            "  -fstat-io         Print bytes read and syscalls made per input file\n"
+            "  -fmem-stats       Print memory usage per allocation arena\n"
+            "  -ftime-report     Print time spent in each phase, file and function\n"
+            "  -fmacro-stats     Print the macros that take the most time to expand\n"
+            "  -fdump-peephole   Print how many instructions each peephole rule removed\n"
+            "  -fdump-inline     Print which function calls are inlined\n"
+            "  -finline-limit=<n> Inline static leaf functions of up to <n> AST nodes\n"
+            "  -fheader-cache=<dir> Cache tokenized headers in <dir>\n"
+            "  -fintegrated-as   Write object files directly instead of running as\n"
             "  -o filename       Output to the specified file\n"
+            "  -j <number>       Compile up to <number> input files in parallel\n"
             "  -g                Do nothing at this moment\n"
             "  -Wall             Enable all warnings\n"
             "  -Werror           Make all warnings into errors\n"
-            "  -O<number>        Does nothing at this moment\n"
+            "  -O<number>        Optimization level. -O1 keeps local variables in registers,\n"
+            "                    inlines small functions and runs the peephole optimizer\n"
             "  -m64              Output 64-bit code (default)\n"
             "  -w                Disable all warnings\n"
             "  -h                print this help\n"
@@ -100,6 +123,20 @@ static FILE *open_asmfile() {
     return fp;
 }
 
+// Runs as(1) on the assembly file to make an object file.
+static void run_as() {
+    pid_t pid = fork();
+    if (pid < 0) perror("fork");
+    if (pid == 0) {
+        execlp("as", "as", "-o", outfile, "-c", asmfile, (char *)NULL);
+        perror("execl failed");
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (status < 0)
+        error("as failed");
+}
+
 static void parse_warnings_arg(char *s) {
     if (!strcmp(s, "error"))
         warning_is_error = true;
@@ -110,10 +147,30 @@ static void parse_warnings_arg(char *s) {
 static void parse_f_arg(char *s) {
     if (!strcmp(s, "dump-ast"))
         dumpast = true;
+    else if (!strcmp(s, "lex-only"))
+        lexonly = true;
     else if (!strcmp(s, "dump-stack"))
         dumpstack = true;
     else if (!strcmp(s, "no-dump-source"))
         dumpsource = false;
+    else if (!strcmp(s, "stat-io"))
+        stat_io = true;
+    else if (!strcmp(s, "mem-stats"))
+        mem_stats = true;
+    else if (!strcmp(s, "time-report"))
+        time_report = true;
+    else if (!strcmp(s, "macro-stats"))
+        macro_stats = true;
+    else if (!strcmp(s, "dump-peephole"))
+        dump_peephole = true;
+    else if (!strcmp(s, "dump-inline"))
+        dump_inline = true;
+    else if (!strncmp(s, "inline-limit=", 13))
+        inline_limit = atoi(s + 13);
+    else if (!strcmp(s, "integrated-as"))
+        integrated_as = true;
+    else if (!strncmp(s, "header-cache=", 13))
+        header_cache_dir = s + 13;
     else
         usage(1);
 }
@@ -123,11 +180,31 @@ static void parse_m_arg(char *s) {
         error("Only 64 is allowed for -m, but got %s", s);
 }
 
+// getopt() only knows single-letter options, so the only long option,
+// --binary, is taken out of argv before getopt() sees it. --binary makes -E
+// write a token stream (see tokstream.c) that 8cc can compile without
+// preprocessing it again. Returns the new argc.
+static int parse_long_options(int argc, char **argv) {
+    int j = 0;
+    bool done = false; // seen "--", after which everything is a file name
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "--"))
+            done = true;
+        if (!done && !strcmp(argv[i], "--binary"))
+            binary = true;
+        else
+            argv[j++] = argv[i];
+    }
+    argv[j] = NULL;
+    return j;
+}
+
 // Function to parse the provided command line options.
 static void parseopt(int argc, char **argv) {
 
     // Create a buffer called 'cppdefs'.
     cppdefs = make_buffer();
+    argc = parse_long_options(argc, argv);
 
     // 'Infinite' loop
     for (;;) {
@@ -139,7 +216,7 @@ static void parseopt(int argc, char **argv) {
         // themselves, and the final argument is a string containing characters
         // that define which arguments are legit. If the character is followed
         // by a ':', then the option needs an argument. 
-        int opt = getopt(argc, argv, "I:ED:O:SU:W:acd:f:gm:o:hw");
+        int opt = getopt(argc, argv, "I:ED:O:SU:W:acd:f:gj:m:o:hw");
         
         // getopt() returns -1 when there are no more options.
         if (opt == -1)
@@ -172,8 +249,11 @@ static void parseopt(int argc, char **argv) {
             break;
         }
 
-        // This option does nothing.
-        case 'O': break;
+        // Sets the optimization level. Levels that aren't numbers, such as
+        // -Os, count as 1.
+        case 'O':
+            optimize_level = isdigit(*optarg) ? atoi(optarg) : 1;
+            break;
 
         // This option sets the 'dumpasm' flag, which causes the assembly to be
         // dumped instead of being assembled.
@@ -202,6 +282,14 @@ static void parseopt(int argc, char **argv) {
         // This option does nothing.
         case 'g': break;
 
+        // Sets the number of files compiled at the same time when there's
+        // more than one input file.
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1)
+                error("-j takes a positive number, but got %s", optarg);
+            break;
+
         // This option defines the output file.
         case 'o': outfile = optarg; break;
 
@@ -218,23 +306,37 @@ static void parseopt(int argc, char **argv) {
         }
     }
 
-    // optind is the index of the next argument to be parsed. If the number of
-    // options provided was invalid, we print the usage information.
-    if (optind != argc - 1)
+    // optind is the index of the next argument to be parsed. If there are no
+    // arguments left, there's no input file, so we print the usage information.
+    if (optind == argc)
         usage(1);
 
-    if (!dumpast && !cpponly && !dumpasm && !dontlink)
+    if (!dumpast && !cpponly && !dumpasm && !dontlink && !lexonly)
         error("One of -a, -c, -E or -S must be specified");
+    if (binary && !cpponly)
+        error("--binary is only meaningful with -E");
 
-    // The input file should be the final argument.
+    // The input files are the remaining arguments.
+    for (int i = optind; i < argc; i++)
+        vec_push(infiles, argv[i]);
     infile = argv[optind];
-}
 
-char *get_base_file() {
-    return infile;
+    // Each input file gets an output file named after it, so there's no way
+    // to name them all with -o. -E and -fdump-ast print to stdout, where the
+    // output of several files would be interleaved.
+    if (vec_len(infiles) > 1) {
+        if (outfile)
+            error("-o cannot be used with more than one input file");
+        if (cpponly || dumpast)
+            error("-E and -fdump-ast take only one input file");
+    }
 }
 
 static void preprocess() {
+    if (binary) {
+        write_token_stream(stdout);
+        exit(0);
+    }
     for (;;) {
         Token *tok = read_token();
         if (tok->kind == TEOF)
@@ -249,6 +351,164 @@ static void preprocess() {
     exit(0);
 }
 
+// Compiles infile. This is the whole compiler for a single input file.
+static int compile() {
+    // The I/O statistics are printed at exit, so that they are also reported
+    // when we stop early, e.g. after preprocessing with -E.
+    if (stat_io && (atexit(print_include_stat) || atexit(print_stat_io)))
+        perror("atexit");
+    if (mem_stats && atexit(print_mem_stats))
+        perror("atexit");
+    if (time_report && atexit(print_time_report))
+        perror("atexit");
+    if (macro_stats && atexit(print_macro_stats))
+        perror("atexit");
+    if (dump_peephole && atexit(print_peephole_stats))
+        perror("atexit");
+
+    lex_open(infile);
+    set_base_file(infile);
+    // -flex-only measures the lexer alone. The tokens are read and dropped.
+    if (lexonly) {
+        while (lex()->kind != TEOF)
+            ;
+        return 0;
+    }
+    // With -fintegrated-as, the assembly is kept in memory and turned into
+    // an object file by asm.c, so there's no temporary file to write and no
+    // as(1) process to spawn. It doesn't apply if we aren't making an object
+    // file in the first place.
+    bool inmemory = integrated_as && !dumpast && !dumpasm && !cpponly;
+    Buffer *asmbuf = make_buffer();
+    if (inmemory)
+        set_output_buffer(asmbuf);
+    else
+        set_output_file(open_asmfile());
+
+    if (cpponly)
+        preprocess();
+
+    Vector *toplevels = read_toplevels();
+    if (optimize_level)
+        toplevels = optimize(toplevels);
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (dumpast)
+            printf("%s", node2s(v));
+        else
+            emit_toplevel(v);
+    }
+
+    close_output_file();
+
+    if (!dumpast && !dumpasm) {
+        if (!outfile)
+            outfile = replace_suffix(base(infile), 'o');
+        if (inmemory && assemble(asmbuf, outfile))
+            return 0;
+        // The integrated assembler gives up on input it doesn't understand.
+        // In that case we write the assembly out and use as(1) after all.
+        if (inmemory) {
+            FILE *fp = open_asmfile();
+            if (fwrite(buf_body(asmbuf), 1, buf_len(asmbuf), fp) != buf_len(asmbuf))
+                perror("fwrite");
+            fclose(fp);
+        }
+        run_as();
+    }
+    return 0;
+}
+
+// Copies what a child process wrote to its log, i.e. its diagnostics, to
+// our stderr.
+static void print_log(FILE *log) {
+    char buf[4096];
+    fseek(log, 0, SEEK_SET);
+    for (;;) {
+        int n = fread(buf, 1, sizeof(buf), log);
+        if (n <= 0)
+            break;
+        fwrite(buf, 1, n, stderr);
+    }
+    fclose(log);
+}
+
+// Compiles every input file, each in a child process of its own, running up
+// to 'jobs' of them at the same time.
+//
+// The compiler keeps its state in global variables and never frees memory,
+// so a process can compile only one file. fork() gives each child a fresh
+// copy of the state as it is after the common setup in main(), which is
+// therefore done only once instead of once per file.
+//
+// Children finish in any order, but their diagnostics should come out in the
+// order of the input files, as if they were compiled one by one. So each
+// child's stderr goes to a temporary file, which is copied to our stderr once
+// the children for all the previous files have finished too.
+static int compile_all() {
+    int n = vec_len(infiles);
+    pid_t *pids = calloc(n, sizeof(pid_t));
+    FILE **logs = calloc(n, sizeof(FILE *));
+    int *status = calloc(n, sizeof(int));
+    bool *done = calloc(n, sizeof(bool));
+    int started = 0;
+    int reported = 0;
+    int running = 0;
+    int r = 0;
+
+    // Anything in our stdio buffers would be written again by every child.
+    fflush(stdout);
+    fflush(stderr);
+
+    while (reported < n) {
+        // Start as many children as we are allowed to.
+        while (running < jobs && started < n) {
+            int i = started++;
+            logs[i] = tmpfile();
+            if (!logs[i])
+                error("tmpfile failed: %s", strerror(errno));
+            pid_t pid = fork();
+            if (pid < 0)
+                error("fork failed: %s", strerror(errno));
+            if (pid == 0) {
+                // The child compiles file i. Temporary files are deleted by the
+                // process that created them, so the child starts with none.
+                dup2(fileno(logs[i]), STDERR_FILENO);
+                tmpfiles = make_vector();
+                infile = vec_get(infiles, i);
+                exit(compile());
+            }
+            pids[i] = pid;
+            running++;
+        }
+
+        // Wait for any child to finish.
+        int st;
+        pid_t pid = wait(&st);
+        if (pid < 0)
+            error("wait failed: %s", strerror(errno));
+        for (int i = 0; i < started; i++) {
+            if (pids[i] == pid) {
+                done[i] = true;
+                status[i] = st;
+            }
+        }
+        running--;
+
+        // Print the diagnostics of the files that are finished, in order.
+        while (reported < n && done[reported]) {
+            int i = reported++;
+            print_log(logs[i]);
+            if (WIFSIGNALED(status[i]))
+                fprintf(stderr, "%s: compiler killed by signal %d\n",
+                        (char *)vec_get(infiles, i), WTERMSIG(status[i]));
+            if (!WIFEXITED(status[i]) || WEXITSTATUS(status[i]))
+                r = 1;
+        }
+    }
+    return r;
+}
+
 // The entry point of the program!
 int main(int argc, char **argv) {
 
@@ -257,9 +517,11 @@ int main(int argc, char **argv) {
     // filled up, at which point the system call is made to actually print to
     // stdout. This is done because system calls are expensive (1000s of cycles)
     // compared to function calls.
-    // This line code sets the buffer for stdout to be NULL, which means that
-    // buffering shouldn't happen at all for this program.
-    setbuf(stdout, NULL);
+    // -E and -fdump-ast print their output to stdout a token or a node at a
+    // time, so we give stdout a large buffer rather than the default one.
+    // The assembly output has a buffer of its own (see gen.c). Whatever is
+    // left in the buffer is flushed by exit().
+    setvbuf(stdout, NULL, _IOFBF, 65536);
     
     // atexit() does what you would expect, if you were able to actually parse
     // the name. atexit() = at_exit(); the first line ensures that the temp 
@@ -275,41 +537,16 @@ int main(int argc, char **argv) {
     // Call to parse the provided command-line options.
     parseopt(argc, argv);
 
-
-    lex_init(infile);
+    // The setup below is the same for every input file: the keywords, the
+    // predefined macros and the ones given by -D and -U. It's done once,
+    // before any input file is opened.
+    lex_init();
     cpp_init();
     parse_init();
-    set_output_file(open_asmfile());
     if (buf_len(cppdefs) > 0)
         read_from_string(buf_body(cppdefs));
 
-    if (cpponly)
-        preprocess();
-
-    Vector *toplevels = read_toplevels();
-    for (int i = 0; i < vec_len(toplevels); i++) {
-        Node *v = vec_get(toplevels, i);
-        if (dumpast)
-            printf("%s", node2s(v));
-        else
-            emit_toplevel(v);
-    }
-
-    close_output_file();
-
-    if (!dumpast && !dumpasm) {
-        if (!outfile)
-            outfile = replace_suffix(base(infile), 'o');
-        pid_t pid = fork();
-        if (pid < 0) perror("fork");
-        if (pid == 0) {
-            execlp("as", "as", "-o", outfile, "-c", asmfile, (char *)NULL);
-            perror("execl failed");
-        }
-        int status;
-        waitpid(pid, &status, 0);
-        if (status < 0)
-            error("as failed");
-    }
-    return 0;
+    if (vec_len(infiles) == 1)
+        return compile();
+    return compile_all();
 }
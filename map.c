@@ -1,152 +1,443 @@
 // Copyright 2014 Rui Ueyama. Released under the MIT license.
 
 // This is an implementation of hash table.
-// Specifically, this implementation is of an open-addressing hash table with
-// linear probing.
+// Specifically, this implementation is of an open-addressing hash table in
+// the style of Swiss tables.
+//
+// The slots of a map are divided into groups of eight. Besides the slots,
+// which hold the keys, the values and the full 32-bit hashes of the keys,
+// a map has an array of control bytes, one per slot. A control byte says
+// whether its slot is empty, deleted (a tombstone) or full, and if it's
+// full, it holds the top 7 bits of the key's hash. A lookup loads the eight
+// control bytes of a group as a single 64-bit word and compares all of them
+// with the 7 bits of the hash it is looking for at once, using the
+// bit-twiddling tricks below. Only the slots whose control bytes match are
+// looked at, and of those, only the ones with an equal full hash have their
+// keys compared. So a lookup usually touches one word of control bytes and
+// one slot, and calls strcmp() only for the key it finds.
+//
+// Real Swiss tables compare sixteen control bytes at a time with SSE2
+// instructions. We do that too when we are compiled by GCC for a target
+// that has SSE2, but 8cc has to be able to compile itself and it doesn't
+// support SSE intrinsics, so otherwise we use groups of eight bytes in a
+// general-purpose register.
+//
+// A map can be marked as 'interned', meaning that every key stored in or
+// looked up from it is an interned string (see intern.c). Such a map takes
+// the hash of a key from the intern table instead of computing it, and
+// compares keys by pointer instead of with strcmp(). It doesn't have
+// control bytes and uses plain linear probing instead (see below).
 
 #include <stdlib.h>
 #include <string.h>
 #include "8cc.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define INIT_SIZE 16
 
-// This is a macro that defines a pointer value that is greater than any other
-// address on the system, and (presumably) an address that we can't write to.
-// It utilizes undefined C behaviour: it should underflow (void *) to be the 
-// maximum value.   
-#define TOMBSTONE ((void *)-1)
-
-// Hash function. Specifically, this function implements the FNV hash, a fast
-// non-cryptographic hash function.
-static uint32_t hash(char *p) {
-    // FNV hash
-    uint32_t r = 2166136261;
-    for (; *p; p++) {
-        r ^= *p;
-        r *= 16777619;
+// Control bytes. A full slot's control byte is the top 7 bits of its
+// hash, so its most significant bit is always 0.
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+// Multipliers for the hash function. They are odd numbers whose bits look
+// random, taken from the fractional part of the golden ratio and from
+// MurmurHash3's finalizer.
+#define K1 0x9E3779B97F4A7C15ULL
+#define K2 0xFF51AFD7ED558CCDULL
+
+// Hash function. It reads the input 8 bytes at a time rather than one
+// byte at a time like the FNV hash this table used to use, which makes a
+// difference for long identifiers. Each word is mixed into the state by a
+// multiplication by a large odd constant, which spreads its bits upward,
+// and a shift, which brings the high bits back down. The final mixing step
+// makes sure that every input bit affects both the low bits, which select
+// a group, and the top 7 bits, which go into a control byte.
+uint32_t hash_bytes(char *p, int len) {
+    uint64_t h = len * K1;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = (h ^ v) * K1;
+        h ^= h >> 32;
+    }
+    if (len > 0) {
+        // The last 1 to 7 bytes. Most identifiers are that short.
+        uint64_t v = 0;
+        for (int i = 0; i < len; i++)
+            v |= (uint64_t)(unsigned char)p[i] << (i * 8);
+        h = (h ^ v) * K1;
+        h ^= h >> 32;
     }
+    h *= K2;
+    h ^= h >> 29;
+    return h ^ (h >> 32);
+}
+
+// Get the hash of a key in a map that isn't interned.
+static uint32_t key_hash(char *key) {
+    return hash_bytes(key, strlen(key));
+}
+
+// The operations on groups of control bytes. A Group holds the control
+// bytes of a group, and a Bitmask marks the bytes of a group that match
+// something. The number of slots in a group is GROUP. The size of a map is
+// always a power of two and a multiple of it.
+#ifdef __SSE2__
+
+#define GROUP 16
+
+typedef __m128i Group;
+typedef unsigned Bitmask;
+
+static Group load_group(Map *m, int g) {
+    return _mm_loadu_si128((__m128i *)(m->ctrl + g * GROUP));
+}
+
+// Return a group with the control byte c in every byte.
+static Group make_pattern(uint8_t c) {
+    return _mm_set1_epi8(c);
+}
+
+// Return a bitmask with bit i set where byte i of the group equals the
+// pattern's.
+static Bitmask match_byte(Group grp, Group pattern) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(grp, pattern));
+}
+
+static Bitmask match_empty(Group grp) {
+    return match_byte(grp, make_pattern(CTRL_EMPTY));
+}
+
+// Empty and deleted slots are the ones whose control bytes have the top
+// bit set, which is what movemask collects.
+static Bitmask match_free(Group grp) {
+    return _mm_movemask_epi8(grp);
+}
+
+static int first_match(Bitmask bits) {
+    return __builtin_ctz(bits);
+}
+
+#else
+
+#define GROUP 8
+
+// These constants have 0x01 or 0x80 in every byte.
+#define LSB 0x0101010101010101ULL
+#define MSB 0x8080808080808080ULL
+
+typedef uint64_t Group;
+typedef uint64_t Bitmask;
+
+// Read the eight control bytes of a group as one word. Byte i of the
+// group is byte i of the word, since x86-64 is little-endian.
+static Group load_group(Map *m, int g) {
+    uint64_t r;
+    memcpy(&r, m->ctrl + g * GROUP, 8);
     return r;
 }
 
+static Group make_pattern(uint8_t c) {
+    return LSB * c;
+}
+
+// Return a word with 0x80 in each byte where the group has the control
+// byte of the pattern. This is the well-known trick to find a zero byte
+// in a word, applied to the group XOR'ed with the pattern. It can report
+// a false match for a byte that follows a true match, because the
+// subtraction borrows from it, but that's harmless because we compare
+// hashes of the slots it reports anyway. It never reports an empty or
+// deleted slot when the pattern is a hash, since those have the top bit
+// set and hashes don't.
+static Bitmask match_byte(Group grp, Group pattern) {
+    uint64_t x = grp ^ pattern;
+    return (x - LSB) & ~x & MSB;
+}
+
+// Return a word with 0x80 in each byte where the group has CTRL_EMPTY.
+// It's the only control byte whose bit 7 is set and bit 1 is clear.
+static Bitmask match_empty(Group grp) {
+    return grp & ~(grp << 6) & MSB;
+}
+
+// Return a word with 0x80 in each byte where the group has CTRL_EMPTY or
+// CTRL_DELETED. They are the control bytes whose bit 7 is set and bit 0
+// is clear.
+static Bitmask match_free(Group grp) {
+    return grp & ~(grp << 7) & MSB;
+}
+
+// Return the index of the first byte marked in a word returned by one of
+// the functions above. GCC has a builtin for that, which is a single
+// instruction. 8cc doesn't, so we isolate the lowest set bit and shift it
+// to bit 0 of its byte, which leaves 1 << (8 * i) for index i. Multiplying
+// a constant by that shifts the constant left by i bytes, so the top byte
+// of the product is byte 7 - i of the constant, which is i.
+static int first_match(Bitmask bits) {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits) >> 3;
+#else
+    return (((bits & -bits) >> 7) * 0x0001020304050607ULL) >> 56;
+#endif
+}
+
+#endif
+
 // Create a map of a certain size.
-static Map *do_make_map(Map *parent, int size) {
+static Map *do_make_map(Map *parent, int size, bool interned) {
     // Allocate memory for the map struct.
     Map *r = malloc(sizeof(Map));
 
     // Set the parent of the new map to the provided map.
     r->parent = parent;
 
-    // calloc() allocates memory for a number of items and zeroes it.
-    // Note that the keys are a pointer to char, while the values can be
-    // anything (pointer to void).
-    r->key = calloc(size, sizeof(char *));
-    r->val = calloc(size, sizeof(void *));
+    // All slots start empty. The slots themselves don't need to be
+    // initialized because nobody looks at a slot whose control byte is
+    // CTRL_EMPTY. An interned map has no control bytes, and its empty
+    // slots are the ones with a NULL key (see below).
+    r->ctrl = NULL;
+    r->slots = NULL;
+    r->keys = NULL;
+    r->vals = NULL;
+    if (interned) {
+        r->keys = calloc(size, sizeof(char *));
+        r->vals = malloc(size * sizeof(void *));
+    } else {
+        r->ctrl = malloc(size);
+        memset(r->ctrl, CTRL_EMPTY, size);
+        r->slots = malloc(size * sizeof(MapSlot));
+    }
 
     // Set the size, number of elements, number of used and return.
     r->size = size;
     r->nelem = 0;
     r->nused = 0;
+    r->interned = interned;
     return r;
 }
 
+// Find the first free slot in the probe sequence of a hash. Groups are
+// probed in triangular order: g, g+1, g+3, g+6 and so on. That order
+// visits every group if the number of groups is a power of two, and it
+// jumps away from clusters of full groups faster than linear probing.
+static int find_free(Map *m, uint32_t h) {
+    int gmask = m->size / GROUP - 1;
+    int g = h & gmask;
+    for (int step = 1;; step++) {
+        Bitmask bits = match_free(load_group(m, g));
+        if (bits)
+            return g * GROUP + first_match(bits);
+        g = (g + step) & gmask;
+    }
+}
+
 static void maybe_rehash(Map *m) {
-    // The base case: if there's no key, we allocate the minimum amount of 
-    // memory for each of the properties.
-    if (!m->key) {
-        m->key = calloc(INIT_SIZE, sizeof(char *));
-        m->val = calloc(INIT_SIZE, sizeof(void *));
+    // The base case: if there's no control array, we allocate the minimum
+    // amount of memory for each of the properties.
+    if (!m->ctrl) {
+        m->ctrl = malloc(INIT_SIZE);
+        memset(m->ctrl, CTRL_EMPTY, INIT_SIZE);
+        m->slots = malloc(INIT_SIZE * sizeof(MapSlot));
         m->size = INIT_SIZE;
         return;
     }
 
-    // If the amount of used memory is less than 70% of the total amount of memory,
-    // then there's no need to reallocate. This variable is called the 'load 
-    // factor', and it's very important for the performance of the hash map.
-    // Adjusting this factor changes how frequently we need to rehash and how 
-    // efficient the lookups we do are.  
-    if (m->nused < m->size * 0.7)
+    // If less than 7/8 of the slots have been used, then there's no need to
+    // reallocate. This fraction is called the 'load factor', and it's very
+    // important for the performance of the hash map. Since a lookup looks at
+    // a whole group at a time and a group with an empty slot ends it, a
+    // Swiss table stays fast at a higher load factor than a table with
+    // linear probing. The slots that are still free also guarantee that
+    // every probe sequence reaches an empty slot.
+    if (m->nused < m->size / 8 * 7)
         return;
-    
-    // The new size of the hashmap is 
-    int newsize = (m->nelem < m->size * 0.35) ? m->size : m->size * 2;
-
-    // Allocate memory for new arrays of char* and void* for storing keys and
-    // values.
-    char **k = calloc(newsize, sizeof(char *));
-    void **v = calloc(newsize, sizeof(void *));
-
-    // Since the size of the map is a power of two, the value one less than the
-    // size can act as an effective mask. Consider that the size of the map is
-    // 0b001000000. The value of size - 1 would be 0b000111111. 
-    int mask = newsize - 1;
 
-    // Iterate through all of the keys and the values.
-    for (int i = 0; i < m->size; i++) {
-        // If a key is null, we don't include it in the reallocation.
-        if (m->key[i] == NULL || m->key[i] == TOMBSTONE)
+    // The new size of the hashmap is the same if most of the used slots
+    // are tombstones, and twice as large otherwise.
+    int newsize = (m->nelem < m->size / 16 * 7) ? m->size : m->size * 2;
+
+    // Move the elements to new arrays. The hashes are stored in the slots,
+    // so we don't need to compute them again.
+    uint8_t *ctrl = m->ctrl;
+    MapSlot *slots = m->slots;
+    int size = m->size;
+    m->ctrl = malloc(newsize);
+    memset(m->ctrl, CTRL_EMPTY, newsize);
+    m->slots = malloc(newsize * sizeof(MapSlot));
+    m->size = newsize;
+    for (int i = 0; i < size; i++) {
+        // Skip empty slots and tombstones.
+        if (ctrl[i] & 0x80)
             continue;
-
-        // We can then use the mask we created earlier to restrict the range of
-        // the output of the hash function to only the values in the  
-        int j = hash(m->key[i]) & mask;
-
-        // We also need to reallocate any of the data that is next to a given 
-        // key. We increase the current hash value, taking care to restrict it
-        // to the correct range (to avoid accessing null memory).
-        for (;; j = (j + 1) & mask) {
-            if (k[j] != NULL)
-                continue;
-            k[j] = m->key[i];
-            v[j] = m->val[i];
-            break;
-        }
+        int j = find_free(m, slots[i].hash);
+        m->ctrl[j] = ctrl[i];
+        m->slots[j] = slots[i];
     }
-    // Set up the new properties of the map.
-    m->key = k;
-    m->val = v;
-    m->size = newsize;
     m->nused = m->nelem;
 }
 
 // Create a new map.
 Map *make_map() {
-    return do_make_map(NULL, INIT_SIZE);
+    return do_make_map(NULL, INIT_SIZE, false);
+}
+
+// Create a new map whose keys are interned strings.
+Map *make_interned_map() {
+    return do_make_map(NULL, INIT_SIZE, true);
 }
 
-// Create a new map with the supplied parent.
+// Create a new map with the supplied parent. The new map takes the same kind
+// of keys as its parent, because map_get() looks up the same key in both.
 Map *make_map_parent(Map *parent) {
-    return do_make_map(parent, INIT_SIZE);
+    return do_make_map(parent, INIT_SIZE, parent && parent->interned);
 }
 
-// Internal function to get a value from this particular map (ignore parents).
-static void *map_get_nostack(Map *m, char *key) {
-    // If there aren't any keys, return null.
-    if (!m->key)
-        return NULL;
+/*
+ * Interned maps
+ *
+ * Comparing a key with an interned string is a single pointer comparison,
+ * which costs no more than matching a control byte would. So an interned
+ * map has no control bytes, and it doesn't need the hashes either. Its
+ * keys and values are in two arrays, keys and vals, so that a lookup
+ * touches as little memory as possible. A lookup probes the keys one by
+ * one from the one that the hash selects until it finds the key or an
+ * empty slot, whose key is NULL. A removed key is replaced by TOMBSTONE,
+ * which isn't equal to any interned string, so that searches still go
+ * past it. This was the layout of every map before the Swiss table, and
+ * it's faster than the Swiss table for interned keys.
+ */
+
+#define TOMBSTONE ((char *)-1)
+
+// Return the index of a key in an interned map, or -1.
+static int find_interned(Map *m, char *key, uint32_t h) {
+    if (!m->keys)
+        return -1;
+    int mask = m->size - 1;
+    for (int i = h & mask; m->keys[i]; i = (i + 1) & mask)
+        if (m->keys[i] == key)
+            return i;
+    return -1;
+}
+
+// Linear probing slows down at a lower load factor than a Swiss table,
+// so an interned map is rehashed when 7/10 of its slots have been used.
+static void maybe_rehash_interned(Map *m) {
+    if (!m->keys) {
+        m->keys = calloc(INIT_SIZE, sizeof(char *));
+        m->vals = malloc(INIT_SIZE * sizeof(void *));
+        m->size = INIT_SIZE;
+        return;
+    }
+    if (m->nused < m->size * 7 / 10)
+        return;
+    int newsize = (m->nelem < m->size * 35 / 100) ? m->size : m->size * 2;
+    char **keys = m->keys;
+    void **vals = m->vals;
+    int size = m->size;
+    int mask = newsize - 1;
+    m->keys = calloc(newsize, sizeof(char *));
+    m->vals = malloc(newsize * sizeof(void *));
+    m->size = newsize;
+    for (int i = 0; i < size; i++) {
+        if (!keys[i] || keys[i] == TOMBSTONE)
+            continue;
+        int j = intern_hash(keys[i]) & mask;
+        while (m->keys[j])
+            j = (j + 1) & mask;
+        m->keys[j] = keys[i];
+        m->vals[j] = vals[i];
+    }
+    m->nused = m->nelem;
+}
 
-    // The mask is one less than the size (see comment above).
+static void put_interned(Map *m, char *key, void *val) {
+    uint32_t h = intern_hash(key);
+    int i = find_interned(m, key, h);
+    if (i >= 0) {
+        m->vals[i] = val;
+        return;
+    }
+    maybe_rehash_interned(m);
     int mask = m->size - 1;
+    i = h & mask;
+    while (m->keys[i] && m->keys[i] != TOMBSTONE)
+        i = (i + 1) & mask;
+    if (!m->keys[i])
+        m->nused++;
+    m->keys[i] = key;
+    m->vals[i] = val;
+    m->nelem++;
+}
+
+static void remove_interned(Map *m, char *key) {
+    int i = find_interned(m, key, intern_hash(key));
+    if (i < 0)
+        return;
+    m->keys[i] = TOMBSTONE;
+    m->nelem--;
+}
 
-    // Calculate the hash of the key, taking into account the mask.
-    int i = hash(key) & mask;
-
-    // Look at all adjacent values and check if they contain the key we're 
-    // looking for. Note that we only terminate the search when we encounter
-    // a NULL key, but not a key that has a TOMBSTONE key. This is because we
-    // need to be able to know when to stop looking for an element. The TOMBSTONE
-    // key represents an item that has been deleted; there might be items beyond
-    // this item that are still valid, so we can't stop searching once we reach
-    // a TOMBSTONE key.
-    for (; m->key[i] != NULL; i = (i + 1) & mask)
-        if (m->key[i] != TOMBSTONE && !strcmp(m->key[i], key))
-            return m->val[i];
-    
-    // We couldn't find the given key, so we return null.
+// Get a value from an interned map or its parents. This is separate from
+// map_get() so that it doesn't pay for the registers that a Swiss table
+// lookup needs.
+static void *map_get_interned(Map *m, char *key) {
+    uint32_t h = intern_hash(key);
+    for (; m; m = m->parent) {
+        int i = find_interned(m, key, h);
+        if (i >= 0 && m->vals[i])
+            return m->vals[i];
+    }
     return NULL;
 }
 
+// Find the slot of a key whose hash is h, or return NULL. Keys are
+// compared by pointer first, which is usually enough, because callers
+// tend to look up the same string they inserted. This is inline so that
+// GCC doesn't make map_get() call it, which costs a noticeable fraction of
+// a lookup.
+static inline MapSlot *find(Map *m, char *key, uint32_t h) {
+    // If there aren't any slots, there's nothing to find.
+    if (!m->ctrl)
+        return NULL;
+
+    unsigned gmask = m->size / GROUP - 1;
+    unsigned g = h & gmask;
+    Group pattern = make_pattern(h >> 25);
+    for (unsigned step = 1;; step++) {
+        // Check the slots of this group whose control bytes match the top 7
+        // bits of the hash.
+        Group grp = load_group(m, g);
+        for (Bitmask bits = match_byte(grp, pattern); bits; bits &= bits - 1) {
+            MapSlot *s = &m->slots[g * GROUP + first_match(bits)];
+            if (s->key == key || (s->hash == h && !strcmp(s->key, key)))
+                return s;
+        }
+
+        // An empty slot means that the key was never inserted past this
+        // group. Note that a tombstone doesn't end the search: there might be
+        // items beyond it that are still valid.
+        if (match_empty(grp))
+            return NULL;
+        g = (g + step) & gmask;
+    }
+}
+
+// Internal function to get a value from this particular map (ignore parents).
+static void *map_get_nostack(Map *m, char *key) {
+    MapSlot *s = find(m, key, key_hash(key));
+    return s ? s->val : NULL;
+}
+
 // Get a value from the map.
 void *map_get(Map *m, char *key) {
+    if (m->interned)
+        return map_get_interned(m, key);
+
     // Check this map first.
     void *r = map_get_nostack(m, key);
     if (r)
@@ -160,72 +451,55 @@ void *map_get(Map *m, char *key) {
 
 // Insert a value into the map.
 void map_put(Map *m, char *key, void *val) {
-    // Check if we need to rehash and expand the map first. We don't want 
-    // too many collisions!
-    maybe_rehash(m);
+    if (m->interned) {
+        put_interned(m, key, val);
+        return;
+    }
+    uint32_t h = key_hash(key);
 
-    // Create the mask.
-    int mask = m->size - 1;
+    // If the key already exists, we update it.
+    MapSlot *s = find(m, key, h);
+    if (s) {
+        s->val = val;
+        return;
+    }
 
-    // Calculate the hash of the key, taking into account the mask.
-    int i = hash(key) & mask;
-
-    // Look at all of the adjacent values until we find one that we can
-    // insert into. 
-    for (;; i = (i + 1) & mask) {
-        // Create a temp variable for the current key.
-        char *k = m->key[i];
-        
-        // If the current 'slot' isn't filled, we fill it.
-        if (k == NULL || k == TOMBSTONE) {
-            // Set the key and the value.
-            m->key[i] = key;
-            m->val[i] = val;
-            m->nelem++;
-
-            // 'nused' is a measure of how many slots in the hashmap have
-            // been used at any point, rather than merely at the current time,
-            // so it is calculated based on the number of new NULL entries.
-            if (k == NULL)
-                m->nused++;
-            return;
-        }
+    // Check if we need to rehash and expand the map first. We don't want
+    // too many collisions!
+    maybe_rehash(m);
 
-        // Otherwise, we check to see if the key already exists and update it
-        // if it does.
-        if (!strcmp(k, key)) {
-            m->val[i] = val;
-            return;
-        }
-    }
+    // Fill the first free slot in the probe sequence. 'nused' is a measure
+    // of how many slots in the hashmap have been used at any point, rather
+    // than merely at the current time, so it counts only slots that were
+    // empty, not tombstones that are reused.
+    int i = find_free(m, h);
+    if (m->ctrl[i] == CTRL_EMPTY)
+        m->nused++;
+    m->ctrl[i] = h >> 25;
+    m->slots[i] = (MapSlot){ h, key, val };
+    m->nelem++;
 }
 
 // Remove a key from the map.
 void map_remove(Map *m, char *key) {
-    if (!m->key)
+    if (m->interned) {
+        remove_interned(m, key);
         return;
-    
-    // Calculate the mask.
-    int mask = m->size - 1;
-
-    // Calculate the hash.
-    int i = hash(key) & mask;
-
-    // Look at the adjacent keys
-    for (; m->key[i] != NULL; i = (i + 1) & mask) {
-        // If this is the wrong key, we continue.
-        if (m->key[i] == TOMBSTONE || strcmp(m->key[i], key))
-            continue;
-
-        // Key that is removed is set to the TOMBSTONE instead of NULL.
-        // This means that they are still included in the measure of how many
-        // of the elements are 'used', and also it means that we can still search
-        // through adjacent items to find the right item (because there won't be
-        // any gaps).
-        m->key[i] = TOMBSTONE;
-        m->val[i] = NULL;
-        m->nelem--;
+    }
+    MapSlot *s = find(m, key, key_hash(key));
+    if (!s)
         return;
+    int i = s - m->slots;
+    m->nelem--;
+
+    // If the slot's group has an empty slot, no search has ever gone past
+    // this group, so the slot can be made empty again. Otherwise it becomes
+    // a tombstone so that searches for the keys beyond it still find them.
+    if (match_empty(load_group(m, i / GROUP))) {
+        m->ctrl[i] = CTRL_EMPTY;
+        m->nused--;
+    } else {
+        m->ctrl[i] = CTRL_DELETED;
     }
 }
 
@@ -0,0 +1,248 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Micro-benchmark for map.c
+ *
+ * Measures the lookup throughput of Map against the previous
+ * implementation, an open-addressing table with linear probing, separate
+ * key and value arrays and a byte-at-a-time FNV hash, which is kept below
+ * for comparison. Build it like utiltest.c, with the other sources except
+ * main.c, and run it:
+ *
+ *   cc -O2 -DBUILD_DIR='"."' -o mapbench mapbench.c \
+ *       $(ls *.c | grep -v -e main.c -e utiltest.c -e mapbench.c)
+ *   ./mapbench
+ *
+ * Each workload prints the nanoseconds per lookup of both tables. Half of
+ * the lookups are for keys in the table and half for keys that aren't.
+ * The first line compares the hash functions alone.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "8cc.h"
+
+/*
+ * The previous implementation
+ */
+
+typedef struct {
+    char **key;
+    void **val;
+    int size;
+    int nelem;
+    int nused;
+    bool interned;
+} OldMap;
+
+#define OLD_INIT_SIZE 16
+#define TOMBSTONE ((void *)-1)
+
+static uint32_t fnv(char *p) {
+    uint32_t r = 2166136261;
+    for (; *p; p++) {
+        r ^= *p;
+        r *= 16777619;
+    }
+    return r;
+}
+
+static uint32_t old_hash(OldMap *m, char *key) {
+    return m->interned ? intern_hash(key) : fnv(key);
+}
+
+static bool old_equal(OldMap *m, char *k, char *key) {
+    return m->interned ? k == key : !strcmp(k, key);
+}
+
+static OldMap *old_make_map(bool interned) {
+    OldMap *r = malloc(sizeof(OldMap));
+    r->key = calloc(OLD_INIT_SIZE, sizeof(char *));
+    r->val = calloc(OLD_INIT_SIZE, sizeof(void *));
+    r->size = OLD_INIT_SIZE;
+    r->nelem = 0;
+    r->nused = 0;
+    r->interned = interned;
+    return r;
+}
+
+static void old_rehash(OldMap *m) {
+    if (m->nused < m->size * 7 / 10)
+        return;
+    int newsize = (m->nelem < m->size * 35 / 100) ? m->size : m->size * 2;
+    char **k = calloc(newsize, sizeof(char *));
+    void **v = calloc(newsize, sizeof(void *));
+    int mask = newsize - 1;
+    for (int i = 0; i < m->size; i++) {
+        if (m->key[i] == NULL || m->key[i] == TOMBSTONE)
+            continue;
+        int j = old_hash(m, m->key[i]) & mask;
+        while (k[j])
+            j = (j + 1) & mask;
+        k[j] = m->key[i];
+        v[j] = m->val[i];
+    }
+    m->key = k;
+    m->val = v;
+    m->size = newsize;
+    m->nused = m->nelem;
+}
+
+static void *old_map_get(OldMap *m, char *key) {
+    int mask = m->size - 1;
+    for (int i = old_hash(m, key) & mask; m->key[i]; i = (i + 1) & mask)
+        if (m->key[i] != TOMBSTONE && old_equal(m, m->key[i], key))
+            return m->val[i];
+    return NULL;
+}
+
+static void old_map_put(OldMap *m, char *key, void *val) {
+    old_rehash(m);
+    int mask = m->size - 1;
+    for (int i = old_hash(m, key) & mask;; i = (i + 1) & mask) {
+        char *k = m->key[i];
+        if (k == NULL || k == TOMBSTONE) {
+            m->key[i] = key;
+            m->val[i] = val;
+            m->nelem++;
+            if (k == NULL)
+                m->nused++;
+            return;
+        }
+        if (old_equal(m, k, key)) {
+            m->val[i] = val;
+            return;
+        }
+    }
+}
+
+/*
+ * Benchmark
+ */
+
+#define NLOOKUPS 2000000
+#define NROUNDS 5
+
+static long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Returns nkeys keys to insert followed by nkeys keys that aren't
+// inserted. They look like identifiers in C programs, with a mix of
+// short and long names.
+static char **make_keys(int nkeys, bool interned) {
+    static char *fmt[] = { "v%d", "tmp_%d", "read_%d_token", "emit_function_prologue_%d" };
+    char **keys = malloc(nkeys * 2 * sizeof(char *));
+    for (int i = 0; i < nkeys * 2; i++) {
+        keys[i] = format(fmt[i % 4], i);
+        if (interned)
+            keys[i] = intern(keys[i]);
+    }
+    return keys;
+}
+
+// Prints nanoseconds per lookup with two decimal places. Integers are used
+// so that 8cc can compile this file too.
+static void report(char *name, char *impl, long ns) {
+    long ps = ns * 1000 / NLOOKUPS;
+    printf("%-24s %s %4ld.%02ld ns/lookup\n", name, impl, ps / 1000, ps % 1000 / 10);
+}
+
+// Both tables are called through function pointers, so that the old one,
+// which is in this file, isn't inlined into the loop while map_get() can't
+// be. They are set in main().
+static void *(*volatile new_get)(Map *m, char *key);
+static void *(*volatile old_get)(OldMap *m, char *key);
+
+// Lookups go through the keys with a stride coprime to their number, so
+// that consecutive lookups don't hit neighboring slots. Half of the keys
+// are in the map.
+static long run_new(Map *m, char **keys, int n) {
+    long found = 0;
+    long start = now();
+    int stride = 7919 % n;
+    for (int i = 0, j = 0; i < NLOOKUPS; i++, j = (j + stride < n) ? j + stride : j + stride - n)
+        found += (new_get(m, keys[j]) != NULL);
+    if (found != NLOOKUPS / 2)
+        error("new map: %ld keys found", found);
+    return now() - start;
+}
+
+static long run_old(OldMap *m, char **keys, int n) {
+    long found = 0;
+    long start = now();
+    int stride = 7919 % n;
+    for (int i = 0, j = 0; i < NLOOKUPS; i++, j = (j + stride < n) ? j + stride : j + stride - n)
+        found += (old_get(m, keys[j]) != NULL);
+    if (found != NLOOKUPS / 2)
+        error("old map: %ld keys found", found);
+    return now() - start;
+}
+
+// Runs the two tables alternately and reports the best time of each, so
+// that neither is favored by the CPU warming up or by noise.
+static void bench(char *name, int nkeys, bool interned) {
+    char **keys = make_keys(nkeys, interned);
+    Map *m = interned ? make_interned_map() : make_map();
+    OldMap *o = old_make_map(interned);
+    for (int i = 0; i < nkeys; i++) {
+        map_put(m, keys[i], keys[i]);
+        old_map_put(o, keys[i], keys[i]);
+    }
+    long best_new = 0, best_old = 0;
+    for (int i = 0; i < NROUNDS; i++) {
+        long t = run_new(m, keys, nkeys * 2);
+        if (i == 0 || t < best_new)
+            best_new = t;
+        t = run_old(o, keys, nkeys * 2);
+        if (i == 0 || t < best_old)
+            best_old = t;
+    }
+    report(name, "new", best_new);
+    report(name, "old", best_old);
+}
+
+// Compares the hash functions alone on the same keys as the tables use.
+static void bench_hash(char *name, int nkeys) {
+    char **keys = make_keys(nkeys, false);
+    int *len = malloc(nkeys * sizeof(int));
+    for (int i = 0; i < nkeys; i++)
+        len[i] = strlen(keys[i]);
+    long best_new = 0, best_old = 0;
+    uint32_t sum = 0;
+    for (int i = 0; i < NROUNDS; i++) {
+        long start = now();
+        for (int j = 0, k = 0; j < NLOOKUPS; j++, k = (k + 1 == nkeys) ? 0 : k + 1)
+            sum += hash_bytes(keys[k], len[k]);
+        long t = now() - start;
+        if (i == 0 || t < best_new)
+            best_new = t;
+        start = now();
+        for (int j = 0, k = 0; j < NLOOKUPS; j++, k = (k + 1 == nkeys) ? 0 : k + 1)
+            sum += fnv(keys[k]);
+        t = now() - start;
+        if (i == 0 || t < best_old)
+            best_old = t;
+    }
+    // Use the sum so that the hashing isn't optimized away.
+    if (sum == 1)
+        printf("\n");
+    report(name, "new", best_new);
+    report(name, "old", best_old);
+}
+
+int main(int argc, char **argv) {
+    new_get = map_get;
+    old_get = old_map_get;
+    bench_hash("hash", 1000);
+    bench("scope (10 keys)", 10, true);
+    bench("interned (1000 keys)", 1000, true);
+    bench("interned (100000 keys)", 100000, true);
+    bench("string (10 keys)", 10, false);
+    bench("string (1000 keys)", 1000, false);
+    bench("string (100000 keys)", 100000, false);
+    return 0;
+}
@@ -0,0 +1,680 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * AST optimizer
+ *
+ * The parser evaluates constant expressions only where the language
+ * requires a constant, such as array sizes and case labels. Everywhere
+ * else, gen.c emits code for whatever the AST says, so "x * 8" or
+ * "1 << 4" are computed at runtime. At -O1, this pass rewrites the AST
+ * of each function before code generation:
+ *
+ *  - Operators whose operands are literals are replaced with literals.
+ *    Integer arithmetic wraps around like it does on the target.
+ *  - Multiplication, division and remainder by a power of two are
+ *    turned into shifts and masks.
+ *  - Identity operations, such as x + 0 or x * 1, are removed.
+ *
+ * Expressions that would trap or are undefined at runtime, such as
+ * division by zero or out-of-range shifts, are left as they are.
+ *
+ * It also removes code that can't be executed:
+ *
+ *  - The branch of an if statement whose condition is a constant that
+ *    is never taken.
+ *  - Statements after a return or a goto, up to one that contains a
+ *    label some jump outside of it goes to.
+ *
+ * Small static functions are inlined into their callers beforehand (see
+ * inline.c), so the copies are folded too.
+ *
+ * Finally, static functions and variables that aren't referred to by the
+ * rest of the file are dropped. static inline functions from headers are
+ * the usual ones.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+static Node *fold(Node *node);
+
+static Node *copy_node(Node *tmpl) {
+    Node *r = arena_alloc(ARENA_AST, sizeof(Node));
+    *r = *tmpl;
+    return r;
+}
+
+static Node *make_int(Node *orig, Type *ty, long val) {
+    return copy_node(&(Node){ AST_LITERAL, ty, orig->sourceLoc, .ival = val });
+}
+
+static Node *make_float(Node *orig, Type *ty, double val) {
+    return copy_node(&(Node){ AST_LITERAL, ty, orig->sourceLoc, .fval = val });
+}
+
+static Node *make_binop(Node *orig, int kind, Type *ty, Node *left, Node *right) {
+    return copy_node(&(Node){ kind, ty, orig->sourceLoc, .left = left, .right = right });
+}
+
+static bool is_int_literal(Node *node) {
+    return node->kind == AST_LITERAL && is_inttype(node->ty);
+}
+
+static bool is_float_literal(Node *node) {
+    return node->kind == AST_LITERAL && is_flotype(node->ty);
+}
+
+static bool same_type(Type *a, Type *b) {
+    return a->kind == b->kind && a->size == b->size && a->usig == b->usig;
+}
+
+// Truncates val to the size of ty and extends it back to 64 bits, so
+// that it is the value a variable of type ty would hold.
+static long wrap(Type *ty, long val) {
+    if (ty->kind == KIND_BOOL)
+        return val != 0;
+    switch (ty->size) {
+    case 1: return ty->usig ? (long)(unsigned char)val : (long)(signed char)val;
+    case 2: return ty->usig ? (long)(unsigned short)val : (long)(short)val;
+    case 4: return ty->usig ? (long)(unsigned)val : (long)(int)val;
+    default: return val;
+    }
+}
+
+static long ival(Node *node) {
+    return wrap(node->ty, node->ival);
+}
+
+// The parser keeps a float literal's value in double precision.
+static double fval(Node *node) {
+    return (node->ty->kind == KIND_FLOAT) ? (float)node->fval : node->fval;
+}
+
+// Returns log2(val) if val is a power of two, or -1.
+static int log2_exact(long val) {
+    if (val <= 0 || (val & (val - 1)))
+        return -1;
+    int r = 0;
+    while (val > 1) {
+        val >>= 1;
+        r++;
+    }
+    return r;
+}
+
+// Returns true if evaluating the node has no effect other than its value,
+// so that it can be evaluated more than once or not at all.
+static bool is_pure(Node *node) {
+    switch (node->kind) {
+    case AST_LITERAL:
+    case AST_LVAR:
+    case AST_GVAR:
+        return true;
+    case AST_CONV:
+    case OP_CAST:
+        return is_pure(node->operand);
+    default:
+        return false;
+    }
+}
+
+/*
+ * Jumps and references
+ */
+
+static Map *label_refs; // label -> the number of jumps to it
+
+static void add(Map *m, char *key, int delta) {
+    map_put(m, key, (void *)((intptr_t)map_get(m, key) + delta));
+}
+
+static void scan(Node *node, Map *refs, int delta, Vector *defs, Vector *names);
+
+static void scan_vec(Vector *v, Map *refs, int delta, Vector *defs, Vector *names) {
+    for (int i = 0; i < vec_len(v); i++)
+        scan(vec_get(v, i), refs, delta, defs, names);
+}
+
+// Visits a tree, adding delta to the count of each jump to a label in
+// refs, and appending the labels defined in it to defs and the names of
+// the global functions and variables it refers to to names. Any of the
+// three can be NULL.
+static void scan(Node *node, Map *refs, int delta, Vector *defs, Vector *names) {
+    if (!node)
+        return;
+    switch (node->kind) {
+    case AST_LITERAL:
+        return;
+    case AST_LVAR:
+        if (node->lvarinit)
+            scan_vec(node->lvarinit, refs, delta, defs, names);
+        return;
+    case AST_GVAR:
+        if (names)
+            vec_push(names, node->glabel);
+        return;
+    case AST_FUNCDESG:
+        if (names)
+            vec_push(names, node->fname);
+        return;
+    case AST_GOTO:
+    case OP_LABEL_ADDR:
+        if (refs && node->newlabel)
+            add(refs, node->newlabel, delta);
+        return;
+    case AST_LABEL:
+        if (defs && node->newlabel)
+            vec_push(defs, node->newlabel);
+        return;
+    case AST_FUNCALL:
+        if (names)
+            vec_push(names, node->fname);
+        scan_vec(node->args, refs, delta, defs, names);
+        return;
+    case AST_FUNCPTR_CALL:
+        scan(node->fptr, refs, delta, defs, names);
+        scan_vec(node->args, refs, delta, defs, names);
+        return;
+    case AST_FUNC:
+        scan(node->body, refs, delta, defs, names);
+        return;
+    case AST_DECL:
+        if (node->declinit)
+            scan_vec(node->declinit, refs, delta, defs, names);
+        return;
+    case AST_INIT:
+        scan(node->initval, refs, delta, defs, names);
+        return;
+    case AST_IF:
+    case AST_TERNARY:
+        scan(node->cond, refs, delta, defs, names);
+        scan(node->then, refs, delta, defs, names);
+        scan(node->els, refs, delta, defs, names);
+        return;
+    case AST_SWITCH:
+        scan(node->switchvar, refs, delta, defs, names);
+        if (refs) {
+            for (int i = 0; i < vec_len(node->cases); i++)
+                add(refs, ((Case *)vec_get(node->cases, i))->label, delta);
+            add(refs, node->defaultlabel, delta);
+        }
+        return;
+    case AST_RETURN:
+        scan(node->retval, refs, delta, defs, names);
+        return;
+    case AST_COMPOUND_STMT:
+        scan_vec(node->stmts, refs, delta, defs, names);
+        return;
+    case AST_STRUCT_REF:
+        scan(node->struc, refs, delta, defs, names);
+        return;
+    case AST_CONV:
+    case AST_ADDR:
+    case AST_DEREF:
+    case AST_COMPUTED_GOTO:
+    case OP_CAST:
+    case OP_PRE_INC:
+    case OP_PRE_DEC:
+    case OP_POST_INC:
+    case OP_POST_DEC:
+    case '!':
+    case '~':
+        scan(node->operand, refs, delta, defs, names);
+        return;
+    default:
+        scan(node->left, refs, delta, defs, names);
+        scan(node->right, refs, delta, defs, names);
+    }
+}
+
+/*
+ * Unreachable code
+ */
+
+// Returns true if control can enter a statement other than from the top,
+// that is, if it defines a label that is jumped to from outside of it.
+static bool is_entered(Node *node) {
+    Map *inner = make_map();
+    Vector *defs = make_vector();
+    scan(node, inner, 1, defs, NULL);
+    for (int i = 0; i < vec_len(defs); i++) {
+        char *label = vec_get(defs, i);
+        if (map_get(label_refs, label) != map_get(inner, label))
+            return true;
+    }
+    return false;
+}
+
+// Forgets the jumps in a statement that is being removed, which may make
+// the labels they go to unreachable too.
+static void drop(Node *node) {
+    scan(node, label_refs, -1, NULL, NULL);
+}
+
+// Returns true if control never falls off the end of a statement.
+static bool is_jump(Node *node) {
+    if (!node)
+        return false;
+    switch (node->kind) {
+    case AST_GOTO:
+    case AST_COMPUTED_GOTO:
+    case AST_RETURN:
+        return true;
+    case AST_COMPOUND_STMT:
+        return vec_len(node->stmts) > 0 && is_jump(vec_tail(node->stmts));
+    case AST_IF:
+        return is_jump(node->then) && is_jump(node->els);
+    default:
+        return false;
+    }
+}
+
+static Node *make_block(Node *orig) {
+    return copy_node(&(Node){ AST_COMPOUND_STMT, NULL, orig->sourceLoc, .stmts = make_vector() });
+}
+
+// Removes the statements that follow a jump and can't be entered. The
+// declarations among them are kept without their initializers, because
+// the variables may be used after a label further down.
+static void remove_dead_stmts(Node *node) {
+    Vector *v = make_vector();
+    bool dead = false;
+    for (int i = 0; i < vec_len(node->stmts); i++) {
+        Node *stmt = vec_get(node->stmts, i);
+        if (dead && !is_entered(stmt)) {
+            drop(stmt);
+            if (stmt->kind == AST_DECL && stmt->declinit) {
+                stmt = copy_node(stmt);
+                stmt->declinit = NULL;
+            }
+            if (stmt->kind == AST_DECL)
+                vec_push(v, stmt);
+            continue;
+        }
+        vec_push(v, stmt);
+        dead = is_jump(stmt);
+    }
+    node->stmts = v;
+}
+
+// Removes the branch of an if statement that is never taken.
+static Node *fold_if(Node *node) {
+    if (!is_int_literal(node->cond))
+        return node;
+    Node *taken = ival(node->cond) ? node->then : node->els;
+    Node *untaken = ival(node->cond) ? node->els : node->then;
+    if (untaken) {
+        if (is_entered(untaken))
+            return node;
+        drop(untaken);
+    }
+    return taken ? taken : make_block(node);
+}
+
+/*
+ * Constant folding
+ */
+
+static Node *fold_conv(Node *node) {
+    Node *v = node->operand;
+    Type *ty = node->ty;
+    if (is_int_literal(v)) {
+        if (ty->kind == KIND_BOOL)
+            return make_int(node, ty, ival(v) != 0);
+        // gen.c doesn't truncate a value when converting it to a smaller
+        // type, so narrowing conversions are kept.
+        if (is_inttype(ty) && ty->size >= v->ty->size)
+            return (wrap(ty, ival(v)) == ival(v)) ? make_int(node, ty, ival(v)) : node;
+        if (is_flotype(ty))
+            return make_float(node, ty, v->ty->usig ? (double)(unsigned long)ival(v) : (double)ival(v));
+    } else if (is_float_literal(v)) {
+        if (ty->kind == KIND_BOOL)
+            return make_int(node, ty, fval(v) != 0);
+        if (is_inttype(ty))
+            return make_int(node, ty, wrap(ty, ty->usig ? (long)(unsigned long)fval(v) : (long)fval(v)));
+        if (ty->kind == KIND_FLOAT)
+            return make_float(node, ty, (float)fval(v));
+        if (is_flotype(ty))
+            return make_float(node, ty, fval(v));
+    }
+    return node;
+}
+
+static Node *fold_int_binop(Node *node) {
+    Type *ty = node->ty;
+    bool usig = node->left->ty->usig;
+    long l = ival(node->left);
+    long r = ival(node->right);
+    unsigned long ul = l, ur = r;
+    int bits = node->left->ty->size * 8;
+    switch (node->kind) {
+    case '+': return make_int(node, ty, wrap(ty, ul + ur));
+    case '-': return make_int(node, ty, wrap(ty, ul - ur));
+    case '*': return make_int(node, ty, wrap(ty, ul * ur));
+    case '/':
+    case '%':
+        if (r == 0 || (!usig && r == -1))
+            return node;
+        if (node->kind == '/')
+            return make_int(node, ty, wrap(ty, usig ? (long)(ul / ur) : l / r));
+        return make_int(node, ty, wrap(ty, usig ? (long)(ul % ur) : l % r));
+    case '^': return make_int(node, ty, wrap(ty, l ^ r));
+    case '&': return make_int(node, ty, wrap(ty, l & r));
+    case '|': return make_int(node, ty, wrap(ty, l | r));
+    case OP_SAL:
+    case OP_SAR:
+    case OP_SHR:
+        if (r < 0 || r >= bits)
+            return node;
+        if (node->kind == OP_SAL)
+            return make_int(node, ty, wrap(ty, ul << r));
+        if (node->kind == OP_SAR)
+            return make_int(node, ty, wrap(ty, l >> r));
+        // The operand is shifted as a bit pattern of its own size.
+        if (bits < 64)
+            ul &= (1UL << bits) - 1;
+        return make_int(node, ty, wrap(ty, ul >> r));
+    case '<':   return make_int(node, ty, usig ? ul < ur : l < r);
+    case OP_LE: return make_int(node, ty, usig ? ul <= ur : l <= r);
+    case OP_EQ: return make_int(node, ty, l == r);
+    case OP_NE: return make_int(node, ty, l != r);
+    case OP_LOGAND: return make_int(node, ty, l && r);
+    case OP_LOGOR:  return make_int(node, ty, l || r);
+    }
+    return node;
+}
+
+static Node *fold_float_binop(Node *node) {
+    Type *ty = node->ty;
+    double l = fval(node->left);
+    double r = fval(node->right);
+    switch (node->kind) {
+    case '<':   return make_int(node, ty, l < r);
+    case OP_LE: return make_int(node, ty, l <= r);
+    case OP_EQ: return make_int(node, ty, l == r);
+    case OP_NE: return make_int(node, ty, l != r);
+    }
+    if (!is_flotype(ty))
+        return node;
+    // Arithmetic on floats is done in single precision.
+    if (ty->kind == KIND_FLOAT) {
+        float fl = l, fr = r;
+        switch (node->kind) {
+        case '+': return make_float(node, ty, fl + fr);
+        case '-': return make_float(node, ty, fl - fr);
+        case '*': return make_float(node, ty, fl * fr);
+        case '/': return make_float(node, ty, fl / fr);
+        }
+        return node;
+    }
+    switch (node->kind) {
+    case '+': return make_float(node, ty, l + r);
+    case '-': return make_float(node, ty, l - r);
+    case '*': return make_float(node, ty, l * r);
+    case '/': return make_float(node, ty, l / r);
+    }
+    return node;
+}
+
+/*
+ * Algebraic simplification
+ */
+
+// Signed division rounds toward zero, so a negative dividend is biased
+// by 2^k-1 before the arithmetic shift:
+//   x / 2^k = (x + ((x >> (bits-1)) >>> (bits-k))) >> k
+static Node *signed_div(Node *node, int k) {
+    Node *x = node->left;
+    Type *ty = node->ty;
+    int bits = ty->size * 8;
+    Node *sign = make_binop(node, OP_SAR, ty, x, make_int(node, type_int, bits - 1));
+    Node *bias = make_binop(node, OP_SHR, ty, sign, make_int(node, type_int, bits - k));
+    Node *sum = make_binop(node, '+', ty, x, bias);
+    return make_binop(node, OP_SAR, ty, sum, make_int(node, type_int, k));
+}
+
+static Node *simplify_int_binop(Node *node) {
+    Node *left = node->left;
+    Node *right = node->right;
+    Type *ty = node->ty;
+    // Put a literal operand of a commutative operator on the right.
+    if (is_int_literal(left) && !is_int_literal(right)) {
+        switch (node->kind) {
+        case '+': case '*': case '&': case '|': case '^':
+            left = node->right;
+            right = node->left;
+        }
+    }
+    if (!is_int_literal(right) || !same_type(left->ty, ty))
+        return node;
+    long r = ival(right);
+    int k = log2_exact(r);
+    switch (node->kind) {
+    case '+': case '-': case '|': case '^':
+        if (r == 0)
+            return left;
+        break;
+    case OP_SAL: case OP_SAR: case OP_SHR:
+        if (r == 0)
+            return left;
+        break;
+    case '*':
+        if (r == 1)
+            return left;
+        if (r == 0 && is_pure(left))
+            return make_int(node, ty, 0);
+        if (k > 0)
+            return make_binop(node, OP_SAL, ty, left, make_int(node, type_int, k));
+        break;
+    case '/':
+        if (r == 1)
+            return left;
+        if (k > 0 && ty->usig)
+            return make_binop(node, OP_SHR, ty, left, make_int(node, type_int, k));
+        if (k > 0 && is_pure(left))
+            return signed_div(node, k);
+        break;
+    case '%':
+        if (k >= 0 && ty->usig)
+            return make_binop(node, '&', ty, left, make_int(node, ty, r - 1));
+        break;
+    case '&':
+        if (r == wrap(ty, -1))
+            return left;
+        if (r == 0 && is_pure(left))
+            return make_int(node, ty, 0);
+        break;
+    }
+    return node;
+}
+
+static Node *fold_binop(Node *node) {
+    if (!node->left || !node->right)
+        return node;
+    node->left = fold(node->left);
+    node->right = fold(node->right);
+    Node *left = node->left;
+    Node *right = node->right;
+    if (is_int_literal(left) && is_int_literal(right) && is_inttype(node->ty))
+        return fold_int_binop(node);
+    if (is_float_literal(left) && is_float_literal(right))
+        return fold_float_binop(node);
+    if (node->kind == OP_LOGAND && is_int_literal(left) && !ival(left))
+        return make_int(node, node->ty, 0);
+    if (node->kind == OP_LOGOR && is_int_literal(left) && ival(left))
+        return make_int(node, node->ty, 1);
+    if (is_inttype(node->ty))
+        return simplify_int_binop(node);
+    return node;
+}
+
+static void fold_vec(Vector *v) {
+    for (int i = 0; i < vec_len(v); i++)
+        vec_set(v, i, fold(vec_get(v, i)));
+}
+
+static Node *fold(Node *node) {
+    if (!node)
+        return NULL;
+    switch (node->kind) {
+    case AST_LITERAL:
+    case AST_LVAR:
+    case AST_GVAR:
+    case AST_FUNCDESG:
+    case AST_GOTO:
+    case AST_LABEL:
+    case OP_LABEL_ADDR:
+        return node;
+    case AST_FUNCALL:
+        fold_vec(node->args);
+        return node;
+    case AST_FUNCPTR_CALL:
+        node->fptr = fold(node->fptr);
+        fold_vec(node->args);
+        return node;
+    case AST_DECL:
+        if (node->declinit)
+            fold_vec(node->declinit);
+        return node;
+    case AST_INIT:
+        node->initval = fold(node->initval);
+        return node;
+    case AST_IF:
+        node->cond = fold(node->cond);
+        node->then = fold(node->then);
+        node->els = fold(node->els);
+        return fold_if(node);
+    case AST_TERNARY:
+        node->cond = fold(node->cond);
+        node->then = fold(node->then);
+        node->els = fold(node->els);
+        if (is_int_literal(node->cond)) {
+            if (!ival(node->cond))
+                return node->els;
+            return node->then ? node->then : node->cond;
+        }
+        return node;
+    case AST_SWITCH:
+        node->switchvar = fold(node->switchvar);
+        return node;
+    case AST_RETURN:
+        node->retval = fold(node->retval);
+        return node;
+    case AST_COMPOUND_STMT:
+        fold_vec(node->stmts);
+        remove_dead_stmts(node);
+        return node;
+    case AST_STRUCT_REF:
+        node->struc = fold(node->struc);
+        return node;
+    case AST_CONV:
+    case OP_CAST:
+        node->operand = fold(node->operand);
+        return fold_conv(node);
+    case '!':
+        node->operand = fold(node->operand);
+        if (is_int_literal(node->operand))
+            return make_int(node, node->ty, !ival(node->operand));
+        return node;
+    case '~':
+        node->operand = fold(node->operand);
+        if (is_int_literal(node->operand))
+            return make_int(node, node->ty, wrap(node->ty, ~ival(node->operand)));
+        return node;
+    case AST_ADDR:
+    case AST_DEREF:
+    case AST_COMPUTED_GOTO:
+    case OP_PRE_INC:
+    case OP_PRE_DEC:
+    case OP_POST_INC:
+    case OP_POST_DEC:
+        node->operand = fold(node->operand);
+        return node;
+    case '=':
+        node->left = fold(node->left);
+        node->right = fold(node->right);
+        return node;
+    default:
+        return fold_binop(node);
+    }
+}
+
+/*
+ * Unused static functions and variables
+ */
+
+static char *toplevel_name(Node *node) {
+    return (node->kind == AST_FUNC) ? node->fname : node->declvar->glabel;
+}
+
+static bool is_static(Node *node) {
+    return (node->kind == AST_FUNC) ? node->ty->isstatic : node->declvar->ty->isstatic;
+}
+
+// Returns the toplevels without the static functions and variables that
+// can't be reached from the external ones. Static local variables are
+// static variables too, so they are dropped along with their functions.
+static Vector *remove_unused(Vector *toplevels) {
+    Map *statics = make_map(); // name -> its definitions
+    Map *used = make_map();
+    Vector *names = make_vector();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (!is_static(v)) {
+            scan(v, NULL, 0, NULL, names);
+            continue;
+        }
+        Vector *defs = map_get(statics, toplevel_name(v));
+        if (!defs) {
+            defs = make_vector();
+            map_put(statics, toplevel_name(v), defs);
+        }
+        vec_push(defs, v);
+    }
+    while (vec_len(names) > 0) {
+        char *name = vec_pop(names);
+        if (map_get(used, name))
+            continue;
+        map_put(used, name, (void *)1);
+        Vector *defs = map_get(statics, name);
+        for (int i = 0; defs && i < vec_len(defs); i++)
+            scan(vec_get(defs, i), NULL, 0, NULL, names);
+    }
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (!is_static(v) || map_get(used, toplevel_name(v)))
+            vec_push(r, v);
+    }
+    return r;
+}
+
+Vector *optimize(Vector *toplevels) {
+    inline_functions(toplevels);
+    // Labels are unique in a file. The address of a label can be taken
+    // by the initializer of a static local variable, which is a toplevel
+    // of its own, so the jumps are counted in all toplevels at once.
+    label_refs = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++)
+        scan(vec_get(toplevels, i), label_refs, 1, NULL, NULL);
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC)
+            v->body = fold(v->body);
+    }
+    return remove_unused(toplevels);
+}
+
+/*
+ * Compiler contexts
+ */
+
+void *opt_save_state() {
+    return label_refs;
+}
+
+// NULL is the state before optimize() is called.
+void opt_restore_state(void *state) {
+    label_refs = state;
+}
@@ -26,10 +26,12 @@ SourceLoc *source_loc;
 
 // Objects representing various scopes. Did you know C has so many different
 // scopes? You can use the same name for global variable, local variable,
-// struct/union/enum tag, and goto label!
-static Map *globalenv = &EMPTY_MAP;
-static Map *localenv;
-static Map *tags = &EMPTY_MAP;
+// struct/union/enum tag, and goto label! Variables and tags are keyed by
+// interned identifiers, so names that don't come from the lexer have to be
+// passed through intern() before they are used as keys. env and tags hold
+// both the file scope and the open block scopes (see scope.c).
+static Scope *env = &EMPTY_SCOPE;
+static Scope *tags = &EMPTY_SCOPE;
 static Map *labels;
 
 static Vector *toplevels;
@@ -42,6 +44,11 @@ static char *defaultcase;
 static char *lbreak;
 static char *lcontinue;
 
+// Counters for generated names
+static int ntemps;
+static int nlabels;
+static int nstatic_labels;
+
 // Objects representing basic types. All variables will be of one of these types
 // or a derived type from one of them. Note that (typename){initializer} is C99
 // feature to write struct literals.
@@ -88,12 +95,6 @@ static Node *read_comma_expr(void);
 static Token *get(void);
 static Token *peek(void);
 
-typedef struct {
-    int beg;
-    int end;
-    char *label;
-} Case;
-
 enum {
     S_TYPEDEF = 1,
     S_EXTERN,
@@ -115,7 +116,7 @@ enum {
 
 static void mark_location() {
     Token *tok = peek();
-    source_loc = malloc(sizeof(SourceLoc));
+    source_loc = arena_alloc(ARENA_AST, sizeof(SourceLoc));
     source_loc->file = tok->file->name;
     source_loc->line = tok->line;
 }
@@ -126,34 +127,42 @@ static void mark_location() {
  */
 
 char *make_tempname() {
-    static int c = 0;
-    return format(".T%d", c++);
+    return format(".T%d", ntemps++);
 }
 
 char *make_label() {
-    static int c = 0;
-    return format(".L%d", c++);
+    return format(".L%d", nlabels++);
 }
 
 static char *make_static_label(char *name) {
-    static int c = 0;
-    return format(".S%d.%s", c++, name);
+    return format(".S%d.%s", nstatic_labels++, name);
 }
 
-static Case *make_case(int beg, int end, char *label) {
-    Case *r = malloc(sizeof(Case));
+static Case *make_case(long beg, long end, char *label) {
+    Case *r = arena_alloc(ARENA_AST, sizeof(Case));
     r->beg = beg;
     r->end = end;
     r->label = label;
     return r;
 }
 
-static Map *env() {
-    return localenv ? localenv : globalenv;
+// Returns true if local variables are visible.
+static bool in_block_scope() {
+    return env->depth > env->hidden;
+}
+
+static void enter_scope() {
+    scope_enter(env);
+    scope_enter(tags);
+}
+
+static void leave_scope() {
+    scope_leave(env);
+    scope_leave(tags);
 }
 
 static Node *make_ast(Node *tmpl) {
-    Node *r = malloc(sizeof(Node));
+    Node *r = arena_alloc(ARENA_AST, sizeof(Node));
     *r = *tmpl;
     r->sourceLoc = source_loc;
     return r;
@@ -180,8 +189,8 @@ static Node *ast_floattype(Type *ty, double val) {
 
 static Node *ast_lvar(Type *ty, char *name) {
     Node *r = make_ast(&(Node){ AST_LVAR, ty, .varname = name });
-    if (localenv)
-        map_put(localenv, name, r);
+    if (in_block_scope())
+        scope_put(env, name, r);
     if (localvars)
         vec_push(localvars, r);
     return r;
@@ -189,7 +198,7 @@ static Node *ast_lvar(Type *ty, char *name) {
 
 static Node *ast_gvar(Type *ty, char *name) {
     Node *r = make_ast(&(Node){ AST_GVAR, ty, .varname = name, .glabel = name });
-    map_put(globalenv, name, r);
+    scope_put_global(env, name, r);
     return r;
 }
 
@@ -199,14 +208,14 @@ static Node *ast_static_lvar(Type *ty, char *name) {
         .ty = ty,
         .varname = name,
         .glabel = make_static_label(name) });
-    assert(localenv);
-    map_put(localenv, name, r);
+    assert(in_block_scope());
+    scope_put(env, name, r);
     return r;
 }
 
 static Node *ast_typedef(Type *ty, char *name) {
     Node *r = make_ast(&(Node){ AST_TYPEDEF, ty });
-    map_put(env(), name, r);
+    scope_put(env, name, r);
     return r;
 }
 
@@ -326,20 +335,25 @@ static Node *ast_label_addr(char *label) {
     return make_ast(&(Node){ OP_LABEL_ADDR, make_ptr_type(type_void), .label = label });
 }
 
+static Node *ast_switch(Node *var, Vector *cases, char *defaultlabel, int strategy) {
+    return make_ast(&(Node){ AST_SWITCH, .switchvar = var, .cases = cases,
+                             .defaultlabel = defaultlabel, .strategy = strategy });
+}
+
 static Type *make_type(Type *tmpl) {
-    Type *r = malloc(sizeof(Type));
+    Type *r = arena_alloc(ARENA_TYPE, sizeof(Type));
     *r = *tmpl;
     return r;
 }
 
 static Type *copy_type(Type *ty) {
-    Type *r = malloc(sizeof(Type));
+    Type *r = arena_alloc(ARENA_TYPE, sizeof(Type));
     memcpy(r, ty, sizeof(Type));
     return r;
 }
 
 static Type *make_numtype(int kind, bool usig) {
-    Type *r = calloc(1, sizeof(Type));
+    Type *r = arena_alloc(ARENA_TYPE, sizeof(Type));
     r->kind = kind;
     r->usig = usig;
     if (kind == KIND_VOID)         r->size = r->align = 0;
@@ -458,7 +472,7 @@ static Type *copy_incomplete_type(Type *ty) {
 }
 
 static Type *get_typedef(char *name) {
-    Node *node = map_get(env(), name);
+    Node *node = scope_get(env, name);
     return (node && node->kind == AST_TYPEDEF) ? node->ty : NULL;
 }
 
@@ -566,9 +580,13 @@ static Node *binop(int op, Node *lhs, Node *rhs) {
     if (lhs->ty->kind == KIND_PTR && rhs->ty->kind == KIND_PTR) {
         if (!valid_pointer_binop(op))
             error("invalid pointer arith");
-        // C11 6.5.6.9: Pointer subtractions have type ptrdiff_t.
-        if (op == '-')
-            return ast_binop(type_long, op, lhs, rhs);
+        // C11 6.5.6.9: Pointer subtractions have type ptrdiff_t, and the
+        // result is the difference of the subscripts, not of the addresses.
+        if (op == '-') {
+            Node *r = ast_binop(type_long, op, lhs, rhs);
+            int size = lhs->ty->ptr->size;
+            return (size > 1) ? ast_binop(type_long, '/', r, ast_inttype(type_long, size)) : r;
+        }
         // C11 6.5.8.6, 6.5.9.3: Pointer comparisons have type int.
         return ast_binop(type_int, op, lhs, rhs);
     }
@@ -627,7 +645,7 @@ static int eval_struct_ref(Node *node, int offset) {
     return eval_intexpr(node, NULL) + offset;
 }
 
-int eval_intexpr(Node *node, Node **addr) {
+long eval_intexpr(Node *node, Node **addr) {
     switch (node->kind) {
     case AST_LITERAL:
         if (is_inttype(node->ty))
@@ -685,7 +703,7 @@ int eval_intexpr(Node *node, Node **addr) {
     }
 }
 
-static int read_intexpr() {
+static long read_intexpr() {
     return eval_intexpr(read_conditional_expr(), NULL);
 }
 
@@ -905,7 +923,7 @@ static void read_static_assert() {
  */
 
 static Node *read_var_or_func(char *name) {
-    Node *v = map_get(env(), name);
+    Node *v = scope_get(env, name);
     if (!v) {
         Token *tok = peek();
         if (!is_keyword(tok, '('))
@@ -1126,7 +1144,7 @@ static Node *read_unary_expr() {
 }
 
 static Node *read_compound_literal(Type *ty) {
-    char *name = make_label();
+    char *name = intern(make_label());
     Vector *init = read_decl_init(ty);
     Node *r = ast_lvar(ty, name);
     r->lvarinit = init;
@@ -1517,12 +1535,14 @@ static Type *read_rectype_def(bool is_struct) {
     char *tag = read_rectype_tag();
     Type *r;
     if (tag) {
-        r = map_get(tags, tag);
+        // A definition declares a new type unless the tag has been declared
+        // in the same scope already.
+        r = is_keyword(peek(), '{') ? scope_get_local(tags, tag) : scope_get(tags, tag);
         if (r && (r->kind == KIND_ENUM || r->is_struct != is_struct))
             error("declarations of %s does not match", tag);
         if (!r) {
             r = make_rectype(is_struct);
-            map_put(tags, tag, r);
+            scope_put(tags, tag, r);
         }
     } else {
         r = make_rectype(is_struct);
@@ -1560,18 +1580,18 @@ static Type *read_enum_def() {
         tok = get();
     }
     if (tag) {
-        Type *ty = map_get(tags, tag);
+        Type *ty = scope_get(tags, tag);
         if (ty && ty->kind != KIND_ENUM)
             errort(tok, "declarations of %s does not match", tag);
     }
     if (!is_keyword(tok, '{')) {
-        if (!tag || !map_get(tags, tag))
+        if (!tag || !scope_get(tags, tag))
             errort(tok, "enum tag %s is not defined", tag);
         unget_token(tok);
         return type_int;
     }
     if (tag)
-        map_put(tags, tag, type_enum);
+        scope_put(tags, tag, type_enum);
 
     int val = 0;
     for (;;) {
@@ -1585,7 +1605,7 @@ static Type *read_enum_def() {
         if (next_token('='))
             val = read_intexpr();
         Node *constval = ast_inttype(type_int, val++);
-        map_put(env(), name, constval);
+        scope_put(env, name, constval);
         if (next_token(','))
             continue;
         if (next_token('}'))
@@ -2152,10 +2172,10 @@ static void read_static_local_var(Type *ty, char *name) {
     Node *var = ast_static_lvar(ty, name);
     Vector *init = NULL;
     if (next_token('=')) {
-        Map *orig = localenv;
-        localenv = NULL;
+        int orig = env->hidden;
+        env->hidden = env->depth;
         init = read_decl_init(ty);
-        localenv = orig;
+        env->hidden = orig;
     }
     vec_push(toplevels, ast_decl(var, init));
 }
@@ -2167,7 +2187,7 @@ static Type *read_decl_spec_opt(int *sclass) {
     return type_int;
 }
 
-static void read_decl(Vector *block, bool isglobal) {
+static void do_read_decl(Vector *block, bool isglobal) {
     int sclass = 0;
     Type *basetype = read_decl_spec_opt(&sclass);
     if (next_token(';'))
@@ -2197,13 +2217,19 @@ static void read_decl(Vector *block, bool isglobal) {
     }
 }
 
+static void read_decl(Vector *block, bool isglobal) {
+    timer_start(TIMER_READ_DECL);
+    do_read_decl(block, isglobal);
+    timer_stop(TIMER_READ_DECL);
+}
+
 /*
  * K&R-style parameter types
  */
 
 static Vector *read_oldstyle_param_args() {
-    Map *orig = localenv;
-    localenv = NULL;
+    int orig = env->hidden;
+    env->hidden = env->depth;
     Vector *r = make_vector();
     for (;;) {
         if (is_keyword(peek(), '{'))
@@ -2212,7 +2238,7 @@ static Vector *read_oldstyle_param_args() {
             errort(peek(), "K&R-style declarator expected, but got %s", tok2s(peek()));
         read_decl(r, false);
     }
-    localenv = orig;
+    env->hidden = orig;
     return r;
 }
 
@@ -2254,16 +2280,16 @@ static Vector *param_types(Vector *params) {
  */
 
 static Node *read_func_body(Type *functype, char *fname, Vector *params) {
-    localenv = make_map_parent(localenv);
+    enter_scope();
     localvars = make_vector();
     current_func_type = functype;
     Node *funcname = ast_string(ENC_NONE, fname, strlen(fname) + 1);
-    map_put(localenv, "__func__", funcname);
-    map_put(localenv, "__FUNCTION__", funcname);
+    scope_put(env, intern("__func__"), funcname);
+    scope_put(env, intern("__FUNCTION__"), funcname);
     Node *body = read_compound_stmt();
     Node *r = ast_func(functype, fname, params, body, localvars);
     current_func_type = NULL;
-    localenv = NULL;
+    leave_scope();
     localvars = NULL;
     return r;
 }
@@ -2333,7 +2359,7 @@ static void backfill_labels() {
 static Node *read_funcdef() {
     int sclass = 0;
     Type *basetype = read_decl_spec_opt(&sclass);
-    localenv = make_map_parent(globalenv);
+    enter_scope();
     gotos = make_vector();
     labels = make_map();
     char *name;
@@ -2350,7 +2376,7 @@ static Node *read_funcdef() {
     expect('{');
     Node *r = read_func_body(functype, name, params);
     backfill_labels();
-    localenv = NULL;
+    leave_scope();
     return r;
 }
 
@@ -2401,8 +2427,7 @@ static Node *read_for_stmt() {
     char *beg = make_label();
     char *mid = make_label();
     char *end = make_label();
-    Map *orig = localenv;
-    localenv = make_map_parent(localenv);
+    enter_scope();
     Node *init = read_opt_decl_or_stmt();
     Node *cond = read_expr_opt();
     if (cond && is_flotype(cond->ty))
@@ -2413,11 +2438,13 @@ static Node *read_for_stmt() {
     SET_JUMP_LABELS(mid, end);
     Node *body = read_stmt();
     RESTORE_JUMP_LABELS();
-    localenv = orig;
+    leave_scope();
 
+    // Variables declared in the init clause are in scope for the whole
+    // loop, so the declarations are not nested in a block of their own.
     Vector *v = make_vector();
     if (init)
-        vec_push(v, init);
+        vec_append(v, init->stmts);
     vec_push(v, ast_dest(beg));
     if (cond)
         vec_push(v, ast_if(cond, NULL, ast_jump(end)));
@@ -2485,19 +2512,6 @@ static Node *read_do_stmt() {
  * Switch
  */
 
-static Node *make_switch_jump(Node *var, Case *c) {
-    Node *cond;
-    if (c->beg == c->end) {
-        cond = ast_binop(type_int, OP_EQ, var, ast_inttype(type_int, c->beg));
-    } else {
-        // [GNU] case i ... j is compiled to if (i <= cond && cond <= j) goto <label>.
-        Node *x = ast_binop(type_int, OP_LE, ast_inttype(type_int, c->beg), var);
-        Node *y = ast_binop(type_int, OP_LE, var, ast_inttype(type_int, c->end));
-        cond = ast_binop(type_int, OP_LOGAND, x, y);
-    }
-    return ast_if(cond, ast_jump(c->label), NULL);
-}
-
 // C11 6.8.4.2p3: No two case constant expressions have the same value.
 static void check_case_duplicates(Vector *cases) {
     int len = vec_len(cases);
@@ -2507,11 +2521,56 @@ static void check_case_duplicates(Vector *cases) {
         if (x->end < y->beg || y->end < x->beg)
             continue;
         if (x->beg == x->end)
-            error("duplicate case value: %d", x->beg);
-        error("duplicate case value: %d ... %d", x->beg, x->end);
+            error("duplicate case value: %ld", x->beg);
+        error("duplicate case value: %ld ... %ld", x->beg, x->end);
     }
 }
 
+// Use a jump table if at least 1 in this many table entries is a case.
+#define SWITCH_TABLE_DENSITY 4
+#define SWITCH_MIN_CASES 4
+
+// True if case values are compared as unsigned long. Used by comp_case.
+static bool case_usig;
+
+static int comp_case(const void *p, const void *q) {
+    Case *x = *(Case **)p;
+    Case *y = *(Case **)q;
+    if (x->beg == y->beg)
+        return 0;
+    if (case_usig)
+        return (unsigned long)x->beg < (unsigned long)y->beg ? -1 : 1;
+    return x->beg < y->beg ? -1 : 1;
+}
+
+// Converts case values to the type of the switch expression and sorts the
+// cases in that type's order, which is what the code generator compares in.
+// Returns the lowering strategy chosen by the number and density of cases.
+static int sort_cases(Vector *cases, Type *ty) {
+    for (int i = 0; i < vec_len(cases); i++) {
+        Case *c = vec_get(cases, i);
+        if (ty->size == 4 && ty->usig) {
+            c->beg = (unsigned)c->beg;
+            c->end = (unsigned)c->end;
+        } else if (ty->size == 4) {
+            c->beg = (int)c->beg;
+            c->end = (int)c->end;
+        }
+    }
+    case_usig = (ty->size == 8 && ty->usig);
+    qsort(vec_body(cases), vec_len(cases), sizeof(void *), comp_case);
+
+    int n = vec_len(cases);
+    if (n < SWITCH_MIN_CASES)
+        return SWITCH_LINEAR;
+    Case *first = vec_head(cases);
+    Case *last = vec_tail(cases);
+    unsigned long range = (unsigned long)last->end - first->beg;
+    if (range < (unsigned long)n * SWITCH_TABLE_DENSITY)
+        return SWITCH_TABLE;
+    return SWITCH_BSEARCH;
+}
+
 #define SET_SWITCH_CONTEXT(brk)                 \
     Vector *ocases = cases;                     \
     char *odefaultcase = defaultcase;           \
@@ -2535,11 +2594,10 @@ static Node *read_switch_stmt() {
     SET_SWITCH_CONTEXT(end);
     Node *body = read_stmt();
     Vector *v = make_vector();
-    Node *var = ast_lvar(expr->ty, make_tempname());
+    Node *var = ast_lvar(expr->ty, intern(make_tempname()));
     vec_push(v, ast_binop(expr->ty, '=', var, expr));
-    for (int i = 0; i < vec_len(cases); i++)
-        vec_push(v, make_switch_jump(var, vec_get(cases, i)));
-    vec_push(v, ast_jump(defaultcase ? defaultcase : end));
+    int strategy = sort_cases(cases, expr->ty);
+    vec_push(v, ast_switch(var, cases, defaultcase ? defaultcase : end, strategy));
     if (body)
         vec_push(v, body);
     vec_push(v, ast_dest(end));
@@ -2560,12 +2618,12 @@ static Node *read_case_label(Token *tok) {
     if (!cases)
         errort(tok, "stray case label");
     char *label = make_label();
-    int beg = read_intexpr();
+    long beg = read_intexpr();
     if (next_token(KELLIPSIS)) {
-        int end = read_intexpr();
+        long end = read_intexpr();
         expect(':');
         if (beg > end)
-            errort(tok, "case region is not in correct order: %d ... %d", beg, end);
+            errort(tok, "case region is not in correct order: %ld ... %ld", beg, end);
         vec_push(cases, make_case(beg, end, label));
     } else {
         expect(':');
@@ -2667,15 +2725,14 @@ static Node *read_stmt() {
 }
 
 static Node *read_compound_stmt() {
-    Map *orig = localenv;
-    localenv = make_map_parent(localenv);
+    enter_scope();
     Vector *list = make_vector();
     for (;;) {
         if (next_token('}'))
             break;
         read_decl_or_stmt(list);
     }
-    localenv = orig;
+    leave_scope();
     return ast_compound_stmt(list);
 }
 
@@ -2700,15 +2757,16 @@ static void read_decl_or_stmt(Vector *list) {
  */
 
 Vector *read_toplevels() {
+    timer_start(TIMER_PARSE);
     toplevels = make_vector();
-    for (;;) {
-        if (peek()->kind == TEOF)
-            return toplevels;
+    while (peek()->kind != TEOF) {
         if (is_funcdef())
             vec_push(toplevels, read_funcdef());
         else
             read_decl(toplevels, true);
     }
+    timer_stop(TIMER_PARSE);
+    return toplevels;
 }
 
 /*
@@ -2716,7 +2774,9 @@ Vector *read_toplevels() {
  */
 
 // C11 5.1.1.2p6 Adjacent string literal tokens are concatenated.
-static void concatenate_string(Token *tok) {
+// Tokens may be shared by the preprocessor, so this returns a new token
+// rather than modifying the given one.
+static Token *concatenate_string(Token *tok) {
     int enc = tok->enc;
     Buffer *b = make_buffer();
     buf_append(b, tok->sval, tok->slen - 1);
@@ -2730,9 +2790,12 @@ static void concatenate_string(Token *tok) {
             enc = enc2;
     }
     buf_write(b, '\0');
-    tok->sval = buf_body(b);
-    tok->slen = buf_len(b);
-    tok->enc = enc;
+    Token *r = arena_alloc(ARENA_TOKEN, sizeof(Token));
+    *r = *tok;
+    r->sval = buf_body(b);
+    r->slen = buf_len(b);
+    r->enc = enc;
+    return r;
 }
 
 static Token *get() {
@@ -2740,7 +2803,7 @@ static Token *get() {
     if (r->kind == TINVALID)
         errort(r, "stray character in program: '%c'", r->c);
     if (r->kind == TSTRING && peek()->kind == TSTRING)
-        concatenate_string(r);
+        r = concatenate_string(r);
     return r;
 }
 
@@ -2753,7 +2816,7 @@ static Token *peek() {
  */
 
 static void define_builtin(char *name, Type *rettype, Vector *paramtypes) {
-    ast_gvar(make_func_type(rettype, paramtypes, true, false), name);
+    ast_gvar(make_func_type(rettype, paramtypes, true, false), intern(name));
 }
 
 void parse_init() {
@@ -2766,3 +2829,70 @@ void parse_init() {
     define_builtin("__builtin_va_arg", type_void, two_voidptrs);
     define_builtin("__builtin_va_start", type_void, voidptr);
 }
+
+/*
+ * Compiler contexts
+ */
+
+typedef struct {
+    SourceLoc *source_loc;
+    Scope *env;
+    Scope *tags;
+    Map *labels;
+    Vector *toplevels;
+    Vector *localvars;
+    Vector *gotos;
+    Vector *cases;
+    Type *current_func_type;
+    char *defaultcase;
+    char *lbreak;
+    char *lcontinue;
+    int ntemps;
+    int nlabels;
+    int nstatic_labels;
+} ParseState;
+
+void *parse_save_state() {
+    ParseState *s = malloc(sizeof(ParseState));
+    s->source_loc = source_loc;
+    s->env = env;
+    s->tags = tags;
+    s->labels = labels;
+    s->toplevels = toplevels;
+    s->localvars = localvars;
+    s->gotos = gotos;
+    s->cases = cases;
+    s->current_func_type = current_func_type;
+    s->defaultcase = defaultcase;
+    s->lbreak = lbreak;
+    s->lcontinue = lcontinue;
+    s->ntemps = ntemps;
+    s->nlabels = nlabels;
+    s->nstatic_labels = nstatic_labels;
+    return s;
+}
+
+// NULL is the state before parse_init().
+void parse_restore_state(void *state) {
+    ParseState *s = state;
+    if (!s) {
+        s = calloc(1, sizeof(ParseState));
+        s->env = make_scope();
+        s->tags = make_scope();
+    }
+    source_loc = s->source_loc;
+    env = s->env;
+    tags = s->tags;
+    labels = s->labels;
+    toplevels = s->toplevels;
+    localvars = s->localvars;
+    gotos = s->gotos;
+    cases = s->cases;
+    current_func_type = s->current_func_type;
+    defaultcase = s->defaultcase;
+    lbreak = s->lbreak;
+    lcontinue = s->lcontinue;
+    ntemps = s->ntemps;
+    nlabels = s->nlabels;
+    nstatic_labels = s->nstatic_labels;
+}
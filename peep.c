@@ -0,0 +1,974 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Peephole optimizer
+ *
+ * gen.c compiles each AST node by itself, which leaves a lot of
+ * redundancy at the seams between nodes: values pushed onto the stack and
+ * popped right back, values computed in one register only to be moved to
+ * another, jumps to the next instruction and so on. At -O1, gen.c buffers
+ * the assembly of each function instead of writing it out, and this pass
+ * cleans it up before it is printed.
+ *
+ * The lines are parsed into a mnemonic and operands, and into the sets of
+ * registers each instruction reads and writes. Then the rules below are
+ * applied in order, repeatedly until none of them changes anything. Some
+ * rules need to know whether a register is live, that is, whether its
+ * value may be read later. That is computed by the usual backward
+ * dataflow analysis over the basic blocks of the function. Jumps to
+ * unknown places, such as computed gotos, are assumed to read all
+ * registers.
+ *
+ * The rules are:
+ *
+ *  unreachable     instructions after an unconditional jump or a return,
+ *                  up to the next label, are removed.
+ *  jump-thread     a jump to a jump goes directly to the final target.
+ *  branch-invert   "jcc L1; jmp L2; L1:" becomes "jncc L2; L1:".
+ *  jump-next       a jump to the label right after it is removed.
+ *  loc             a .loc directive immediately followed by another one
+ *                  is removed.
+ *  push-pop        "push %r; ...; pop %s" becomes "mov %r, %s; ...", if
+ *                  the instructions in between don't use the stack or %s.
+ *  store-load      a load from a stack slot right after a store to it
+ *                  uses the stored register instead.
+ *  mov-coalesce    "op x, %r; mov %r, %s" becomes "op x, %s" if %r is
+ *                  dead afterwards.
+ *  movzb           "movzb %al, %eax; test %rax, %rax" becomes
+ *                  "test %al, %al" if %rax is dead afterwards.
+ *  dead-move       a move from a register or an immediate to a dead
+ *                  register is removed.
+ *  dead-store      a store to a stack slot that is never read is removed,
+ *                  unless the address of a stack slot is taken somewhere
+ *                  in the function.
+ *
+ * With -fdump-peephole, the number of times each rule was applied and the
+ * number of lines it removed are printed at exit.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+bool dump_peephole;
+
+enum { LINE_INSN, LINE_LABEL, LINE_LOC, LINE_OTHER };
+
+// Kinds of instructions, by what they do to their operands.
+enum {
+    I_OTHER,  // unknown; assumed to read every register
+    I_MOVE,   // writes the last operand and reads the others
+    I_ARITH,  // reads all operands and writes the last one
+    I_SET,    // setcc; writes the low byte of a register
+    I_CMP,    // reads all operands
+    I_PUSH,
+    I_POP,
+    I_CALL,
+    I_RET,
+    I_LEAVE,
+    I_JMP,
+    I_JCC,
+    I_CLTQ,
+    I_CQTO,
+    I_DIV,    // reads and writes %rax and %rdx
+    I_NOP,
+};
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15, XMM0 };
+
+#define BIT(r) ((uint64_t)1 << (r))
+#define ALL_REGS 0xFFFFFFFFULL
+#define ARG_REGS (BIT(RDI) | BIT(RSI) | BIT(RDX) | BIT(RCX) | BIT(R8) | BIT(R9) | (0xFFULL << XMM0))
+#define CALLEE_SAVED (BIT(RBX) | BIT(RSP) | BIT(RBP) | BIT(R12) | BIT(R13) | BIT(R14) | BIT(R15))
+#define CALLER_SAVED (ALL_REGS & ~CALLEE_SAVED)
+#define RET_REGS (BIT(RAX) | BIT(RDX) | BIT(XMM0) | BIT(XMM0 + 1) | CALLEE_SAVED)
+
+static char *REG64[] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                         "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" };
+static char *REG32[] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                         "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" };
+static char *REG16[] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+                         "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" };
+static char *REG8[] = { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+                        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
+
+static char *ARITH_OPS[] = {
+    "add", "sub", "imul", "and", "or", "xor", "sal", "sar", "shl", "shr",
+    "not", "neg", "inc", "dec", "addss", "addsd", "subss", "subsd",
+    "mulss", "mulsd", "divss", "divsd", "xorps", "xorpd", NULL,
+};
+
+// Conditional jumps and their negations.
+static char *JCC[] = {
+    "je", "jne", "jz", "jnz", "jl", "jge", "jle", "jg",
+    "jb", "jae", "jbe", "ja", "js", "jns", "jp", "jnp", NULL,
+};
+
+typedef struct {
+    char *text;    // the line without the note; NULL if removed
+    char *note;    // what -fdump-stack appended to the line, or ""
+    int kind;
+    bool data;     // in a data section
+    // Instructions only
+    char *op;
+    int nargs;
+    char *args[3];
+    int cls;
+    uint64_t use;  // registers read
+    uint64_t def;  // registers written
+    uint64_t live; // registers live after the instruction
+} Line;
+
+typedef struct {
+    int beg;
+    int end;
+    int succ[2]; // successor blocks, or -1
+    bool exit;   // leaves the function or jumps to an unknown place
+    uint64_t in;
+    uint64_t out;
+} Block;
+
+enum {
+    R_UNREACHABLE,
+    R_JUMP_THREAD,
+    R_BRANCH_INVERT,
+    R_JUMP_NEXT,
+    R_LOC,
+    R_PUSH_POP,
+    R_STORE_LOAD,
+    R_MOV_COALESCE, // this and the following rules need liveness
+    R_MOVZB,
+    R_DEAD_MOVE,
+    R_DEAD_STORE,
+    NRULES,
+};
+
+static char *rule_names[] = {
+    "unreachable", "jump-thread", "branch-invert", "jump-next", "loc",
+    "push-pop", "store-load", "mov-coalesce", "movzb", "dead-move", "dead-store",
+};
+
+static long applied[NRULES];
+static long removed[NRULES];
+static long insns_before;
+static long insns_after;
+
+static Vector *lines; // Lines of the function being optimized
+static Map *labels;   // label -> its line number + 1
+static bool escaped;  // the address of a stack slot is taken
+static Vector *reads; // offsets of the stack slots read
+
+/*
+ * Parser
+ */
+
+// Returns the register a name refers to and its size in bytes, or -1.
+static int find_reg(char *name, int *size) {
+    for (int i = 0; i < 16; i++) {
+        if (!strcmp(name, REG64[i])) { *size = 8; return i; }
+        if (!strcmp(name, REG32[i])) { *size = 4; return i; }
+        if (!strcmp(name, REG16[i])) { *size = 2; return i; }
+        if (!strcmp(name, REG8[i]))  { *size = 1; return i; }
+    }
+    if (!strncmp(name, "xmm", 3)) {
+        *size = 16;
+        return XMM0 + atoi(name + 3);
+    }
+    return -1;
+}
+
+// Returns the register of a register operand such as "%rax", or -1.
+static int reg_operand(char *s, int *size) {
+    if (*s == '*')
+        s++;
+    if (*s != '%')
+        return -1;
+    return find_reg(s + 1, size);
+}
+
+// Returns the registers an operand refers to, including the base and
+// index registers of a memory operand.
+static uint64_t operand_regs(char *s) {
+    uint64_t r = 0;
+    for (char *p = s; *p; p++) {
+        if (*p != '%')
+            continue;
+        char name[8];
+        int len = 0;
+        for (p++; (('a' <= *p && *p <= 'z') || ('0' <= *p && *p <= '9')) && len < 7; p++)
+            name[len++] = *p;
+        name[len] = '\0';
+        p--;
+        // %rip is not a register the rules track.
+        if (!strcmp(name, "rip"))
+            continue;
+        int size;
+        int reg = find_reg(name, &size);
+        r |= (reg < 0) ? ALL_REGS : BIT(reg);
+    }
+    return r;
+}
+
+static bool is_mem(char *s) {
+    return strchr(s, '(') != NULL;
+}
+
+static bool in_list(char **list, char *s) {
+    for (int i = 0; list[i]; i++)
+        if (!strcmp(list[i], s))
+            return true;
+    return false;
+}
+
+static bool starts_with(char *s, char *prefix) {
+    return !strncmp(s, prefix, strlen(prefix));
+}
+
+static int classify(char *op, int nargs) {
+    if (!strcmp(op, "call")) return I_CALL;
+    if (!strcmp(op, "ret")) return I_RET;
+    if (!strcmp(op, "leave")) return I_LEAVE;
+    if (!strcmp(op, "nop")) return I_NOP;
+    if (!strcmp(op, "jmp")) return I_JMP;
+    if (in_list(JCC, op)) return I_JCC;
+    if (!strcmp(op, "push")) return I_PUSH;
+    if (!strcmp(op, "pop")) return I_POP;
+    if (!strcmp(op, "cltq")) return I_CLTQ;
+    if (!strcmp(op, "cqto")) return I_CQTO;
+    if (!strcmp(op, "idiv") || !strcmp(op, "div"))
+        return I_DIV;
+    if (nargs == 1 && (!strcmp(op, "imul") || !strcmp(op, "mul")))
+        return I_DIV;
+    if (starts_with(op, "set")) return I_SET;
+    if (starts_with(op, "cmp") || starts_with(op, "test") || starts_with(op, "ucomis"))
+        return I_CMP;
+    if (starts_with(op, "mov") || !strcmp(op, "lea") || starts_with(op, "cvt"))
+        return I_MOVE;
+    if (in_list(ARITH_OPS, op))
+        return I_ARITH;
+    return I_OTHER;
+}
+
+// Computes the registers an instruction reads and writes. prev is the
+// instruction before it, or NULL.
+static void set_effects(Line *l, Line *prev) {
+    uint64_t use = 0, def = 0;
+    int n = l->nargs;
+    int size;
+    switch (l->cls) {
+    case I_MOVE:
+    case I_ARITH:
+    case I_SET:
+    case I_POP: {
+        if (n == 0) {
+            use = def = ALL_REGS;
+            break;
+        }
+        for (int i = 0; i < n - 1; i++)
+            use |= operand_regs(l->args[i]);
+        int r = reg_operand(l->args[n - 1], &size);
+        if (r < 0) {
+            use |= operand_regs(l->args[n - 1]);
+            break;
+        }
+        def |= BIT(r);
+        // A write to the low 8 or 16 bits of a register or to an xmm
+        // register keeps the rest of it, so the old value is read too.
+        if (l->cls == I_ARITH || l->cls == I_SET || size < 4 || r >= XMM0)
+            use |= BIT(r);
+        if (l->cls == I_POP) {
+            use |= BIT(RSP);
+            def |= BIT(RSP);
+        }
+        break;
+    }
+    case I_CMP:
+    case I_JMP:
+    case I_JCC:
+        for (int i = 0; i < n; i++)
+            use |= operand_regs(l->args[i]);
+        break;
+    case I_PUSH:
+        use = BIT(RSP) | (n ? operand_regs(l->args[0]) : ALL_REGS);
+        def = BIT(RSP);
+        break;
+    case I_CALL:
+        // %al is read by functions taking variable arguments, and gen.c
+        // sets it right before calling them.
+        use = ARG_REGS | BIT(RSP) | (n ? operand_regs(l->args[0]) : 0);
+        if (prev && prev->cls == I_MOVE && prev->nargs == 2 && !strcmp(prev->args[1], "%eax"))
+            use |= BIT(RAX);
+        def = CALLER_SAVED;
+        break;
+    case I_RET:
+        use = RET_REGS;
+        break;
+    case I_LEAVE:
+        use = BIT(RBP);
+        def = BIT(RSP) | BIT(RBP);
+        break;
+    case I_CLTQ:
+        use = def = BIT(RAX);
+        break;
+    case I_CQTO:
+        use = BIT(RAX);
+        def = BIT(RDX);
+        break;
+    case I_DIV:
+        use = BIT(RAX) | BIT(RDX) | (n ? operand_regs(l->args[0]) : 0);
+        def = BIT(RAX) | BIT(RDX);
+        break;
+    case I_NOP:
+        break;
+    default:
+        use = def = ALL_REGS;
+    }
+    l->use = use;
+    l->def = def;
+}
+
+// Splits the operands of an instruction at commas outside parentheses.
+static void parse_insn(Line *l, char *s) {
+    char *p = s;
+    while (*p && *p != ' ')
+        p++;
+    l->op = strndup(s, p - s);
+    l->nargs = 0;
+    while (*p == ' ')
+        p++;
+    while (*p && l->nargs < 3) {
+        char *beg = p;
+        int depth = 0;
+        for (; *p && (depth > 0 || *p != ','); p++) {
+            if (*p == '(') depth++;
+            if (*p == ')') depth--;
+        }
+        l->args[l->nargs++] = strndup(beg, p - beg);
+        if (*p == ',')
+            p++;
+        while (*p == ' ')
+            p++;
+    }
+    l->cls = *p ? I_OTHER : classify(l->op, l->nargs);
+}
+
+static Line *parse_line(char *s, bool data) {
+    Line *l = calloc(1, sizeof(Line));
+    l->note = "";
+    l->data = data;
+    l->text = s;
+    char *t = s;
+    while (*t == '\t')
+        t++;
+    char *end = t;
+    while (*end && *end != ' ')
+        end++;
+    bool label = (end > t && end[-1] == ':');
+    if (*t == '#' || (*t == '.' && !label && !starts_with(t, ".loc"))) {
+        // A comment or a directive, whose operands may contain anything.
+        l->kind = LINE_OTHER;
+        return l;
+    }
+    // The rest can be followed by a note from -fdump-stack.
+    char *note = strchr(t, '#');
+    if (note) {
+        while (note > t && note[-1] == ' ')
+            note--;
+        l->note = note;
+        l->text = strndup(s, note - s);
+        t = l->text + (t - s);
+    }
+    if (label) {
+        l->kind = LINE_LABEL;
+    } else if (starts_with(t, ".loc")) {
+        l->kind = LINE_LOC;
+    } else {
+        l->kind = LINE_INSN;
+        parse_insn(l, t);
+    }
+    return l;
+}
+
+/*
+ * Helpers for rules
+ */
+
+static Line *line(int i) {
+    return vec_get(lines, i);
+}
+
+static bool is_code(Line *l, int kind) {
+    return l->text && !l->data && l->kind == kind;
+}
+
+static char *label_name(Line *l) {
+    char *t = l->text;
+    while (*t == '\t')
+        t++;
+    return strndup(t, strlen(t) - 1);
+}
+
+// Rewrites an instruction.
+static void set_insn(Line *l, char *op, int nargs, char *a, char *b) {
+    l->op = op;
+    l->nargs = nargs;
+    l->args[0] = a;
+    l->args[1] = b;
+    if (nargs == 0)
+        l->text = format("\t%s", op);
+    else if (nargs == 1)
+        l->text = format("\t%s %s", op, a);
+    else
+        l->text = format("\t%s %s, %s", op, a, b);
+    l->cls = classify(op, nargs);
+    set_effects(l, NULL);
+}
+
+static void remove_line(int rule, Line *l) {
+    l->text = NULL;
+    removed[rule]++;
+}
+
+// Returns the index of the next instruction after i, or -1 if a label or
+// the end of the function comes first.
+static int next_insn(int i) {
+    for (i++; i < vec_len(lines); i++) {
+        Line *l = line(i);
+        if (is_code(l, LINE_INSN))
+            return i;
+        if (is_code(l, LINE_LABEL))
+            return -1;
+    }
+    return -1;
+}
+
+// Returns the index of the first instruction at or after a label,
+// skipping other labels, or -1.
+static int insn_at_label(char *label) {
+    int i = (intptr_t)map_get(labels, label) - 1;
+    if (i < 0)
+        return -1;
+    for (i++; i < vec_len(lines); i++) {
+        Line *l = line(i);
+        if (is_code(l, LINE_INSN))
+            return i;
+    }
+    return -1;
+}
+
+static bool is_reg64(char *s, int *reg) {
+    int size;
+    *reg = reg_operand(s, &size);
+    return *s == '%' && *reg >= 0 && *reg < XMM0 && size == 8;
+}
+
+static bool is_jump(Line *l) {
+    return l->cls == I_JMP || l->cls == I_JCC;
+}
+
+static bool is_direct_jump(Line *l) {
+    return is_jump(l) && l->nargs == 1 && l->args[0][0] != '*';
+}
+
+static char *negate_jcc(char *op) {
+    for (int i = 0; JCC[i]; i++)
+        if (!strcmp(JCC[i], op))
+            return JCC[i ^ 1];
+    return NULL;
+}
+
+// Returns the offset of a stack slot operand such as "-8(%rbp)".
+static bool stack_slot(char *s, int *off) {
+    char *p = strstr(s, "(%rbp)");
+    if (!p || p[6] || s[0] == '(' || is_mem(p + 1))
+        return false;
+    char *end;
+    *off = strtol(s, &end, 10);
+    return end == p;
+}
+
+/*
+ * Rules
+ */
+
+static bool unreachable(int i) {
+    Line *l = line(i);
+    if (!is_code(l, LINE_INSN) || (l->cls != I_JMP && l->cls != I_RET))
+        return false;
+    bool r = false;
+    for (int j = next_insn(i); j >= 0; j = next_insn(j)) {
+        remove_line(R_UNREACHABLE, line(j));
+        r = true;
+    }
+    return r;
+}
+
+static bool jump_thread(int i) {
+    Line *l = line(i);
+    if (!is_code(l, LINE_INSN) || !is_direct_jump(l))
+        return false;
+    char *target = l->args[0];
+    for (int n = 0; n < 8; n++) {
+        int j = insn_at_label(target);
+        if (j < 0 || j == i)
+            break;
+        Line *m = line(j);
+        if (m->cls != I_JMP || !is_direct_jump(m) || !strcmp(m->args[0], target))
+            break;
+        target = m->args[0];
+    }
+    if (target == l->args[0])
+        return false;
+    set_insn(l, l->op, 1, target, NULL);
+    return true;
+}
+
+static bool branch_invert(int i) {
+    Line *l = line(i);
+    if (!is_code(l, LINE_INSN) || l->cls != I_JCC || !is_direct_jump(l) || !negate_jcc(l->op))
+        return false;
+    int j = next_insn(i);
+    if (j < 0 || line(j)->cls != I_JMP || !is_direct_jump(line(j)))
+        return false;
+    // The label must come right after the jmp.
+    for (int k = j + 1; k < vec_len(lines); k++) {
+        Line *m = line(k);
+        if (is_code(m, LINE_INSN))
+            return false;
+        if (!is_code(m, LINE_LABEL))
+            continue;
+        if (strcmp(label_name(m), l->args[0]))
+            continue;
+        set_insn(l, negate_jcc(l->op), 1, line(j)->args[0], NULL);
+        remove_line(R_BRANCH_INVERT, line(j));
+        return true;
+    }
+    return false;
+}
+
+static bool jump_next(int i) {
+    Line *l = line(i);
+    if (!is_code(l, LINE_INSN) || !is_direct_jump(l))
+        return false;
+    for (int k = i + 1; k < vec_len(lines); k++) {
+        Line *m = line(k);
+        if (is_code(m, LINE_INSN))
+            return false;
+        if (is_code(m, LINE_LABEL) && !strcmp(label_name(m), l->args[0])) {
+            remove_line(R_JUMP_NEXT, l);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool loc(int i) {
+    Line *l = line(i);
+    if (!is_code(l, LINE_LOC))
+        return false;
+    for (int k = i + 1; k < vec_len(lines); k++) {
+        Line *m = line(k);
+        if (!m->text || m->kind == LINE_OTHER)
+            continue;
+        if (!is_code(m, LINE_LOC))
+            return false;
+        remove_line(R_LOC, l);
+        return true;
+    }
+    return false;
+}
+
+static bool push_pop(int i) {
+    Line *l = line(i);
+    int r, s;
+    if (!is_code(l, LINE_INSN) || l->cls != I_PUSH || !is_reg64(l->args[0], &r))
+        return false;
+    uint64_t written = 0, touched = 0;
+    for (int j = next_insn(i), n = 0; j >= 0 && n < 16; j = next_insn(j), n++) {
+        Line *m = line(j);
+        if (m->cls == I_POP) {
+            if (!is_reg64(m->args[0], &s))
+                return false;
+            if (r == s && !(written & BIT(r))) {
+                remove_line(R_PUSH_POP, l);
+                remove_line(R_PUSH_POP, m);
+                return true;
+            }
+            if (r == s || (touched & BIT(s)))
+                return false;
+            set_insn(l, "mov", 2, l->args[0], m->args[0]);
+            remove_line(R_PUSH_POP, m);
+            return true;
+        }
+        switch (m->cls) {
+        case I_MOVE: case I_ARITH: case I_SET: case I_CMP:
+        case I_CLTQ: case I_CQTO: case I_DIV: case I_NOP:
+            break;
+        default:
+            return false;
+        }
+        if ((m->use | m->def) & BIT(RSP))
+            return false;
+        written |= m->def;
+        touched |= m->use | m->def;
+    }
+    return false;
+}
+
+static bool store_load(int i) {
+    Line *l = line(i);
+    int r, s, off, off2;
+    if (!is_code(l, LINE_INSN) || strcmp(l->op, "mov") || l->nargs != 2)
+        return false;
+    if (!is_reg64(l->args[0], &r) || !stack_slot(l->args[1], &off))
+        return false;
+    int j = next_insn(i);
+    if (j < 0)
+        return false;
+    Line *m = line(j);
+    if (strcmp(m->op, "mov") || m->nargs != 2 || !stack_slot(m->args[0], &off2) || off != off2)
+        return false;
+    if (!is_reg64(m->args[1], &s))
+        return false;
+    if (r == s)
+        remove_line(R_STORE_LOAD, m);
+    else
+        set_insn(m, "mov", 2, l->args[0], m->args[1]);
+    return true;
+}
+
+// Returns true if the instruction writes all 64 bits of a general purpose
+// register and nothing else.
+static bool is_full_move(Line *l, int *reg) {
+    if (l->cls != I_MOVE || l->nargs != 2 || is_mem(l->args[1]))
+        return false;
+    int size;
+    *reg = reg_operand(l->args[1], &size);
+    if (*reg < 0 || *reg >= XMM0 || *reg == RSP || *reg == RBP)
+        return false;
+    if (size == 8)
+        return true;
+    // A 32-bit write clears the upper half.
+    return size == 4 && strcmp(l->op, "movss") && strcmp(l->op, "movsd");
+}
+
+static bool mov_coalesce(int i) {
+    Line *l = line(i);
+    int r, s, t;
+    if (!is_code(l, LINE_INSN) || !is_full_move(l, &r) || !is_reg64(l->args[1], &t))
+        return false;
+    int j = next_insn(i);
+    if (j < 0)
+        return false;
+    Line *m = line(j);
+    if (strcmp(m->op, "mov") || m->nargs != 2 || !is_reg64(m->args[0], &t) || t != r)
+        return false;
+    if (!is_reg64(m->args[1], &s) || s == RSP || s == RBP || (m->live & BIT(r)))
+        return false;
+    uint64_t live = m->live;
+    set_insn(l, l->op, 2, l->args[0], m->args[1]);
+    l->live = live;
+    remove_line(R_MOV_COALESCE, m);
+    if (!strcmp(l->op, "mov") && !strcmp(l->args[0], l->args[1]))
+        remove_line(R_MOV_COALESCE, l);
+    return true;
+}
+
+static bool movzb(int i) {
+    Line *l = line(i);
+    if (!is_code(l, LINE_INSN) || l->nargs != 2 || strcmp(l->args[0], "%al"))
+        return false;
+    if ((strcmp(l->op, "movzb") || strcmp(l->args[1], "%eax")) &&
+        (strcmp(l->op, "movzx") || strcmp(l->args[1], "%rax")))
+        return false;
+    int j = next_insn(i);
+    if (j < 0)
+        return false;
+    Line *m = line(j);
+    if (strcmp(m->op, "test") || strcmp(m->args[0], "%rax") || strcmp(m->args[1], "%rax"))
+        return false;
+    if (m->live & BIT(RAX))
+        return false;
+    uint64_t live = m->live;
+    set_insn(m, "test", 2, "%al", "%al");
+    m->live = live;
+    remove_line(R_MOVZB, l);
+    return true;
+}
+
+// Loads from memory are kept, because the assembly doesn't say whether
+// the memory is volatile.
+static bool dead_move(int i) {
+    Line *l = line(i);
+    int r;
+    if (!is_code(l, LINE_INSN) || !is_full_move(l, &r) || (l->live & BIT(r)))
+        return false;
+    if (is_mem(l->args[0]))
+        return false;
+    remove_line(R_DEAD_MOVE, l);
+    return true;
+}
+
+// Finds the stack slots read in the function.
+static void find_reads() {
+    escaped = false;
+    reads = make_vector();
+    for (int i = 0; i < vec_len(lines); i++) {
+        Line *l = line(i);
+        if (!is_code(l, LINE_INSN))
+            continue;
+        if (l->cls == I_OTHER) {
+            escaped = true;
+            return;
+        }
+        for (int j = 0; j < l->nargs; j++) {
+            char *a = l->args[j];
+            if (!strstr(a, "%rbp"))
+                continue;
+            int off;
+            bool store = (j == l->nargs - 1 && l->cls == I_MOVE);
+            // Saving %rbp and setting it up in the prologue don't count,
+            // but any other read of %rbp itself leaks the frame address.
+            if (!strcmp(a, "%rbp") && (store || l->cls == I_PUSH))
+                continue;
+            if (!stack_slot(a, &off) || !strcmp(l->op, "lea")) {
+                escaped = true;
+                return;
+            }
+            if (!store)
+                vec_push(reads, (void *)(intptr_t)off);
+        }
+    }
+}
+
+static bool dead_store(int i) {
+    Line *l = line(i);
+    int off;
+    if (escaped || !is_code(l, LINE_INSN) || l->cls != I_MOVE || l->nargs != 2)
+        return false;
+    if (!stack_slot(l->args[1], &off) || off >= 0)
+        return false;
+    // Loads and stores access at most 16 bytes.
+    for (int j = 0; j < vec_len(reads); j++) {
+        int r = (intptr_t)vec_get(reads, j);
+        if (r < off + 16 && off < r + 16)
+            return false;
+    }
+    remove_line(R_DEAD_STORE, l);
+    return true;
+}
+
+static bool apply(int rule, int i) {
+    switch (rule) {
+    case R_UNREACHABLE:   return unreachable(i);
+    case R_JUMP_THREAD:   return jump_thread(i);
+    case R_BRANCH_INVERT: return branch_invert(i);
+    case R_JUMP_NEXT:     return jump_next(i);
+    case R_LOC:           return loc(i);
+    case R_PUSH_POP:      return push_pop(i);
+    case R_STORE_LOAD:    return store_load(i);
+    case R_MOV_COALESCE:  return mov_coalesce(i);
+    case R_MOVZB:         return movzb(i);
+    case R_DEAD_MOVE:     return dead_move(i);
+    case R_DEAD_STORE:    return dead_store(i);
+    default:
+        error("internal error: unknown peephole rule %d", rule);
+    }
+}
+
+/*
+ * Liveness
+ */
+
+static void compute_effects() {
+    Line *prev = NULL;
+    for (int i = 0; i < vec_len(lines); i++) {
+        Line *l = line(i);
+        if (is_code(l, LINE_INSN)) {
+            set_effects(l, prev);
+            prev = l;
+        }
+    }
+}
+
+static int block_of_label(Vector *blocks, char *label) {
+    int i = (intptr_t)map_get(labels, label) - 1;
+    if (i < 0)
+        return -1;
+    for (int j = 0; j < vec_len(blocks); j++) {
+        Block *b = vec_get(blocks, j);
+        if (b->beg <= i && i < b->end)
+            return j;
+    }
+    return -1;
+}
+
+static Vector *make_blocks() {
+    Vector *blocks = make_vector();
+    Block *cur = NULL;
+    for (int i = 0; i < vec_len(lines); i++) {
+        Line *l = line(i);
+        if (!cur || is_code(l, LINE_LABEL)) {
+            cur = calloc(1, sizeof(Block));
+            cur->beg = i;
+            vec_push(blocks, cur);
+        }
+        cur->end = i + 1;
+        if (is_code(l, LINE_INSN) && (is_jump(l) || l->cls == I_RET))
+            cur = NULL;
+    }
+    for (int i = 0; i < vec_len(blocks); i++) {
+        Block *b = vec_get(blocks, i);
+        b->succ[0] = b->succ[1] = -1;
+        Line *last = NULL;
+        for (int j = b->beg; j < b->end; j++)
+            if (is_code(line(j), LINE_INSN))
+                last = line(j);
+        bool falls = !last || (last->cls != I_JMP && last->cls != I_RET);
+        if (falls)
+            b->succ[0] = (i + 1 < vec_len(blocks)) ? i + 1 : -1;
+        if (last && is_jump(last)) {
+            int t = is_direct_jump(last) ? block_of_label(blocks, last->args[0]) : -1;
+            if (t < 0)
+                b->exit = true;
+            b->succ[1] = t;
+        }
+        if (falls && b->succ[0] < 0)
+            b->exit = true;
+    }
+    return blocks;
+}
+
+static void compute_liveness() {
+    Vector *blocks = make_blocks();
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = vec_len(blocks) - 1; i >= 0; i--) {
+            Block *b = vec_get(blocks, i);
+            uint64_t live = b->exit ? ALL_REGS : 0;
+            for (int j = 0; j < 2; j++)
+                if (b->succ[j] >= 0)
+                    live |= ((Block *)vec_get(blocks, b->succ[j]))->in;
+            b->out = live;
+            for (int j = b->end - 1; j >= b->beg; j--) {
+                Line *l = line(j);
+                if (!is_code(l, LINE_INSN))
+                    continue;
+                l->live = live | BIT(RSP) | BIT(RBP);
+                live = (live & ~l->def) | l->use;
+            }
+            if (live != b->in) {
+                b->in = live;
+                changed = true;
+            }
+        }
+    }
+}
+
+/*
+ * Driver
+ */
+
+static int count_insns() {
+    int n = 0;
+    for (int i = 0; i < vec_len(lines); i++)
+        if (is_code(line(i), LINE_INSN))
+            n++;
+    return n;
+}
+
+// Optimizes the assembly of a function, given as a vector of lines.
+Vector *peephole(Vector *text) {
+    lines = make_vector();
+    bool data = false;
+    for (int i = 0; i < vec_len(text); i++) {
+        char *s = vec_get(text, i);
+        char *t = s;
+        while (*t == '\t')
+            t++;
+        if (starts_with(t, ".data"))
+            data = true;
+        else if (starts_with(t, ".text"))
+            data = false;
+        vec_push(lines, parse_line(s, data));
+    }
+    insns_before += count_insns();
+
+    for (int round = 0; round < 8; round++) {
+        labels = make_map();
+        for (int i = 0; i < vec_len(lines); i++)
+            if (is_code(line(i), LINE_LABEL))
+                map_put(labels, label_name(line(i)), (void *)(intptr_t)(i + 1));
+        bool changed = false;
+        for (int rule = 0; rule < NRULES; rule++) {
+            if (rule == R_PUSH_POP)
+                compute_effects();
+            if (rule == R_MOV_COALESCE) {
+                compute_effects();
+                compute_liveness();
+            }
+            if (rule == R_DEAD_STORE)
+                find_reads();
+            for (int i = 0; i < vec_len(lines); i++) {
+                if (!apply(rule, i))
+                    continue;
+                applied[rule]++;
+                changed = true;
+            }
+        }
+        if (!changed)
+            break;
+    }
+
+    insns_after += count_insns();
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(lines); i++) {
+        Line *l = line(i);
+        if (l->text)
+            vec_push(r, *l->note ? format("%s%s", l->text, l->note) : l->text);
+    }
+    return r;
+}
+
+void print_peephole_stats() {
+    fprintf(stderr, "peephole: %-16s %10s %10s\n", "rule", "applied", "removed");
+    long total = 0;
+    for (int i = 0; i < NRULES; i++) {
+        fprintf(stderr, "peephole: %-16s %10ld %10ld\n", rule_names[i], applied[i], removed[i]);
+        total += removed[i];
+    }
+    fprintf(stderr, "peephole: %-16s %10s %10ld\n", "total", "", total);
+    fprintf(stderr, "peephole: instructions %ld -> %ld\n", insns_before, insns_after);
+}
+
+/*
+ * Compiler contexts
+ *
+ * The counters printed by print_peephole_stats() are totals for the
+ * process and are not part of a context.
+ */
+
+typedef struct {
+    Vector *lines;
+    Map *labels;
+    bool escaped;
+    Vector *reads;
+} PeepState;
+
+void *peep_save_state() {
+    PeepState *s = malloc(sizeof(PeepState));
+    s->lines = lines;
+    s->labels = labels;
+    s->escaped = escaped;
+    s->reads = reads;
+    return s;
+}
+
+// NULL is the state before peephole() is called.
+void peep_restore_state(void *state) {
+    PeepState *s = state ? state : &(PeepState){};
+    lines = s->lines;
+    labels = s->labels;
+    escaped = s->escaped;
+    reads = s->reads;
+}
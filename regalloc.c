@@ -0,0 +1,279 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Register allocator
+ *
+ * The code generator is a stack machine, and every local variable lives
+ * in a stack slot. At -O1, scalar local variables whose address is never
+ * taken are kept in callee-saved registers (rbx and r12-r15) instead.
+ * Callee-saved registers survive function calls, so the code generator
+ * only has to save and restore the ones in use in the function prologue
+ * and epilogue.
+ *
+ * This is a linear scan allocator that works on the AST rather than on
+ * an IR. Nodes are numbered in evaluation order, and the live interval
+ * of a variable is approximated by its scope: it starts at the
+ * declaration and ends at the end of the enclosing block. That is safe
+ * even with loops and gotos, because a variable's value doesn't have to
+ * survive leaving its block. Parameters live throughout the function.
+ * Compiler-generated temporaries have no declaration, so they are born
+ * at their first use.
+ *
+ * If more intervals overlap than there are registers, the variable with
+ * the fewest references stays on the stack. Functions calling setjmp()
+ * are left alone, because longjmp() would restore the registers to the
+ * values they had at the time of setjmp().
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+#define NREGS 5
+
+static char *CALLEE_SAVED[] = {"rbx", "r12", "r13", "r14", "r15"};
+
+typedef struct {
+    Node *var;
+    int beg;
+    int end;
+    int uses;
+    bool addr_taken;
+} Interval;
+
+static Vector *intervals;
+static Vector *scopes; // variables declared in each enclosing block
+static int pos;
+static bool calls_setjmp;
+
+static Interval *find_interval(Node *var) {
+    for (int i = 0; i < vec_len(intervals); i++) {
+        Interval *iv = vec_get(intervals, i);
+        if (iv->var == var)
+            return iv;
+    }
+    return NULL;
+}
+
+static Interval *make_interval(Node *var, int beg, int end) {
+    Interval *iv = calloc(1, sizeof(Interval));
+    iv->var = var;
+    iv->beg = beg;
+    iv->end = end;
+    vec_push(intervals, iv);
+    return iv;
+}
+
+// The interval ends when the innermost block is closed.
+static Interval *declare(Node *var) {
+    Interval *iv = make_interval(var, pos, INT_MAX);
+    if (vec_len(scopes) > 0)
+        vec_push(vec_tail(scopes), iv);
+    return iv;
+}
+
+static void use(Node *var) {
+    Interval *iv = find_interval(var);
+    if (!iv)
+        iv = declare(var);
+    iv->uses++;
+}
+
+static void mark_addr_taken(Node *node) {
+    while (node->kind == AST_STRUCT_REF)
+        node = node->struc;
+    if (node->kind != AST_LVAR)
+        return;
+    Interval *iv = find_interval(node);
+    if (!iv)
+        iv = declare(node);
+    iv->addr_taken = true;
+}
+
+static void walk(Node *node);
+
+static void walk_vec(Vector *v) {
+    for (int i = 0; i < vec_len(v); i++)
+        walk(vec_get(v, i));
+}
+
+static void walk_block(Node *node) {
+    vec_push(scopes, make_vector());
+    walk_vec(node->stmts);
+    Vector *vars = vec_pop(scopes);
+    for (int i = 0; i < vec_len(vars); i++) {
+        Interval *iv = vec_get(vars, i);
+        iv->end = pos;
+    }
+}
+
+static void walk(Node *node) {
+    if (!node)
+        return;
+    pos++;
+    switch (node->kind) {
+    case AST_LITERAL:
+    case AST_GVAR:
+    case AST_FUNCDESG:
+    case AST_GOTO:
+    case AST_LABEL:
+    case OP_LABEL_ADDR:
+        return;
+    case AST_LVAR:
+        use(node);
+        return;
+    case AST_ADDR:
+        mark_addr_taken(node->operand);
+        walk(node->operand);
+        return;
+    case AST_FUNCALL:
+        if (strstr(node->fname, "setjmp"))
+            calls_setjmp = true;
+        walk_vec(node->args);
+        return;
+    case AST_FUNCPTR_CALL:
+        walk(node->fptr);
+        walk_vec(node->args);
+        return;
+    case AST_DECL:
+        declare(node->declvar);
+        if (node->declinit)
+            walk_vec(node->declinit);
+        return;
+    case AST_INIT:
+        walk(node->initval);
+        return;
+    case AST_IF:
+    case AST_TERNARY:
+        walk(node->cond);
+        walk(node->then);
+        walk(node->els);
+        return;
+    case AST_SWITCH:
+        walk(node->switchvar);
+        return;
+    case AST_RETURN:
+        walk(node->retval);
+        return;
+    case AST_COMPOUND_STMT:
+        walk_block(node);
+        return;
+    case AST_STRUCT_REF:
+        walk(node->struc);
+        return;
+    case AST_CONV:
+    case AST_DEREF:
+    case AST_COMPUTED_GOTO:
+    case OP_CAST:
+    case OP_PRE_INC:
+    case OP_PRE_DEC:
+    case OP_POST_INC:
+    case OP_POST_DEC:
+    case '!':
+    case '~':
+        walk(node->operand);
+        return;
+    default:
+        walk(node->left);
+        walk(node->right);
+    }
+}
+
+static bool is_allocatable(Interval *iv) {
+    Type *ty = iv->var->ty;
+    if (iv->addr_taken || iv->var->lvarinit || iv->uses < 2)
+        return false;
+    return ty->kind == KIND_PTR || (is_inttype(ty) && ty->kind != KIND_BOOL);
+}
+
+static int comp_interval(const void *x, const void *y) {
+    Interval *a = *(Interval **)x;
+    Interval *b = *(Interval **)y;
+    return a->beg - b->beg;
+}
+
+// Assigns registers to the local variables of a function by setting their
+// lreg fields. Returns the callee-saved registers the function uses.
+Vector *alloc_regs(Node *func) {
+    intervals = make_vector();
+    scopes = make_vector();
+    pos = 0;
+    calls_setjmp = false;
+    for (int i = 0; i < vec_len(func->params); i++)
+        make_interval(vec_get(func->params, i), 0, INT_MAX);
+    walk(func->body);
+
+    Vector *r = make_vector();
+    if (calls_setjmp)
+        return r;
+    int n = 0;
+    Interval **cands = malloc(vec_len(intervals) * sizeof(Interval *));
+    for (int i = 0; i < vec_len(intervals); i++) {
+        Interval *iv = vec_get(intervals, i);
+        if (is_allocatable(iv))
+            cands[n++] = iv;
+    }
+    qsort(cands, n, sizeof(Interval *), comp_interval);
+
+    Interval *active[NREGS] = {};
+    bool used[NREGS] = {};
+    for (int i = 0; i < n; i++) {
+        Interval *cur = cands[i];
+        int reg = -1;
+        for (int j = 0; j < NREGS; j++) {
+            if (active[j] && active[j]->end < cur->beg)
+                active[j] = NULL;
+            if (!active[j] && reg < 0)
+                reg = j;
+        }
+        if (reg < 0) {
+            // No free register. Spill the least used variable.
+            int victim = 0;
+            for (int j = 1; j < NREGS; j++)
+                if (active[j]->uses < active[victim]->uses)
+                    victim = j;
+            if (active[victim]->uses >= cur->uses)
+                continue;
+            active[victim]->var->lreg = NULL;
+            reg = victim;
+        }
+        active[reg] = cur;
+        used[reg] = true;
+        cur->var->lreg = CALLEE_SAVED[reg];
+    }
+    free(cands);
+    for (int i = 0; i < NREGS; i++)
+        if (used[i])
+            vec_push(r, CALLEE_SAVED[i]);
+    return r;
+}
+
+/*
+ * Compiler contexts
+ */
+
+typedef struct {
+    Vector *intervals;
+    Vector *scopes;
+    int pos;
+    bool calls_setjmp;
+} RegallocState;
+
+void *regalloc_save_state() {
+    RegallocState *s = malloc(sizeof(RegallocState));
+    s->intervals = intervals;
+    s->scopes = scopes;
+    s->pos = pos;
+    s->calls_setjmp = calls_setjmp;
+    return s;
+}
+
+// NULL is the state before alloc_regs() is called.
+void regalloc_restore_state(void *state) {
+    RegallocState *s = state ? state : &(RegallocState){};
+    intervals = s->intervals;
+    scopes = s->scopes;
+    pos = s->pos;
+    calls_setjmp = s->calls_setjmp;
+}
@@ -0,0 +1,111 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Symbol tables for nested scopes
+ *
+ * C lets a declaration in a block hide a declaration of the same name in
+ * an enclosing block or at file scope until the end of the block. A Scope
+ * keeps all the names in one hash table, which maps each name to its
+ * innermost visible declaration, a Binding. A Binding points to the one it
+ * hides, so each name has a stack of declarations of its own, and a lookup
+ * is a single hash table probe no matter how deeply blocks are nested.
+ *
+ * The Bindings made in block scopes are also appended to a log. Entering a
+ * block pushes a NULL marker onto the log, and leaving it pops the
+ * Bindings back to the marker and reinstates the ones they hid. So the
+ * cost of a block is proportional to the number of names declared in it,
+ * and an empty block costs nothing but the marker.
+ *
+ * Some parts of a function can only refer to file-scope names, such as the
+ * initializer of a static local variable. Setting 'hidden' to the current
+ * depth hides the open block scopes until it's set back. While they are
+ * hidden, new names are declared at file scope, except in blocks entered
+ * after hiding.
+ */
+
+#include <stdlib.h>
+#include "8cc.h"
+
+typedef struct Binding {
+    char *name;
+    void *val;
+    int depth; // 0 for file scope
+    struct Binding *shadowed;
+} Binding;
+
+Scope *make_scope() {
+    Scope *r = malloc(sizeof(Scope));
+    *r = EMPTY_SCOPE;
+    return r;
+}
+
+void scope_enter(Scope *s) {
+    vec_push(&s->log, NULL);
+    s->depth++;
+}
+
+void scope_leave(Scope *s) {
+    for (;;) {
+        Binding *b = vec_pop(&s->log);
+        if (!b)
+            break;
+        // Inner blocks have been left already, so b is the innermost
+        // Binding of its name.
+        if (b->shadowed)
+            map_put(&s->map, b->name, b->shadowed);
+        else
+            map_remove(&s->map, b->name);
+    }
+    s->depth--;
+}
+
+void *scope_get(Scope *s, char *name) {
+    Binding *b = map_get(&s->map, name);
+    while (b && b->depth > 0 && b->depth <= s->hidden)
+        b = b->shadowed;
+    return b ? b->val : NULL;
+}
+
+// Returns the value of a name only if it's declared in the innermost
+// visible scope.
+void *scope_get_local(Scope *s, char *name) {
+    Binding *b = map_get(&s->map, name);
+    int depth = (s->depth > s->hidden) ? s->depth : 0;
+    while (b && b->depth > depth)
+        b = b->shadowed;
+    return (b && b->depth == depth) ? b->val : NULL;
+}
+
+// Declares a name at a given depth. A redeclaration in the same scope
+// replaces the value. A file-scope name can be declared while it's hidden
+// by block-scope names, in which case the new Binding goes under them.
+static void put(Scope *s, char *name, void *val, int depth) {
+    Binding *above = NULL;
+    Binding *b = map_get(&s->map, name);
+    for (; b && b->depth > depth; b = b->shadowed)
+        above = b;
+    if (b && b->depth == depth) {
+        b->val = val;
+        return;
+    }
+    Binding *r = malloc(sizeof(Binding));
+    r->name = name;
+    r->val = val;
+    r->depth = depth;
+    r->shadowed = b;
+    if (above)
+        above->shadowed = r;
+    else
+        map_put(&s->map, name, r);
+    if (depth > 0)
+        vec_push(&s->log, r);
+}
+
+// Declares a name in the innermost visible scope.
+void scope_put(Scope *s, char *name, void *val) {
+    put(s, name, val, (s->depth > s->hidden) ? s->depth : 0);
+}
+
+void scope_put_global(Scope *s, char *name, void *val) {
+    put(s, name, val, 0);
+}
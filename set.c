@@ -1,48 +1,231 @@
 // Copyright 2014 Rui Ueyama. Released under the MIT license.
 
-// Sets are containers that store unique strings.
+// Sets are containers that store unique strings. The macro expander uses
+// them as hidesets.
+// The strings have to be interned (see intern.c). A set is a sorted array
+// of their intern IDs, so membership is a binary search and union and
+// intersection are linear merges.
+//
+// Sets are hash-consed: there is at most one Set object for a given set of
+// elements, so two sets are equal if and only if they are the same pointer.
+// This makes it cheap to memoize set_union() and set_intersection() by the
+// addresses of their operands. The macro expander computes the same union
+// for every token of a macro body, so nearly all calls hit the memo table.
 //
 // The data structure is functional. Because no destructive
 // operation is defined, it's guranteed that a set will never
 // change once it's created.
 //
 // A null pointer represents an empty set.
-//
-// Set is designed with simplicity in mind.
-// It should be very fast for small number of items.
-// However, if you plan to add a lot of items to a set,
-// you should consider using Map as a set.
 
 #include <stdlib.h>
 #include <string.h>
 #include "8cc.h"
 
-Set *set_add(Set *s, char *v) {
-    Set *r = malloc(sizeof(Set));
-    r->next = s;
-    r->v = v;
+#define INIT_SIZE 256
+
+enum { OP_UNION = 1, OP_INTERSECTION };
+
+typedef struct {
+    Set *a;
+    Set *b;
+    int op;
+    Set *r;
+} Memo;
+
+// Hash-consing table
+static Set **sets;
+static int nsets;
+static int setsize;
+
+// Results of set_union() and set_intersection()
+static Memo *memo;
+static int nmemo;
+static int memosize;
+
+// Scratch space for merging
+static int *tmp;
+static int tmpsize;
+
+static uint32_t hash_ids(int *ids, int len) {
+    uint32_t r = 2166136261;
+    for (int i = 0; i < len; i++) {
+        r ^= ids[i];
+        r *= 16777619;
+    }
+    return r;
+}
+
+static void grow_sets() {
+    int newsize = setsize ? setsize * 2 : INIT_SIZE;
+    Set **tab = calloc(newsize, sizeof(Set *));
+    for (int i = 0; i < setsize; i++) {
+        Set *s = sets[i];
+        if (!s)
+            continue;
+        int j = s->hash & (newsize - 1);
+        while (tab[j])
+            j = (j + 1) & (newsize - 1);
+        tab[j] = s;
+    }
+    sets = tab;
+    setsize = newsize;
+}
+
+// Returns the unique set containing the given sorted IDs.
+static Set *make_set(int *ids, int len) {
+    if (len == 0)
+        return NULL;
+    if (nsets >= setsize / 2)
+        grow_sets();
+    uint32_t h = hash_ids(ids, len);
+    int mask = setsize - 1;
+    int i = h & mask;
+    for (; sets[i]; i = (i + 1) & mask) {
+        Set *s = sets[i];
+        if (s->hash == h && s->len == len && !memcmp(s->ids, ids, len * sizeof(int)))
+            return s;
+    }
+    Set *r = arena_alloc(ARENA_TOKEN, sizeof(Set) + len * sizeof(int));
+    r->len = len;
+    r->hash = h;
+    memcpy(r->ids, ids, len * sizeof(int));
+    sets[i] = r;
+    nsets++;
     return r;
 }
 
+static int *scratch(int len) {
+    if (len > tmpsize) {
+        tmpsize = len * 2;
+        tmp = realloc(tmp, tmpsize * sizeof(int));
+    }
+    return tmp;
+}
+
+static int memo_index(Set *a, Set *b, int op) {
+    uint32_t h = ((uintptr_t)a >> 3) * 2654435761u;
+    h ^= ((uintptr_t)b >> 3) * 40503u + op;
+    return h & (memosize - 1);
+}
+
+static void grow_memo() {
+    Memo *old = memo;
+    int oldsize = memosize;
+    memosize = memosize ? memosize * 2 : INIT_SIZE;
+    memo = calloc(memosize, sizeof(Memo));
+    for (int i = 0; i < oldsize; i++) {
+        if (!old[i].op)
+            continue;
+        int j = memo_index(old[i].a, old[i].b, old[i].op);
+        while (memo[j].op)
+            j = (j + 1) & (memosize - 1);
+        memo[j] = old[i];
+    }
+    free(old);
+}
+
+static Memo *memo_lookup(Set *a, Set *b, int op) {
+    if (nmemo >= memosize / 2)
+        grow_memo();
+    int i = memo_index(a, b, op);
+    for (; memo[i].op; i = (i + 1) & (memosize - 1))
+        if (memo[i].a == a && memo[i].b == b && memo[i].op == op)
+            return &memo[i];
+    return &memo[i];
+}
+
+static void memo_put(Memo *m, Set *a, Set *b, int op, Set *r) {
+    m->a = a;
+    m->b = b;
+    m->op = op;
+    m->r = r;
+    nmemo++;
+}
+
+Set *set_add(Set *s, char *v) {
+    int id = intern_id(v);
+    return set_union(s, make_set(&id, 1));
+}
+
 bool set_has(Set *s, char *v) {
-    for (; s; s = s->next)
-        if (!strcmp(s->v, v))
+    if (!s)
+        return false;
+    int id = intern_id(v);
+    int lo = 0, hi = s->len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (s->ids[mid] == id)
             return true;
+        if (s->ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
     return false;
 }
 
 Set *set_union(Set *a, Set *b) {
-    Set *r = b;
-    for (; a; a = a->next)
-        if (!set_has(b, a->v))
-            r = set_add(r, a->v);
+    if (!a || a == b)
+        return b;
+    if (!b)
+        return a;
+    // Union is commutative, so both orders share one memo entry.
+    if ((uintptr_t)a > (uintptr_t)b) {
+        Set *t = a;
+        a = b;
+        b = t;
+    }
+    Memo *m = memo_lookup(a, b, OP_UNION);
+    if (m->op)
+        return m->r;
+    int *ids = scratch(a->len + b->len);
+    int i = 0, j = 0, n = 0;
+    while (i < a->len && j < b->len) {
+        if (a->ids[i] < b->ids[j])
+            ids[n++] = a->ids[i++];
+        else if (a->ids[i] > b->ids[j])
+            ids[n++] = b->ids[j++];
+        else {
+            ids[n++] = a->ids[i++];
+            j++;
+        }
+    }
+    while (i < a->len)
+        ids[n++] = a->ids[i++];
+    while (j < b->len)
+        ids[n++] = b->ids[j++];
+    Set *r = make_set(ids, n);
+    memo_put(m, a, b, OP_UNION, r);
     return r;
 }
 
 Set *set_intersection(Set *a, Set *b) {
-    Set *r = NULL;
-    for (; a; a = a->next)
-        if (set_has(b, a->v))
-            r = set_add(r, a->v);
+    if (!a || !b)
+        return NULL;
+    if (a == b)
+        return a;
+    if ((uintptr_t)a > (uintptr_t)b) {
+        Set *t = a;
+        a = b;
+        b = t;
+    }
+    Memo *m = memo_lookup(a, b, OP_INTERSECTION);
+    if (m->op)
+        return m->r;
+    int *ids = scratch(a->len < b->len ? a->len : b->len);
+    int i = 0, j = 0, n = 0;
+    while (i < a->len && j < b->len) {
+        if (a->ids[i] < b->ids[j])
+            i++;
+        else if (a->ids[i] > b->ids[j])
+            j++;
+        else {
+            ids[n++] = a->ids[i++];
+            j++;
+        }
+    }
+    Set *r = make_set(ids, n);
+    memo_put(m, a, b, OP_INTERSECTION, r);
     return r;
 }
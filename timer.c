@@ -0,0 +1,166 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Phase timers for -ftime-report
+ *
+ * The phases of the compiler (lexing, macro expansion, parsing and code
+ * generation) and a few hot functions within them call timer_start() and
+ * timer_stop() around their work. The phases are interleaved, because the
+ * parser pulls tokens from the preprocessor, which pulls them from the
+ * lexer, so each interval between two timer events is charged to the
+ * innermost running timer. That is a timer's self time. Its total time is
+ * the time from the outermost start to the matching stop, which includes
+ * the timers nested in it. Recursive calls are counted as calls but
+ * don't add to the total time twice.
+ *
+ * The same intervals are also charged to the input file being read at
+ * the time, so that we can tell which headers are expensive, and the code
+ * generation time of each function is recorded.
+ *
+ * timer_start() and timer_stop() are macros that do nothing unless
+ * -ftime-report is given.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "8cc.h"
+
+#define TOP_N 10
+
+typedef struct {
+    long calls;
+    long self;  // nanoseconds
+    long total; // nanoseconds
+    long start; // start of the outermost running call
+    int depth;  // number of running calls
+} Timer;
+
+typedef struct {
+    char *name;
+    long nsec;
+} Entry;
+
+bool time_report;
+
+static char *timer_names[] = {
+    "lex", "cpp", "parse", "gen",
+    "subst", "expand_all", "try_include", "read_decl", "emit_expr",
+};
+
+static Timer timers[NTIMERS];
+static int stack[1024];
+static int sp;
+static long last;           // time of the last event
+static long gen_start;      // start of the current emit_toplevel()
+static Vector *files = &EMPTY_VECTOR;     // files charged with time
+static Vector *functions = &EMPTY_VECTOR; // Entries of functions emitted
+
+long timer_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Charges the time since the last event to the running timer and the
+// current file.
+static long tick() {
+    long t = timer_now();
+    if (sp > 0) {
+        timers[stack[sp - 1]].self += t - last;
+        File *f = stream_depth() ? current_file() : NULL;
+        if (f && f->name) {
+            if (f->nsec == 0)
+                vec_push(files, f);
+            f->nsec += t - last;
+        }
+    }
+    last = t;
+    return t;
+}
+
+void do_timer_start(int id) {
+    long t = tick();
+    if (sp == sizeof(stack) / sizeof(*stack))
+        error("internal error: timers nested too deeply");
+    stack[sp++] = id;
+    Timer *tm = &timers[id];
+    tm->calls++;
+    if (tm->depth++ == 0)
+        tm->start = t;
+    if (id == TIMER_GEN)
+        gen_start = t;
+}
+
+static void pop(long t) {
+    Timer *tm = &timers[stack[--sp]];
+    if (--tm->depth == 0)
+        tm->total += t - tm->start;
+}
+
+void do_timer_stop(int id) {
+    long t = tick();
+    // Timers whose stop was skipped by longjmp() end here too.
+    while (sp > 0 && stack[sp - 1] != id)
+        pop(t);
+    if (sp > 0)
+        pop(t);
+}
+
+// Records the code generation time of a function. Called right after the
+// function's emit_toplevel() returns.
+void timer_function(char *name) {
+    if (!time_report)
+        return;
+    Entry *e = malloc(sizeof(Entry));
+    e->name = name;
+    e->nsec = last - gen_start;
+    vec_push(functions, e);
+}
+
+static int comp_entry(const void *x, const void *y) {
+    long a = (*(Entry **)x)->nsec;
+    long b = (*(Entry **)y)->nsec;
+    return (a < b) - (a > b);
+}
+
+// Formats nanoseconds as milliseconds. Integer arithmetic is used because
+// 8cc converts only 32-bit integers to floating point correctly.
+static char *ms(long ns) {
+    return format("%ld.%03ld", ns / 1000000, ns / 1000 % 1000);
+}
+
+static void print_top(char *title, Vector *entries) {
+    int n = vec_len(entries);
+    Entry **v = malloc(n * sizeof(Entry *));
+    for (int i = 0; i < n; i++)
+        v[i] = vec_get(entries, i);
+    qsort(v, n, sizeof(Entry *), comp_entry);
+    fprintf(stderr, "time-report: %s\n", title);
+    for (int i = 0; i < n && i < TOP_N; i++)
+        fprintf(stderr, "time-report: %10s  %s\n", ms(v[i]->nsec), v[i]->name);
+}
+
+void print_time_report() {
+    long sum = 0;
+    for (int i = 0; i < NTIMERS; i++)
+        sum += timers[i].self;
+    fprintf(stderr, "time-report: timer             calls    self ms  self%%   total ms\n");
+    for (int i = 0; i < NTIMERS; i++) {
+        Timer *tm = &timers[i];
+        long permille = sum ? tm->self * 1000 / sum : 0;
+        fprintf(stderr, "time-report: %-12s %10ld %10s %3ld.%ld%% %10s\n", timer_names[i],
+                tm->calls, ms(tm->self), permille / 10, permille % 10, ms(tm->total));
+    }
+    fprintf(stderr, "time-report: %-12s %10s %10s\n", "total", "", ms(sum));
+
+    Vector *v = make_vector();
+    for (int i = 0; i < vec_len(files); i++) {
+        File *f = vec_get(files, i);
+        Entry *e = malloc(sizeof(Entry));
+        e->name = f->name;
+        e->nsec = f->nsec;
+        vec_push(v, e);
+    }
+    print_top("slowest files (ms)", v);
+    print_top("slowest functions by code generation (ms)", functions);
+}
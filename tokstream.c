@@ -0,0 +1,314 @@
+// Copyright 2014 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Binary token streams
+ *
+ * "8cc -E --binary" writes the output of the preprocessor as a stream of
+ * tokens rather than as text. When 8cc is later given such a file to
+ * compile, the tokens are handed to the parser as they are, without
+ * lexing or preprocessing them again. That allows preprocessing and
+ * compilation to run at different times or on different machines.
+ *
+ * A stream starts with a magic string, followed by one record per token,
+ * terminated by an EOF token. A record consists of a byte with the token
+ * kind and flags, the file name if it differs from the previous token's,
+ * the line as a delta from the previous token's if it differs, the column
+ * (as a delta too if the line is the same), and the contents of the token.
+ * Numbers are written as variable-length integers, 7 bits per byte.
+ * Identifiers, numbers and file names are stored only once: the first
+ * occurrence of a string is written as its ID followed by the string,
+ * later ones by the ID alone. IDs are assigned from 0 in order of first
+ * occurrence.
+ *
+ * Keywords are written as their IDs, which are specific to a version of
+ * 8cc, so a stream should be read by the same 8cc that wrote it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+#define MAGIC "8cc-tokens-1\n"
+
+// A record starts with a byte holding the token kind in the lower 3 bits
+// and these flags.
+enum {
+    F_SPACE = 8,
+    F_BOL = 16,
+    F_FILE = 32, // the token comes from another file than the previous one
+    F_LINE = 64, // the token is on another line than the previous one
+};
+
+typedef struct {
+    char *p;
+    char *end;
+    Vector *strings;
+    Map *files;
+    jmp_buf fail; // jumped to if the stream is truncated or corrupt
+} Reader;
+
+/*
+ * Writer
+ */
+
+static Map *string_ids;
+static int nstrings;
+
+static void write_uint(Buffer *b, unsigned v) {
+    while (v >= 0x80) {
+        buf_write(b, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buf_write(b, v);
+}
+
+// Signed numbers are zigzag-encoded, so that small negative numbers are
+// small too.
+static void write_int(Buffer *b, int v) {
+    write_uint(b, ((unsigned)v << 1) ^ (v >> 31));
+}
+
+static void write_string(Buffer *b, char *s) {
+    s = intern(s);
+    int id = (intptr_t)map_get(string_ids, s);
+    if (id) {
+        write_uint(b, id - 1);
+        return;
+    }
+    map_put(string_ids, s, (void *)(intptr_t)(nstrings + 1));
+    write_uint(b, nstrings++);
+    write_uint(b, strlen(s));
+    buf_append(b, s, strlen(s));
+}
+
+static void write_tok(Buffer *b, Token *tok, File **file, int *line, int *column) {
+    if (tok->kind == TEOF) {
+        buf_write(b, TEOF);
+        return;
+    }
+    int flags = (tok->space ? F_SPACE : 0) | (tok->bol ? F_BOL : 0);
+    if (tok->file != *file)
+        flags |= F_FILE;
+    if (tok->line != *line)
+        flags |= F_LINE;
+    buf_write(b, tok->kind | flags);
+    if (flags & F_FILE) {
+        *file = tok->file;
+        write_string(b, (tok->file && tok->file->name) ? tok->file->name : "");
+    }
+    if (flags & F_LINE) {
+        write_int(b, tok->line - *line);
+        write_uint(b, tok->column);
+    } else {
+        write_int(b, tok->column - *column);
+    }
+    *line = tok->line;
+    *column = tok->column;
+    switch (tok->kind) {
+    case TIDENT:
+    case TNUMBER:
+        write_string(b, tok->sval);
+        break;
+    case TKEYWORD:
+        write_uint(b, tok->id);
+        break;
+    case TSTRING:
+        write_uint(b, tok->slen);
+        buf_append(b, tok->sval, tok->slen);
+        write_uint(b, tok->enc);
+        break;
+    case TCHAR:
+        write_int(b, tok->c);
+        write_uint(b, tok->enc);
+        break;
+    case TINVALID:
+        write_int(b, tok->c);
+        break;
+    default:
+        error("internal error: cannot serialize token: %s", tok2s(tok));
+    }
+}
+
+// Preprocesses the input and writes the tokens to fp.
+void write_token_stream(FILE *fp) {
+    string_ids = make_interned_map();
+    nstrings = 0;
+    Buffer *b = make_buffer();
+    buf_append(b, MAGIC, strlen(MAGIC));
+    File *file = NULL;
+    int line = 0;
+    int column = 0;
+    for (;;) {
+        Token *tok = read_token();
+        write_tok(b, tok, &file, &line, &column);
+        if (tok->kind == TEOF)
+            break;
+    }
+    if (fwrite(buf_body(b), 1, buf_len(b), fp) != buf_len(b))
+        perror("fwrite");
+}
+
+/*
+ * Reader
+ */
+
+static int read_byte(Reader *r) {
+    if (r->p == r->end)
+        longjmp(r->fail, 1);
+    return (unsigned char)*r->p++;
+}
+
+static unsigned read_uint(Reader *r) {
+    unsigned v = 0;
+    for (int shift = 0; shift < 32; shift += 7) {
+        int c = read_byte(r);
+        v |= (unsigned)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return v;
+    }
+    longjmp(r->fail, 1);
+}
+
+static int read_int(Reader *r) {
+    unsigned v = read_uint(r);
+    return (v >> 1) ^ -(v & 1);
+}
+
+static char *read_bytes(Reader *r, unsigned n) {
+    if (r->end - r->p < n)
+        longjmp(r->fail, 1);
+    char *p = r->p;
+    r->p += n;
+    return p;
+}
+
+static char *read_string(Reader *r) {
+    unsigned id = read_uint(r);
+    if (id < vec_len(r->strings))
+        return vec_get(r->strings, id);
+    if (id != vec_len(r->strings))
+        longjmp(r->fail, 1);
+    unsigned len = read_uint(r);
+    char *s = intern_len(read_bytes(r, len), len);
+    vec_push(r->strings, s);
+    return s;
+}
+
+static File *read_file(Reader *r) {
+    char *name = read_string(r);
+    File *f = map_get(r->files, name);
+    if (!f) {
+        f = make_file_tokens(*name ? name : NULL, 0);
+        map_put(r->files, name, f);
+    }
+    return f;
+}
+
+static Token *read_tok(Reader *r, File **file, int *line, int *column) {
+    Token *tok = arena_alloc(ARENA_TOKEN, sizeof(Token));
+    int flags = read_byte(r);
+    tok->kind = flags & 7;
+    if (tok->kind == TEOF)
+        return tok;
+    tok->space = flags & F_SPACE;
+    tok->bol = flags & F_BOL;
+    if (flags & F_FILE)
+        *file = read_file(r);
+    tok->file = *file;
+    if (flags & F_LINE) {
+        *line += read_int(r);
+        *column = read_uint(r);
+    } else {
+        *column += read_int(r);
+    }
+    tok->line = *line;
+    tok->column = *column;
+    switch (tok->kind) {
+    case TIDENT:
+    case TNUMBER:
+        tok->sval = read_string(r);
+        break;
+    case TKEYWORD:
+        tok->id = read_uint(r);
+        break;
+    case TSTRING:
+        tok->slen = read_uint(r);
+        tok->sval = arena_alloc(ARENA_STRING, tok->slen);
+        memcpy(tok->sval, read_bytes(r, tok->slen), tok->slen);
+        tok->enc = read_uint(r);
+        break;
+    case TCHAR:
+        tok->c = read_int(r);
+        tok->enc = read_uint(r);
+        break;
+    case TINVALID:
+        tok->c = read_int(r);
+        break;
+    default:
+        longjmp(r->fail, 1);
+    }
+    return tok;
+}
+
+static bool is_token_stream(FILE *fp) {
+    char buf[sizeof(MAGIC) - 1];
+    bool r = fread(buf, 1, sizeof(buf), fp) == sizeof(buf)
+        && !memcmp(buf, MAGIC, sizeof(buf));
+    rewind(fp);
+    return r;
+}
+
+// Returns a File to read the main input file from. If it's a token stream,
+// the File replays its tokens, and read_token() returns them without
+// preprocessing them again. Otherwise it's an ordinary source file.
+File *tokstream_open(FILE *fp, char *name) {
+    if (!is_token_stream(fp))
+        return make_file(fp, name);
+    Buffer *b = make_buffer();
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        buf_append(b, buf, n);
+    fclose(fp);
+
+    File *f = make_file_tokens(name, 0);
+    f->preprocessed = true;
+    Reader r = { buf_body(b) + strlen(MAGIC), buf_body(b) + buf_len(b) };
+    r.strings = make_vector();
+    r.files = make_interned_map();
+    if (setjmp(r.fail))
+        error("%s: broken token stream", name);
+    File *file = NULL;
+    int line = 0;
+    int column = 0;
+    for (;;) {
+        Token *tok = read_tok(&r, &file, &line, &column);
+        if (tok->kind == TEOF)
+            break;
+        vec_push(f->tokens, tok);
+    }
+    return f;
+}
+
+/*
+ * Compiler contexts
+ */
+
+typedef struct {
+    Map *string_ids;
+    int nstrings;
+} TokstreamState;
+
+void *tokstream_save_state() {
+    TokstreamState *s = malloc(sizeof(TokstreamState));
+    s->string_ids = string_ids;
+    s->nstrings = nstrings;
+    return s;
+}
+
+// NULL is the state before write_token_stream() is called.
+void tokstream_restore_state(void *state) {
+    TokstreamState *s = state ? state : &(TokstreamState){};
+    string_ids = s->string_ids;
+    nstrings = s->nstrings;
+}
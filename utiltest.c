@@ -1,10 +1,13 @@
 // Copyright 2012 Rui Ueyama. Released under the MIT license.
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "8cc.h"
 
-char *get_base_file(void) { return NULL; }
-
 #define assert_true(expr) assert_true2(__LINE__, #expr, (expr))
 #define assert_null(...) assert_null2(__LINE__, __VA_ARGS__)
 #define assert_string(...) assert_string2(__LINE__, __VA_ARGS__)
@@ -43,6 +46,22 @@ static void test_buf() {
     assert_string(".0123456789", buf_body(b2));
 }
 
+static void test_arena() {
+    char *p = arena_alloc(ARENA_STRING, 3);
+    char *q = arena_alloc(ARENA_STRING, 5);
+    assert_int(0, (intptr_t)p % 8);
+    assert_int(0, (intptr_t)q % 8);
+    assert_true(p != q);
+    for (int i = 0; i < 5; i++)
+        assert_int(0, q[i]);
+
+    // Large objects don't fit in a chunk and are allocated separately.
+    char *big = arena_alloc(ARENA_STRING, 1024 * 1024);
+    assert_int(0, big[1024 * 1024 - 1]);
+    char *r = arena_alloc(ARENA_STRING, 1);
+    assert_true(r == q + 8);
+}
+
 static void test_list() {
     Vector *list = make_vector();
     assert_int(0, vec_len(list));
@@ -118,6 +137,38 @@ static void test_map_stack() {
     assert_int(1, (int)(intptr_t)map_get(m1, "x"));
 }
 
+static void test_scope() {
+    Scope *s = make_scope();
+    char *x = intern("x"), *y = intern("y");
+    scope_put(s, x, (void *)1);
+    scope_enter(s);
+    assert_int(1, (int)(intptr_t)scope_get(s, x));
+    scope_put(s, x, (void *)2);
+    scope_put(s, y, (void *)3);
+    scope_enter(s);
+    scope_put(s, x, (void *)4);
+    assert_int(4, (int)(intptr_t)scope_get(s, x));
+    assert_int(4, (int)(intptr_t)scope_get_local(s, x));
+    assert_null(scope_get_local(s, y));
+
+    // Hidden block scopes.
+    s->hidden = s->depth;
+    assert_int(1, (int)(intptr_t)scope_get(s, x));
+    assert_null(scope_get(s, y));
+    scope_put(s, y, (void *)5);
+    s->hidden = 0;
+    assert_int(3, (int)(intptr_t)scope_get(s, y));
+
+    scope_leave(s);
+    assert_int(2, (int)(intptr_t)scope_get(s, x));
+    scope_put_global(s, x, (void *)6);
+    assert_int(2, (int)(intptr_t)scope_get(s, x));
+    scope_leave(s);
+    assert_int(6, (int)(intptr_t)scope_get(s, x));
+    assert_int(5, (int)(intptr_t)scope_get(s, y));
+    assert_int(0, s->depth);
+}
+
 static void test_dict() {
     Dict *dict = make_dict();
     assert_null(dict_get(dict, "abc"));
@@ -129,22 +180,81 @@ static void test_dict() {
 }
 
 static void test_set() {
+    char *abc = intern("abc"), *def = intern("def"), *DEF = intern("DEF");
     Set *s = NULL;
-    assert_int(0, set_has(s, "abc"));
-    s = set_add(s, "abc");
-    s = set_add(s, "def");
-    assert_int(1, set_has(s, "abc"));
-    assert_int(1, set_has(s, "def"));
-    assert_int(0, set_has(s, "xyz"));
+    assert_int(0, set_has(s, abc));
+    s = set_add(s, abc);
+    s = set_add(s, def);
+    assert_int(1, set_has(s, abc));
+    assert_int(1, set_has(s, def));
+    assert_int(0, set_has(s, intern("xyz")));
     Set *t = NULL;
-    t = set_add(t, "abc");
-    t = set_add(t, "DEF");
-    assert_int(1, set_has(set_union(s, t), "abc"));
-    assert_int(1, set_has(set_union(s, t), "def"));
-    assert_int(1, set_has(set_union(s, t), "DEF"));
-    assert_int(1, set_has(set_intersection(s, t), "abc"));
-    assert_int(0, set_has(set_intersection(s, t), "def"));
-    assert_int(0, set_has(set_intersection(s, t), "DEF"));
+    t = set_add(t, abc);
+    t = set_add(t, DEF);
+    assert_int(1, set_has(set_union(s, t), abc));
+    assert_int(1, set_has(set_union(s, t), def));
+    assert_int(1, set_has(set_union(s, t), DEF));
+    assert_int(1, set_has(set_intersection(s, t), abc));
+    assert_int(0, set_has(set_intersection(s, t), def));
+    assert_int(0, set_has(set_intersection(s, t), DEF));
+
+    // Sets are hash-consed
+    assert_true(s == set_add(set_add(NULL, def), abc));
+    assert_true(s == set_add(s, abc));
+    assert_true(set_union(s, t) == set_union(t, s));
+    assert_true(set_intersection(s, t) == set_add(NULL, abc));
+    assert_null(set_intersection(s, set_add(NULL, intern("xyz"))));
+}
+
+static void test_intern() {
+    char buf[] = "abcdef";
+    char *p = intern("abc");
+    assert_string("abc", p);
+    assert_true(p == intern("abc"));
+    assert_true(p == intern_len(buf, 3));
+    assert_true(p != intern("abcdef"));
+    assert_true(intern_hash(p) == intern_hash(intern_len(buf, 3)));
+
+    // Enough strings to make the table grow
+    for (int i = 0; i < 10000; i++)
+        assert_true(intern(format("%d", i)) == intern(format("%d", i)));
+    assert_true(p == intern("abc"));
+}
+
+static void test_map_interned() {
+    Map *m = make_interned_map();
+    for (int i = 0; i < 1000; i++)
+        map_put(m, intern(format("%d", i)), (void *)(intptr_t)i);
+    for (int i = 0; i < 1000; i++)
+        assert_int(i, (intptr_t)map_get(m, intern(format("%d", i))));
+    map_remove(m, intern("5"));
+    assert_null(map_get(m, intern("5")));
+
+    Map *m2 = make_map_parent(m);
+    assert_true(m2->interned);
+    assert_int(7, (intptr_t)map_get(m2, intern("7")));
+}
+
+static void test_map_churn() {
+    // Removing and inserting keys over and over leaves tombstones, which
+    // must be reused or cleaned up by rehashing rather than fill the map.
+    Map *m = make_map();
+    for (int i = 0; i < 100000; i++) {
+        map_put(m, format("%d", i), (void *)(intptr_t)(i + 1));
+        if (i >= 100)
+            map_remove(m, format("%d", i - 100));
+    }
+    assert_int(100, map_len(m));
+    assert_true(m->size <= 256);
+    for (int i = 0; i < 100000; i++)
+        assert_int(i < 99900 ? 0 : i + 1, (intptr_t)map_get(m, format("%d", i)));
+
+    // The hash reads 8 bytes at a time. Strings that differ only in their
+    // last few bytes or only in their length must still hash differently.
+    assert_true(hash_bytes("abcdefgh", 8) == hash_bytes("abcdefghij", 8));
+    assert_true(hash_bytes("abcdefghi", 9) != hash_bytes("abcdefghj", 9));
+    assert_true(hash_bytes("abc\0", 3) != hash_bytes("abc\0", 4));
+    assert_true(hash_bytes("", 0) != hash_bytes("\0", 1));
 }
 
 static void test_path() {
@@ -172,15 +282,307 @@ static void test_file() {
     assert_true(readc() < 0);
 }
 
+static Token *read_macro(char *name) {
+    stream_push(make_file_string(name));
+    Token *tok = read_token();
+    stream_pop();
+    return tok;
+}
+
+static void test_context() {
+    CompilerContext *a = make_context();
+    CompilerContext *b = make_context();
+    enter_context(a);
+    lex_init();
+    read_from_string("#define X 1");
+    leave_context();
+    enter_context(b);
+    lex_init();
+    read_from_string("#define X 2");
+    assert_string("2", read_macro("X")->sval);
+    leave_context();
+    enter_context(a);
+    assert_string("1", read_macro("X")->sval);
+    diagnostics = make_vector();
+    leave_context();
+    assert_true(diagnostics == NULL);
+    lex_init();
+    assert_int(TIDENT, read_macro("X")->kind);
+}
+
+static void test_compile_string() {
+    Buffer *b = make_buffer();
+    Vector *diags = make_vector();
+    assert_true(compile_string("t.c", "int f(int x) { return x + 1; }", OUTPUT_ASM, b, diags));
+    buf_write(b, '\0');
+    assert_true(strstr(buf_body(b), "f:") != NULL);
+    assert_int(0, vec_len(diags));
+
+    b = make_buffer();
+    assert_true(compile_string("t.c", "int f(int x) { return x + 1; }", OUTPUT_OBJ, b, diags));
+    assert_true(!memcmp(buf_body(b) + 1, "ELF", 3));
+
+    b = make_buffer();
+    assert_true(!compile_string("t.c", "int g() { return x; }", OUTPUT_ASM, b, diags));
+    assert_int(0, buf_len(b));
+    assert_int(1, vec_len(diags));
+    Diagnostic *d = vec_get(diags, 0);
+    assert_true(d->error);
+    assert_true(!strncmp(d->pos, "t.c:1:", 6));
+    assert_string("undefined variable: x", d->msg);
+}
+
+// Returns the number of memory mappings of files whose path contains name.
+static int count_mappings(char *name) {
+    FILE *fp = fopen("/proc/self/maps", "r");
+    char line[512];
+    int r = 0;
+    while (fgets(line, sizeof(line), fp))
+        if (strstr(line, name))
+            r++;
+    fclose(fp);
+    return r;
+}
+
+static void *compile_thread(void *arg) {
+    intptr_t n = (intptr_t)arg;
+    for (int i = 0; i < 20; i++) {
+        Buffer *b = make_buffer();
+        char *src = format("#include <stddef.h>\nsize_t f%ld(size_t x) { return x + %d; }", n, i);
+        if (!compile_string("t.c", src, OUTPUT_ASM, b, make_vector()))
+            return NULL;
+        buf_write(b, '\0');
+        if (!strstr(buf_body(b), format("f%ld:", n)))
+            return NULL;
+    }
+    return arg;
+}
+
+static void test_compile_threads() {
+    // Compilations on several threads don't interfere.
+    pthread_t th[4];
+    for (intptr_t i = 0; i < 4; i++)
+        pthread_create(&th[i], NULL, compile_thread, (void *)(i + 1));
+    for (intptr_t i = 0; i < 4; i++) {
+        void *r;
+        pthread_join(th[i], &r);
+        assert_int(i + 1, (intptr_t)r);
+    }
+}
+
+static void test_unmap() {
+    // Headers are unmapped when they have been read, and when the
+    // compilation ends, even in the middle of a header.
+    char *path = format("/tmp/8cc-utiltest-%d.h", getpid());
+    FILE *fp = fopen(path, "w");
+    fprintf(fp, "int x = y;\n");
+    fclose(fp);
+    Vector *diags = make_vector();
+    for (int i = 0; i < 3; i++) {
+        assert_true(compile_string("t.c", "#include <stddef.h>\n", OUTPUT_ASM, make_buffer(), diags));
+        assert_true(!compile_string("t.c", format("#include \"%s\"\n", path), OUTPUT_ASM,
+                                    make_buffer(), diags));
+    }
+    assert_int(0, count_mappings("stddef.h"));
+    assert_int(0, count_mappings(path));
+    unlink(path);
+}
+
+// Compiles src at -O1 and returns the assembly.
+static char *compile_opt(char *src) {
+    Buffer *b = make_buffer();
+    int level = optimize_level;
+    optimize_level = 1;
+    assert_true(compile_string("t.c", src, OUTPUT_ASM, b, make_vector()));
+    optimize_level = level;
+    buf_write(b, '\0');
+    return buf_body(b);
+}
+
+static void test_fold_float() {
+    assert_true(strstr(compile_opt("int f() { return 0.1f > 0.1; }"), "mov $1, %rax") != NULL);
+    assert_true(strstr(compile_opt("int f() { return (double)0.1f == 0.1; }"), "mov $0, %rax") != NULL);
+}
+
+// a[idx(5)] is shared by both sides of "a[idx(5)] = a[idx(5)] + 7".
+// Inlining the call there would define the same labels twice.
+static void test_inline_shared() {
+    char *s = compile_opt("static int idx(int i) { return i & 3; }\n"
+                          "int a[4];\n"
+                          "int main() { a[idx(5)] += 7; }\n");
+    Map *labels = make_map();
+    for (char *p = strtok(s, "\n"); p; p = strtok(NULL, "\n")) {
+        p += strspn(p, "\t ");
+        if (p[0] != '.' || p[strlen(p) - 1] != ':')
+            continue;
+        assert_true(!map_get(labels, p));
+        map_put(labels, p, p);
+    }
+}
+
+static void test_tokstream() {
+    CompilerContext *ctx = make_context();
+    enter_context(ctx);
+    lex_init();
+    cpp_init();
+    FILE *fp = tmpfile();
+    File *f = make_file_string("#define N 42\nint x = N;\n\"s\\0t\" 'c'\n");
+    f->name = "t.c";
+    stream_push(f);
+    write_token_stream(fp);
+    stream_pop();
+
+    rewind(fp);
+    stream_push(tokstream_open(fp, "t.tok"));
+    assert_int(TKEYWORD, read_token()->kind);
+    Token *tok = read_token();
+    assert_string("x", tok->sval);
+    assert_string("t.c", tok->file->name);
+    assert_int(2, tok->line);
+    assert_int(5, tok->column);
+    assert_int('=', read_token()->id);
+    assert_string("42", read_token()->sval);
+    assert_int(';', read_token()->id);
+    tok = read_token();
+    assert_int(4, tok->slen);
+    assert_true(!memcmp("s\0t", tok->sval, 4));
+    assert_true(tok->bol);
+    assert_int('c', read_token()->c);
+    assert_int(TEOF, read_token()->kind);
+    leave_context();
+}
+
+static void test_node2s() {
+    Node *one = &(Node){ AST_LITERAL, type_int, .ival = 1 };
+    Node *two = &(Node){ AST_LITERAL, type_int, .ival = 2 };
+    Node *x = &(Node){ AST_LVAR, type_int, .varname = "x" };
+    Node *sum = &(Node){ '+', type_int, .left = one, .right = two };
+    assert_string("(* (+ 1 2) lv=x)", node2s(&(Node){ '*', type_int, .left = sum, .right = x }));
+    assert_string("(conv lv=x=>long)", node2s(&(Node){ AST_CONV, type_long, .operand = x }));
+
+    // A call through a function pointer prints the pointer, not the call.
+    Node *f = &(Node){ AST_LVAR, type_int, .varname = "f" };
+    Node *call = &(Node){ AST_FUNCPTR_CALL, type_int, .fptr = f, .args = make_vector1(one) };
+    assert_string("(int)lv=f(1)", node2s(call));
+
+    // Deep expressions are formatted in linear time.
+    Node *e = one;
+    for (int i = 0; i < 10000; i++) {
+        Node *n = malloc(sizeof(Node));
+        *n = (Node){ '+', type_int, .left = e, .right = two };
+        e = n;
+    }
+    assert_int(10000 * 6 + 1, strlen(node2s(e)));
+}
+
+static void test_peephole() {
+    // A load whose result is dead stays; the memory may be volatile.
+    assert_true(strstr(compile_opt("void f(volatile long *p) { *p; p = 0; }"), "(%rax), %rax") != NULL);
+
+    // Arguments pushed and popped into place become moves.
+    char *s = compile_opt("int g(int, int);\nint f(int a, int b) { return g(a + 1, b * 2); }");
+    assert_true(strstr(s, "\tpop") == NULL);
+    assert_true(strstr(s, "mov %rax, %rdi") != NULL);
+
+    // A load of the slot just stored reuses the stored register.
+    s = compile_opt("long f(long a) { long x = a; return x + 1; }");
+    assert_true(strstr(s, "mov %rax, -16(%rbp)") != NULL);
+    assert_true(strstr(s, "-16(%rbp), %rax") == NULL);
+
+    // A store to a slot that is never read is removed.
+    s = compile_opt("long f(long a) { long b = a, c = 0, x = 1; return b; }");
+    assert_true(strstr(s, "-16(%rbp), %rax") != NULL);
+    assert_true(strstr(s, "-32(%rbp)") == NULL);
+
+    // A RIP-relative operand reads no register, so %rax is dead here.
+    s = compile_opt("void *p;\nint g(void *, char *);\nint f(void) { return g(p, \"x\"); }");
+    assert_true(strstr(s, "(%rip), %rsi") != NULL);
+}
+
+// Compiles src and returns the assembly.
+static char *compile_asm(char *src) {
+    Buffer *b = make_buffer();
+    assert_true(compile_string("t.c", src, OUTPUT_ASM, b, make_vector()));
+    buf_write(b, '\0');
+    return buf_body(b);
+}
+
+static void test_global_init() {
+    // A literal of type long needs no conversion node.
+    assert_true(strstr(compile_asm("long x = 5L;"), ".quad 5") != NULL);
+    assert_true(strstr(compile_asm("char *p = 0L;"), ".quad 0") != NULL);
+
+    // Members after padding are placed at their offsets.
+    char *s = compile_asm("struct { char c; long l; char d; } s = { 1, 2, 3 };");
+    assert_true(strstr(s, ".quad 2\n\t.byte 3\n") != NULL);
+    s = compile_asm("struct { char a; int b; } t[2] = { { 1, 2 }, { 3, 4 } };");
+    assert_true(strstr(s, ".long 2\n\t.byte 3\n") != NULL);
+}
+
+static void test_pointer_diff() {
+    // p - q is the difference of the subscripts, so it's divided by the
+    // element size unless that is 1.
+    assert_true(strstr(compile_asm("long f(int *p, int *q) { return p - q; }"), "idiv") != NULL);
+    assert_true(strstr(compile_asm("long f(char *p, char *q) { return p - q; }"), "idiv") == NULL);
+}
+
+// Writes s to the file at path and sets its modification time.
+static void write_header(char *path, char *s, long sec, long nsec) {
+    FILE *fp = fopen(path, "w");
+    fputs(s, fp);
+    fclose(fp);
+    struct timespec ts[2] = { { sec, nsec }, { sec, nsec } };
+    utimensat(AT_FDCWD, path, ts, 0);
+}
+
+static void test_hcache() {
+    // A header that changes within the same second, or is replaced by
+    // another file, is not read from the cache.
+    char *dir = format("/tmp/8cc-utiltest-%d", getpid());
+    char *path = format("%s.h", dir);
+    char *src = format("#include \"%s\"\n", path);
+    header_cache_dir = dir;
+    write_header(path, "int a = 1;\n", 1000000000, 1);
+    assert_true(strstr(compile_asm(src), "a:") != NULL);
+    assert_true(strstr(compile_asm(src), "a:") != NULL);
+    write_header(path, "int b = 1;\n", 1000000000, 2);
+    assert_true(strstr(compile_asm(src), "b:") != NULL);
+
+    char *tmp = format("%s.tmp", dir);
+    write_header(tmp, "int c = 1;\n", 1000000000, 2);
+    rename(tmp, path);
+    assert_true(strstr(compile_asm(src), "c:") != NULL);
+    header_cache_dir = NULL;
+    unlink(path);
+    system(format("rm -rf %s", dir));
+}
+
 int main(int argc, char **argv) {
     test_buf();
+    test_arena();
     test_list();
     test_map();
     test_map_stack();
+    test_map_interned();
+    test_map_churn();
+    test_scope();
     test_dict();
     test_set();
+    test_intern();
     test_path();
     test_file();
+    test_context();
+    test_node2s();
+    test_global_init();
+    test_pointer_diff();
+    test_hcache();
+    test_compile_string();
+    test_unmap();
+    test_compile_threads();
+    test_tokstream();
+    test_fold_float();
+    test_inline_shared();
+    test_peephole();
     printf("Passed\n");
     return 0;
 }